@@ -0,0 +1,306 @@
+#include "addressracer.h"
+#include <QDebug>
+#include <QThread>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#define ATTEMPT_DELAY_MS 250 // RFC 8305 recommends 250 ms between connection attempts.
+
+AddressRacer::AddressRacer(QObject *parent)
+    : QObject{parent}
+{
+    staggerTimer = new QTimer(this);
+    staggerTimer->setSingleShot(true);
+    staggerTimer->setInterval(ATTEMPT_DELAY_MS);
+    connect(staggerTimer, &QTimer::timeout, this, &AddressRacer::startNextAttempt);
+}
+
+AddressRacer::~AddressRacer()
+{
+    abort();
+}
+
+///
+/// \brief AddressRacer::start resolves host and races its addresses.
+/// Reports the connected socket with won(), the caller owns it from then on.
+///
+void AddressRacer::start(const QString &host, quint16 port)
+{
+    abort();
+    int current = generation;
+    auto result = std::make_shared<QList<Address>>();
+    auto error = std::make_shared<QString>();
+    QByteArray name = host.toUtf8();
+    QByteArray service = QByteArray::number(port);
+
+    // getaddrinfo blocks, it gets a thread of its own so the connect stays cancellable.
+    QThread *resolver = QThread::create([name, service, result, error]() {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        addrinfo *list = nullptr;
+        int rc = getaddrinfo(name.constData(), service.constData(), &hints, &list);
+        if (rc != 0 || !list)
+        {
+            *error = QString("Could not resolve %1: %2").arg(QString::fromUtf8(name), gai_strerror(rc));
+            return;
+        }
+
+        // Alternate the families, starting with the one the resolver prefers.
+        QList<Address> preferred;
+        QList<Address> other;
+        int preferredFamily = list->ai_family;
+        for (addrinfo *info = list; info; info = info->ai_next)
+        {
+            Address address;
+            memcpy(&address.storage, info->ai_addr, info->ai_addrlen);
+            address.length = static_cast<socklen_t>(info->ai_addrlen);
+            (info->ai_family == preferredFamily ? preferred : other).append(address);
+        }
+        freeaddrinfo(list);
+        for (int i = 0; i < std::max(preferred.size(), other.size()); i++)
+        {
+            if (i < preferred.size())
+            {
+                result->append(preferred.at(i));
+            }
+            if (i < other.size())
+            {
+                result->append(other.at(i));
+            }
+        }
+    });
+    connect(resolver, &QThread::finished, this, [this, current, result, error]() {
+        onResolved(current, *result, *error);
+    });
+    connect(resolver, &QThread::finished, resolver, &QObject::deleteLater);
+    resolver->start();
+}
+
+///
+/// \brief AddressRacer::abort closes every attempt and ignores a resolve still running.
+///
+void AddressRacer::abort()
+{
+    generation++;
+    staggerTimer->stop();
+    while (!attempts.isEmpty())
+    {
+        closeAttempt(0);
+    }
+    addresses.clear();
+    nextAddress = 0;
+    lastError.clear();
+}
+
+void AddressRacer::onResolved(int generation, const QList<Address> &resolved, const QString &error)
+{
+    if (generation != this->generation)
+    {
+        // Aborted or restarted while resolving.
+        return;
+    }
+    if (resolved.isEmpty())
+    {
+        emit failed(error.isEmpty() ? QString("No address to connect to.") : error);
+        return;
+    }
+    addresses = resolved;
+    emit this->resolved(addresses.size());
+    startNextAttempt();
+}
+
+///
+/// \brief AddressRacer::startNextAttempt starts connecting to the next address, leaving the
+/// attempts already running alone.
+///
+void AddressRacer::startNextAttempt()
+{
+    while (nextAddress < addresses.size())
+    {
+        const Address &address = addresses.at(nextAddress++);
+        QString name = addressString(address);
+        socket_t fd = socket(address.storage.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd == SSH_INVALID_SOCKET)
+        {
+            int code = lastSocketError();
+            lastError = QString("Could not create a socket for %1: %2").arg(name, socketError(code));
+            continue;
+        }
+
+#ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(fd, FIONBIO, &nonBlocking);
+        int rc = ::connect(fd, reinterpret_cast<const sockaddr*>(&address.storage), address.length);
+        int code = rc != 0 ? lastSocketError() : 0;
+        bool pending = rc == 0 || code == WSAEWOULDBLOCK;
+#else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        int rc = ::connect(fd, reinterpret_cast<const sockaddr*>(&address.storage), address.length);
+        int code = rc != 0 ? lastSocketError() : 0;
+        bool pending = rc == 0 || code == EINPROGRESS;
+#endif
+        if (!pending)
+        {
+            lastError = QString("Connecting to %1 failed: %2").arg(name, socketError(code));
+            closeSocket(fd);
+            continue;
+        }
+
+        // Writable means connected or failed, SO_ERROR tells which. A connect that finished
+        // right away (loopback) is writable at once and wins the same way.
+        QSocketNotifier *notifier = new QSocketNotifier(fd, QSocketNotifier::Write, this);
+        connect(notifier, &QSocketNotifier::activated, this, [this, fd]() {
+            onAttemptReady(fd);
+        });
+        QSocketNotifier *failNotifier = nullptr;
+#ifdef _WIN32
+        failNotifier = new QSocketNotifier(fd, QSocketNotifier::Exception, this);
+        connect(failNotifier, &QSocketNotifier::activated, this, [this, fd]() {
+            onAttemptReady(fd);
+        });
+#endif
+        attempts.append({fd, name, notifier, failNotifier});
+        qDebug() << "Racing connection to" << name;
+        staggerTimer->start();
+        return;
+    }
+    finishIfExhausted();
+}
+
+void AddressRacer::onAttemptReady(socket_t fd)
+{
+    int index = -1;
+    for (int i = 0; i < attempts.size(); i++)
+    {
+        if (attempts.at(i).fd == fd)
+        {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1)
+    {
+        return;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length) != 0)
+    {
+        // Otherwise error stays 0 and a socket in an unknown state would win.
+        error = lastSocketError();
+    }
+    if (error != 0)
+    {
+        lastError = QString("Connecting to %1 failed: %2").arg(attempts.at(index).address, socketError(error));
+        closeAttempt(index);
+        // No point waiting out the delay, the next address can go now.
+        staggerTimer->stop();
+        startNextAttempt();
+        return;
+    }
+
+    Attempt winner = attempts.takeAt(index);
+    dropNotifiers(winner);
+    staggerTimer->stop();
+    while (!attempts.isEmpty())
+    {
+        closeAttempt(0);
+    }
+    qDebug() << "Connected to" << winner.address;
+    emit won(winner.fd, winner.address);
+}
+
+void AddressRacer::closeAttempt(int index)
+{
+    Attempt attempt = attempts.takeAt(index);
+    dropNotifiers(attempt);
+    closeSocket(attempt.fd);
+}
+
+void AddressRacer::dropNotifiers(const Attempt &attempt)
+{
+    // Possibly called from their own activated() signal, so not deleted right away.
+    for (QSocketNotifier *notifier : {attempt.notifier, attempt.failNotifier})
+    {
+        if (notifier)
+        {
+            notifier->setEnabled(false);
+            notifier->deleteLater();
+        }
+    }
+}
+
+void AddressRacer::finishIfExhausted()
+{
+    if (attempts.isEmpty() && nextAddress >= addresses.size())
+    {
+        emit failed(lastError.isEmpty() ? QString("No address to connect to.") : lastError);
+    }
+}
+
+QString AddressRacer::addressString(const Address &address)
+{
+    char buffer[INET6_ADDRSTRLEN] = {};
+    if (address.storage.ss_family == AF_INET6)
+    {
+        const sockaddr_in6 *in6 = reinterpret_cast<const sockaddr_in6*>(&address.storage);
+        inet_ntop(AF_INET6, &in6->sin6_addr, buffer, sizeof(buffer));
+        return QString("[%1]").arg(buffer);
+    }
+    const sockaddr_in *in = reinterpret_cast<const sockaddr_in*>(&address.storage);
+    inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer));
+    return QString(buffer);
+}
+
+void AddressRacer::closeSocket(socket_t fd)
+{
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+///
+/// \brief AddressRacer::lastSocketError returns the error code of the socket call that just failed.
+/// Read it before anything else, closing a socket or logging may overwrite it.
+///
+int AddressRacer::lastSocketError()
+{
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+///
+/// \brief AddressRacer::socketError describes an error code of the socket API, a Winsock
+/// code on Windows and an errno value elsewhere.
+///
+QString AddressRacer::socketError(int code)
+{
+#ifdef _WIN32
+    wchar_t *buffer = nullptr;
+    DWORD length = FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                                  nullptr, code, 0, reinterpret_cast<LPWSTR>(&buffer), 0, nullptr);
+    QString message = length > 0 ? QString::fromWCharArray(buffer, length).trimmed() : QString("Winsock error %1").arg(code);
+    LocalFree(buffer);
+    return message;
+#else
+    return QString::fromLocal8Bit(strerror(code));
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef ADDRESSRACER_H
+#define ADDRESSRACER_H
+
+#include <QObject>
+#include <QList>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSocketNotifier>
+#include <libssh/libssh.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+///
+/// \brief The AddressRacer class opens a TCP connection to a host the happy eyeballs way (RFC 8305).
+/// Addresses are resolved off thread, ordered alternating IPv6 and IPv4, and a new attempt starts
+/// every 250 ms, or as soon as the previous one fails, while earlier attempts keep running. The
+/// first socket to connect wins and the others are closed. A stale address therefore costs a
+/// quarter of a second instead of a full TCP timeout.
+///
+class AddressRacer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AddressRacer(QObject *parent = nullptr);
+    ~AddressRacer();
+
+    void start(const QString &host, quint16 port);
+    void abort();
+
+signals:
+    void resolved(int addressCount);
+    void won(socket_t fd, const QString &address);
+    void failed(const QString &message);
+
+private slots:
+    void startNextAttempt();
+
+private:
+    struct Address {
+        sockaddr_storage storage;
+        socklen_t length;
+    };
+    struct Attempt {
+        socket_t fd;
+        QString address;
+        QSocketNotifier *notifier;
+        QSocketNotifier *failNotifier; // Windows reports a failed connect as an exception, nullptr elsewhere.
+    };
+
+    QList<Address> addresses;
+    QList<Attempt> attempts;
+    QTimer *staggerTimer;
+    int nextAddress = 0;
+    int generation = 0;
+    QString lastError;
+
+    void onResolved(int generation, const QList<Address> &resolved, const QString &error);
+    void onAttemptReady(socket_t fd);
+    void closeAttempt(int index);
+    void finishIfExhausted();
+    static QString addressString(const Address &address);
+    static void closeSocket(socket_t fd);
+    static void dropNotifiers(const Attempt &attempt);
+    static int lastSocketError();
+    static QString socketError(int code);
+};
+
+#endif // ADDRESSRACER_H
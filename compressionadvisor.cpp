@@ -0,0 +1,165 @@
+#include "compressionadvisor.h"
+#include <QDebug>
+#include <QSettings>
+#include <algorithm>
+
+#define DEFAULT_LEVEL 6
+// Weight of a new sample in the running averages.
+#define SAMPLE_WEIGHT 0.3
+
+namespace {
+// Rough zlib throughput per level on one core and its ratio relative to level 6.
+struct LevelCost {
+    int level;
+    double bytesPerSecond;
+    double relativeRatio;
+};
+const LevelCost LEVEL_COSTS[] = {
+    {1, 60e6, 0.85},
+    {6, 20e6, 1.0},
+    {9, 8e6, 1.05},
+};
+}
+
+CompressionAdvisor::CompressionAdvisor(const QString &connectionName)
+    : group("compression/" + connectionName)
+{
+    load();
+}
+
+void CompressionAdvisor::load()
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    linkBandwidth = settings.value("linkBandwidth", 0).toDouble();
+    effectiveBandwidth = settings.value("effectiveBandwidth", 0).toDouble();
+    ratio = settings.value("ratio", 0).toDouble();
+    settings.endGroup();
+}
+
+void CompressionAdvisor::save()
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    settings.setValue("linkBandwidth", linkBandwidth);
+    settings.setValue("effectiveBandwidth", effectiveBandwidth);
+    settings.setValue("ratio", ratio);
+    settings.endGroup();
+}
+
+///
+/// \brief CompressionAdvisor::choose resolves a setting to the level used for the next session.
+/// For Auto every candidate level is scored by the time it takes to move one byte: the wire
+/// time of the compressed byte plus the CPU time of compressing it. Off wins unless a level
+/// is clearly faster.
+/// \return zlib level, 0 for no compression.
+///
+int CompressionAdvisor::choose(const CompressionSetting &setting)
+{
+    this->setting = setting;
+    switch (setting.mode)
+    {
+    case CompressionSetting::Off:
+        chosenLevel = 0;
+        break;
+    case CompressionSetting::On:
+        chosenLevel = DEFAULT_LEVEL;
+        break;
+    case CompressionSetting::Level:
+        chosenLevel = std::clamp(setting.level, 1, 9);
+        break;
+    case CompressionSetting::Auto:
+    {
+        chosenLevel = 0;
+        if (linkBandwidth <= 0 || ratio <= 0)
+        {
+            break;
+        }
+        double best = 0.9 / linkBandwidth;
+        for (const LevelCost &cost : LEVEL_COSTS)
+        {
+            double levelRatio = std::max(1.0, ratio * cost.relativeRatio);
+            double secondsPerByte = 1.0 / (levelRatio * linkBandwidth) + 1.0 / cost.bytesPerSecond;
+            if (secondsPerByte < best)
+            {
+                best = secondsPerByte;
+                chosenLevel = cost.level;
+            }
+        }
+        break;
+    }
+    }
+    qDebug() << describe();
+    return chosenLevel;
+}
+
+///
+/// \brief CompressionAdvisor::addSample records what the current session measured.
+/// \param bytesPerSecond Throughput of a transfer, 0 if the sample only carries a ratio.
+/// \param ratio Compressibility of a sampled payload, 0 if unknown.
+/// \param compressionLevel Level of the session that measured it. Throughput from a session
+/// compressed differently than chosen (one still open from before) says nothing about this
+/// level and is dropped, the payload ratio does not depend on the session and is kept.
+///
+void CompressionAdvisor::addSample(double bytesPerSecond, double ratio, int compressionLevel)
+{
+    auto blend = [](double average, double sample) {
+        return average <= 0 ? sample : average + SAMPLE_WEIGHT * (sample - average);
+    };
+    if (ratio > 0)
+    {
+        this->ratio = blend(this->ratio, ratio);
+    }
+    if (bytesPerSecond > 0 && compressionLevel == chosenLevel)
+    {
+        if (chosenLevel == 0)
+        {
+            linkBandwidth = blend(linkBandwidth, bytesPerSecond);
+        }
+        else
+        {
+            effectiveBandwidth = blend(effectiveBandwidth, bytesPerSecond);
+            // What the link itself carries is the throughput divided by what compression saved.
+            if (this->ratio > 0)
+            {
+                linkBandwidth = blend(linkBandwidth, bytesPerSecond / std::max(1.0, this->ratio));
+            }
+        }
+    }
+    save();
+}
+
+QString CompressionAdvisor::modeName(const CompressionSetting &setting)
+{
+    switch (setting.mode)
+    {
+    case CompressionSetting::Off: return "off";
+    case CompressionSetting::On: return "on";
+    case CompressionSetting::Level: return QString("level %1").arg(setting.level);
+    case CompressionSetting::Auto: return "auto";
+    }
+    return QString();
+}
+
+QString CompressionAdvisor::describe() const
+{
+    QString text = QString("Compression %1: %2").arg(modeName(setting),
+                                                       chosenLevel ? QString("level %1").arg(chosenLevel) : QString("off"));
+    if (setting.mode == CompressionSetting::Auto && (linkBandwidth <= 0 || ratio <= 0))
+    {
+        text += " (measuring)";
+    }
+    if (linkBandwidth > 0)
+    {
+        text += QString(", link %1 KiB/s").arg(linkBandwidth / 1024, 0, 'f', 0);
+    }
+    if (ratio > 0)
+    {
+        text += QString(", payload %1x").arg(ratio, 0, 'f', 1);
+    }
+    if (chosenLevel && effectiveBandwidth > 0)
+    {
+        text += QString(", %1 KiB/s effective").arg(effectiveBandwidth / 1024, 0, 'f', 0);
+    }
+    return text;
+}
@@ -0,0 +1,42 @@
+#ifndef COMPRESSIONADVISOR_H
+#define COMPRESSIONADVISOR_H
+
+#include <QString>
+
+struct CompressionSetting {
+    enum Mode { Off, On, Level, Auto };
+    Mode mode = Auto;
+    int level = 6; // Only used by Level.
+};
+
+///
+/// \brief The CompressionAdvisor class picks the SSH compression level for a saved connection.
+/// Compression is negotiated at key exchange, so Auto decides from what earlier sessions to the
+/// same connection measured: link bandwidth from transfers and compressibility from sampled
+/// payloads. Measurements are kept in the settings, keyed by connection name.
+///
+class CompressionAdvisor
+{
+public:
+    explicit CompressionAdvisor(const QString &connectionName = QString());
+
+    int choose(const CompressionSetting &setting);
+    void addSample(double bytesPerSecond, double ratio, int compressionLevel);
+    QString describe() const;
+
+    static QString modeName(const CompressionSetting &setting);
+
+private:
+    QString group;
+    CompressionSetting setting;
+    int chosenLevel = 0;
+
+    double linkBandwidth = 0;      // Bytes per second without compression.
+    double effectiveBandwidth = 0; // Bytes per second seen with compression on.
+    double ratio = 0;              // Payload size over zlib compressed size.
+
+    void load();
+    void save();
+};
+
+#endif // COMPRESSIONADVISOR_H
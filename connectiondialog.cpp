@@ -9,6 +9,16 @@ ConnectionDialog::ConnectionDialog(QWidget *parent)
 {
     ui->setupUi(this);
     ui->portLine->setValidator(new QIntValidator(0, 65535, this));
+
+    // Off, On, Auto, then one entry per fixed level.
+    ui->compressionBox->addItem("Off");
+    ui->compressionBox->addItem("On");
+    ui->compressionBox->addItem("Auto");
+    for (int level = 1; level <= 9; level++)
+    {
+        ui->compressionBox->addItem(QString("Level %1").arg(level));
+    }
+    ui->compressionBox->setCurrentIndex(2);
 }
 
 ConnectionDialog::~ConnectionDialog()
@@ -24,6 +34,54 @@ void ConnectionDialog::setValues(QString user, QString host, quint16 port)
 }
 
 
+CompressionSetting ConnectionDialog::compression()
+{
+    CompressionSetting setting;
+    int index = ui->compressionBox->currentIndex();
+    switch (index)
+    {
+    case 0: setting.mode = CompressionSetting::Off; break;
+    case 1: setting.mode = CompressionSetting::On; break;
+    case 2: setting.mode = CompressionSetting::Auto; break;
+    default:
+        setting.mode = CompressionSetting::Level;
+        setting.level = index - 2;
+        break;
+    }
+    return setting;
+}
+
+void ConnectionDialog::setCompression(const CompressionSetting &compression)
+{
+    switch (compression.mode)
+    {
+    case CompressionSetting::Off: ui->compressionBox->setCurrentIndex(0); break;
+    case CompressionSetting::On: ui->compressionBox->setCurrentIndex(1); break;
+    case CompressionSetting::Auto: ui->compressionBox->setCurrentIndex(2); break;
+    case CompressionSetting::Level: ui->compressionBox->setCurrentIndex(2 + compression.level); break;
+    }
+}
+
+int ConnectionDialog::keepaliveInterval()
+{
+    return ui->keepaliveBox->value();
+}
+
+void ConnectionDialog::setKeepaliveInterval(int seconds)
+{
+    ui->keepaliveBox->setValue(seconds);
+}
+
+bool ConnectionDialog::prewarm()
+{
+    return ui->prewarmBox->isChecked();
+}
+
+void ConnectionDialog::setPrewarm(bool prewarm)
+{
+    ui->prewarmBox->setChecked(prewarm);
+}
+
 QString ConnectionDialog::user()
 {
     return ui->userLine->displayText();
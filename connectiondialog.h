@@ -2,6 +2,7 @@
 #define CONNECTIONDIALOG_H
 
 #include <QDialog>
+#include "compressionadvisor.h"
 
 namespace Ui {
 class ConnectionDialog;
@@ -21,6 +22,12 @@ public:
     QString host();
     quint16 port();
     void setValues(QString user, QString host, quint16 port);
+    CompressionSetting compression();
+    void setCompression(const CompressionSetting &compression);
+    int keepaliveInterval();
+    void setKeepaliveInterval(int seconds);
+    bool prewarm();
+    void setPrewarm(bool prewarm);
 
 private:
     QString userName;
@@ -1,37 +1,474 @@
 #include "connectionmanager.h"
+#include "listingcache.h"
+#include <QStandardPaths>
+
+#define DEFAULT_PARKED_LIFETIME 15 // Minutes a pre-warmed session waits to be opened.
+#define MAX_PARKED_ENTRIES 50000   // Entries kept for one pre-warmed session, bigger listings are redone when it opens.
+
+QString StartupTimings::summary() const
+{
+    QString summary = QString("Root listed %1 ms after the click, home %2 ms (session ready at %3 ms).")
+        .arg(firstListingMs)
+        .arg(homeListingMs)
+        .arg(sessionMs);
+    if (cachedTreeMs >= 0)
+    {
+        summary += QString(" Cached tree shown at %1 ms.").arg(cachedTreeMs);
+    }
+    return summary;
+}
 
 ConnectionManager::ConnectionManager(RemoteFileSystem *fs, QObject *parent)
-    : QObject{parent}, settings(this)
+    : QObject{parent}, settings(this), fs(fs)
 {
     loadConnections();
-    workerThread = new QThread(this);
-    wrap = new SSHWrapper();
-    connect(workerThread, &QThread::finished, wrap, &QObject::deleteLater);
-    wrap->moveToThread(workerThread);
-    workerThread->start();
 
-    connect(this, &ConnectionManager::requestConnection, wrap, &SSHWrapper::connectSession);
-    connect(this, &ConnectionManager::requestDir, wrap, &SSHWrapper::sftp_list_dir);
-    connect(wrap, &SSHWrapper::connectionStatus, this, &ConnectionManager::onConnectionStatus);
-    connect(this, &ConnectionManager::requestFile, wrap, &SSHWrapper::onRequestFile);
-    connect(wrap, &SSHWrapper::fileReceived, this, &ConnectionManager::fileReceived);
-    connect(this, &ConnectionManager::sendFile, wrap, &SSHWrapper::onSendFile);
+    connect(fs, &RemoteFileSystem::request_list_dir, this, &ConnectionManager::onListRequest);
+    connect(fs, &RemoteFileSystem::request_stat_dir, this, &ConnectionManager::onStatRequest);
+    connect(this, &ConnectionManager::hostConnected, fs, &RemoteFileSystem::onSSHConnected);
+}
+
+///
+/// \brief ConnectionManager::~ConnectionManager keeps the trees of the open hosts for next time.
+///
+ConnectionManager::~ConnectionManager()
+{
+    for (auto it = pools.cbegin(); it != pools.cend(); it++)
+    {
+        if (!parked.contains(it.key()))
+        {
+            saveListings(it.key());
+        }
+    }
+}
 
-    // Conect the file system to the SSH Session Wrapper
-    connect(fs, &RemoteFileSystem::request_list_dir, wrap, &SSHWrapper::sftp_list_dir);
-    connect(wrap, &SSHWrapper::sftpEntriesListed, fs, &RemoteFileSystem::onSftpEntriesListed);
+///
+/// \brief ConnectionManager::createPool starts the sessions of a connection and routes what
+/// they report back, tagged with the connection name.
+///
+SessionPool* ConnectionManager::createPool(const QString &connName)
+{
+    SessionPool *pool = new SessionPool(this);
+    SSHWrapper *browse = pool->browser();
+    SSHWrapper *transfer = pool->transferer();
+    pools.insert(connName, pool);
 
-    connect(this, &ConnectionManager::firstConnection, fs, &RemoteFileSystem::onSSHConnected);
+    connect(browse, &SSHWrapper::connectionStatus, this, [this, connName](bool status, bool newConnection) {
+        onConnectionStatus(connName, status, newConnection);
+    });
+    connect(browse, &SSHWrapper::connectPhase, this, [this, connName](const QString &phase) {
+        if (!parked.contains(connName))
+        {
+            emit connectProgress(connName, phase);
+        }
+    });
+    connect(browse, &SSHWrapper::connectFailed, this, [this, connName](const QString &message, bool cancelled) {
+        if (parked.contains(connName))
+        {
+            // Nobody asked for it, it will connect the normal way when opened.
+            qDebug() << "Pre-warming" << connName << "failed:" << message;
+            dropPool(connName);
+            return;
+        }
+        startupClocks.remove(connName);
+        emit connectFailed(connName, message, cancelled);
+    });
+    connect(browse, &SSHWrapper::connectTimed, this, [this, connName](const ConnectTimings &timings) {
+        if (connections.contains(connName) && connections[connName].lastAuthMethod != timings.authMethod)
+        {
+            connections[connName].lastAuthMethod = timings.authMethod;
+            saveConnections();
+        }
+        startups[connName].connect = timings;
+        if (startupClocks.contains(connName))
+        {
+            startups[connName].sessionMs = startupClocks[connName].elapsed();
+        }
+        if (!parked.contains(connName))
+        {
+            emit connectTimed(connName, timings);
+        }
+    });
+    connect(browse, &SSHWrapper::hostKeyPrompt, this, [this, connName](const QString &message) {
+        emit hostKeyQuestion(connName, message);
+    });
+    connect(browse, &SSHWrapper::passwordPrompt, this, [this, connName](const QString &prompt) {
+        emit passwordQuestion(connName, prompt);
+    });
+    connect(browse, &SSHWrapper::rttMeasured, this, [this, connName](double ms) {
+        rtts.insert(connName, ms);
+        emit connectionRtt(connName, ms);
+    });
+    connect(browse, &SSHWrapper::sftpEntriesListed, fs, [this, connName](const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime) {
+        if (parked.contains(connName))
+        {
+            parkListing(connName, entries, directory, complete, mtime);
+            return;
+        }
+        deliverListing(connName, entries, directory, complete, mtime);
+    });
+    connect(browse, &SSHWrapper::sftpListingFailed, fs, [this, connName](const QString &directory) {
+        if (parked.contains(connName))
+        {
+            parkedListings[connName].remove(directory);
+            return;
+        }
+        fs->onListingFailed(connName, directory);
+    });
+    connect(browse, &SSHWrapper::sftpDirectoriesStatted, fs, [this, connName](const QHash<QString, qint64> &mtimes) {
+        if (!parked.contains(connName))
+        {
+            fs->onDirectoriesStatted(connName, mtimes);
+        }
+    });
+    connect(browse, &SSHWrapper::homeResolved, fs, [this, connName](const QString &home) {
+        if (parked.contains(connName))
+        {
+            homes.insert(connName, home);
+            return;
+        }
+        deliverHome(connName, home);
+    });
+    RemoteIndexer *indexer = pool->indexer();
+    connect(indexer, &RemoteIndexer::entriesFound, fs, [this, connName](const QString &, const QHash<QString, QList<SFTPEntry>> &entries) {
+        PathIndex &index = pathIndexes[connName];
+        for (auto it = entries.cbegin(); it != entries.cend(); it++)
+        {
+            index.add(it.key(), it.value());
+        }
+        fs->onTreeStreamed(connName, entries);
+        emit indexProgress(connName, index.size(), false, QString());
+    });
+    connect(indexer, &RemoteIndexer::indexFinished, fs, [this, connName](const QString &, const QStringList &directories, bool complete, const QString &error) {
+        fs->onTreeStreamFinished(connName, directories, complete);
+        emit indexProgress(connName, indexedPaths(connName), true, error);
+    });
+    for (SSHWrapper *wrapper : {browse, transfer})
+    {
+        connect(wrapper, &SSHWrapper::trafficSampled, this, [this, connName](double bytesPerSecond, double ratio, int compressionLevel) {
+            onTrafficSampled(connName, bytesPerSecond, ratio, compressionLevel);
+        });
+    }
+
+    connect(transfer, &SSHWrapper::fileReceived, this, [this, connName](const QString &localPath, const QString &remotePath) {
+        openFiles.insert(localPath, connName);
+        emit fileReceived(localPath, remotePath);
+    });
+    connect(transfer, &SSHWrapper::fileDownloaded, this, &ConnectionManager::fileDownloaded);
+    connect(transfer, &SSHWrapper::transferFinished, this, &ConnectionManager::transferFinished);
+    connect(pool->transferManager(), &TransferManager::stateChanged, this, &ConnectionManager::transfersChanged);
+    return pool;
 }
 
-ConnectionManager::~ConnectionManager()
+///
+/// \brief ConnectionManager::disconnectHost closes every session of a connection and drops
+/// its tree and queued transfers.
+///
+void ConnectionManager::disconnectHost(const QString &connName)
+{
+    if (!pools.contains(connName))
+    {
+        return;
+    }
+    if (!parked.contains(connName))
+    {
+        saveListings(connName);
+    }
+    dropPool(connName);
+    fs->removeHost(connName);
+    emit connectionStatus(connName, false);
+}
+
+void ConnectionManager::dropPool(const QString &connName)
+{
+    // First, the park timer may be the one whose timeout got here.
+    dropParkTimer(connName);
+    delete pools.take(connName);
+    connected.remove(connName);
+    rtts.remove(connName);
+    compressionAdvisors.remove(connName);
+    homes.remove(connName);
+    pathIndexes.remove(connName);
+    startupClocks.remove(connName);
+    startups.remove(connName);
+    parked.remove(connName);
+    parkedListings.remove(connName);
+    emit transfersChanged();
+}
+
+///
+/// \brief ConnectionManager::dropParkTimer stops the lifetime timer of a parked connection. It is
+/// deleted later, its timeout may be what is being delivered right now.
+///
+void ConnectionManager::dropParkTimer(const QString &connName)
 {
-    if (workerThread->isRunning()) {
-        workerThread->quit();
-        workerThread->wait();
+    if (QTimer *timer = parkTimers.take(connName))
+    {
+        timer->stop();
+        timer->disconnect(this);
+        timer->deleteLater();
     }
 }
 
+///
+/// \brief ConnectionManager::parkListing keeps a batch of a listing until the pre-warmed connection
+/// is opened. A listing that would take the connection past MAX_PARKED_ENTRIES is let go, the
+/// rest of it is ignored and the directory is listed again when the connection is opened.
+///
+void ConnectionManager::parkListing(const QString &connName, const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime)
+{
+    QMap<QString, ParkedListing> &listings = parkedListings[connName];
+    ParkedListing &listing = listings[directory];
+    if (listing.complete)
+    {
+        // Listed again, e.g. after the session came back. The new listing replaces the old one.
+        listing = ParkedListing{};
+    }
+    listing.complete = complete;
+    listing.mtime = mtime;
+    if (listing.dropped)
+    {
+        return;
+    }
+    qsizetype kept = entries.size();
+    for (const ParkedListing &other : std::as_const(listings))
+    {
+        kept += other.entries.size();
+    }
+    if (kept > MAX_PARKED_ENTRIES)
+    {
+        qDebug() << "Not keeping the listing of" << directory << "for pre-warmed" << connName << ", too many entries.";
+        listing.entries.clear();
+        listing.dropped = true;
+        return;
+    }
+    listing.entries += entries;
+}
+
+///
+/// \brief ConnectionManager::prewarmSaved connects the saved connections marked for it in the
+/// background and lists their root, without showing them. Opening one later finds it ready.
+/// Only connects that need no prompt are made, and a session nobody opens is closed after
+/// the parked lifetime (prewarm/parkedLifetime minutes).
+///
+void ConnectionManager::prewarmSaved()
+{
+    int lifetime = settings.value("prewarm/parkedLifetime", DEFAULT_PARKED_LIFETIME).toInt();
+    for (const ConnectionInfo &con : std::as_const(connections))
+    {
+        if (!con.prewarm || pools.contains(con.name))
+        {
+            continue;
+        }
+        qDebug() << "Pre-warming" << con.name;
+        SessionPool *pool = createPool(con.name);
+        parked.insert(con.name);
+
+        QTimer *timer = new QTimer(this);
+        timer->setSingleShot(true);
+        QString connName = con.name;
+        connect(timer, &QTimer::timeout, this, [this, connName]() {
+            qDebug() << "Closing unused pre-warmed session" << connName;
+            dropPool(connName);
+        });
+        timer->start(lifetime * 60 * 1000);
+        parkTimers.insert(con.name, timer);
+
+        startConnect(pool, con, false);
+    }
+}
+
+///
+/// \brief ConnectionManager::unpark shows a pre-warmed connection that is ready, with the
+/// listings it already has. The root is listed again meanwhile to catch up.
+///
+void ConnectionManager::unpark(const QString &connName)
+{
+    QMap<QString, ParkedListing> listings = parkedListings.take(connName);
+    parked.remove(connName);
+    dropParkTimer(connName);
+
+    emit connectionStatus(connName, true);
+    emit hostConnected(connName);
+    emit hostActivated(connName);
+    restoreListings(connName);
+    // The root first, home needs its node.
+    if (listings.contains("/") && !listings.value("/").dropped)
+    {
+        ParkedListing root = listings.take("/");
+        deliverListing(connName, root.entries, "/", root.complete, root.mtime);
+    }
+    if (homes.contains(connName))
+    {
+        deliverHome(connName, homes.value(connName));
+    }
+    // A listing still arriving goes on with its next batch. One that was let go is listed again,
+    // its remaining batches come first and the new listing completes it.
+    for (auto it = listings.cbegin(); it != listings.cend(); it++)
+    {
+        if (it.value().dropped)
+        {
+            if (it.key() != "/")
+            {
+                onListRequest(connName, it.key());
+            }
+            continue;
+        }
+        deliverListing(connName, it.value().entries, it.key(), it.value().complete, it.value().mtime);
+    }
+    onListRequest(connName, "/");
+}
+
+///
+/// \brief ConnectionManager::deliverListing hands a batch of a listing to the tree and notes when
+/// the first ones of a new connection got there.
+///
+void ConnectionManager::deliverListing(const QString &connName, const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime)
+{
+    fs->onSftpEntriesListed(connName, entries, directory, complete, mtime);
+    if (!startupClocks.contains(connName))
+    {
+        return;
+    }
+    StartupTimings &timings = startups[connName];
+    qint64 ms = startupClocks[connName].elapsed();
+    if (directory == "/" && timings.firstListingMs < 0)
+    {
+        timings.firstListingMs = ms;
+    }
+    if (homes.contains(connName) && directory == homes.value(connName) && timings.homeListingMs < 0)
+    {
+        timings.homeListingMs = ms;
+    }
+    finishStartup(connName);
+}
+
+void ConnectionManager::deliverHome(const QString &connName, const QString &home)
+{
+    homes.insert(connName, home);
+    fs->onHomeResolved(connName, home);
+    emit homeResolved(connName, home);
+    if (home == "/" && startupClocks.contains(connName))
+    {
+        startups[connName].homeListingMs = startups[connName].firstListingMs;
+        finishStartup(connName);
+    }
+}
+
+///
+/// \brief ConnectionManager::finishStartup reports the startup timings once both the root and
+/// home are in the tree.
+///
+void ConnectionManager::finishStartup(const QString &connName)
+{
+    const StartupTimings &timings = startups[connName];
+    if (timings.firstListingMs < 0 || timings.homeListingMs < 0)
+    {
+        return;
+    }
+    startupClocks.remove(connName);
+    qDebug() << "Startup of" << connName << timings.summary();
+    emit startupTimed(connName, timings);
+}
+
+///
+/// \brief ConnectionManager::restoreListings shows the tree the host had at the end of its last
+/// session right away. Restored directories are checked when they are opened or show up in the
+/// view, those that changed are listed again and merged, so only what changed moves.
+///
+void ConnectionManager::restoreListings(const QString &connName)
+{
+    if (!connections.contains(connName))
+    {
+        return;
+    }
+    QList<CachedListing> listings = ListingCache(connections[connName].scope()).load();
+    if (listings.isEmpty())
+    {
+        return;
+    }
+    QStringList restored = fs->restoreListings(connName, listings);
+    if (startupClocks.contains(connName))
+    {
+        startups[connName].cachedTreeMs = startupClocks[connName].elapsed();
+    }
+    qDebug() << "Restored" << restored.size() << "cached listings of" << connName;
+}
+
+void ConnectionManager::saveListings(const QString &connName)
+{
+    if (!connections.contains(connName))
+    {
+        return;
+    }
+    QList<CachedListing> listings = fs->listings(connName);
+    if (!listings.isEmpty())
+    {
+        ListingCache(connections[connName].scope()).save(listings);
+    }
+}
+
+int ConnectionManager::connectedCount() const
+{
+    int count = 0;
+    for (auto it = connected.cbegin(); it != connected.cend(); it++)
+    {
+        if (it.value() && !parked.contains(it.key()))
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+TransferManager* ConnectionManager::transferManager(const QString &connName) const
+{
+    SessionPool *pool = pools.value(connName);
+    return pool ? pool->transferManager() : nullptr;
+}
+
+///
+/// \brief ConnectionManager::indexTree walks everything under root on the host with one remote
+/// find, filling the tree and a path index to search. The index covers the last walk only.
+///
+void ConnectionManager::indexTree(const QString &connName, const QString &root)
+{
+    SessionPool *pool = pools.value(connName);
+    if (!pool || !isConnected(connName))
+    {
+        return;
+    }
+    pathIndexes[connName].clear();
+    RemoteIndexer *indexer = pool->indexer();
+    // A walk still running stops, this one starts after it.
+    indexer->cancel();
+    QMetaObject::invokeMethod(indexer, [indexer, root]() {
+        indexer->indexTree(root);
+    });
+}
+
+QStringList ConnectionManager::searchIndex(const QString &connName, const QString &pattern, int limit) const
+{
+    auto it = pathIndexes.constFind(connName);
+    return it != pathIndexes.cend() ? it->search(pattern, limit) : QStringList();
+}
+
+qsizetype ConnectionManager::indexedPaths(const QString &connName) const
+{
+    auto it = pathIndexes.constFind(connName);
+    return it != pathIndexes.cend() ? it->size() : 0;
+}
+
+QList<TransferManager*> ConnectionManager::transferManagers() const
+{
+    QList<TransferManager*> managers;
+    for (SessionPool *pool : pools)
+    {
+        managers.append(pool->transferManager());
+    }
+    return managers;
+}
+
 QList<ConnectionInfo> ConnectionManager::getConnections()
 {
     return connections.values();
@@ -39,6 +476,10 @@ QList<ConnectionInfo> ConnectionManager::getConnections()
 
 void ConnectionManager::removeConnection(QString connection)
 {
+    if (connections.contains(connection))
+    {
+        ListingCache(connections[connection].scope()).remove();
+    }
     connections.remove(connection);
     saveConnections();
 }
@@ -48,6 +489,31 @@ void ConnectionManager::addConnection(ConnectionInfo connection)
     saveConnections();
 }
 
+///
+/// \brief ConnectionManager::updateConnection replaces a saved connection with its edited version.
+/// The cached tree stays unless the edit points the connection at another user, host or port,
+/// then it belongs to a different server and is dropped. A live session to the old address is
+/// closed first, so it does not save its tree under the new one.
+///
+void ConnectionManager::updateConnection(const QString &connName, const ConnectionInfo &connection)
+{
+    if (connections.contains(connName))
+    {
+        QString oldScope = connections[connName].scope();
+        if (oldScope != connection.scope() || connName != connection.name)
+        {
+            disconnectHost(connName);
+        }
+        if (oldScope != connection.scope())
+        {
+            ListingCache(oldScope).remove();
+        }
+        connections.remove(connName);
+    }
+    connections.insert(connection.name, connection);
+    saveConnections();
+}
+
 void ConnectionManager::loadConnections()
 {
     int size = settings.beginReadArray("connections");
@@ -58,6 +524,11 @@ void ConnectionManager::loadConnections()
         c.user = settings.value("user").toString();
         c.host = settings.value("host").toString();
         c.port = settings.value("port").toUInt();
+        c.compression.mode = static_cast<CompressionSetting::Mode>(settings.value("compression", CompressionSetting::Auto).toInt());
+        c.compression.level = settings.value("compressionLevel", 6).toInt();
+        c.keepaliveInterval = settings.value("keepalive", 30).toInt();
+        c.lastAuthMethod = settings.value("authMethod").toString();
+        c.prewarm = settings.value("prewarm", false).toBool();
         connections[c.name] = c;
     }
     settings.endArray();
@@ -74,6 +545,11 @@ void ConnectionManager::saveConnections()
         settings.setValue("user", c.user);
         settings.setValue("host", c.host);
         settings.setValue("port", c.port);
+        settings.setValue("compression", c.compression.mode);
+        settings.setValue("compressionLevel", c.compression.level);
+        settings.setValue("keepalive", c.keepaliveInterval);
+        settings.setValue("authMethod", c.lastAuthMethod);
+        settings.setValue("prewarm", c.prewarm);
     }
     settings.endArray();
 }
@@ -81,38 +557,242 @@ void ConnectionManager::saveConnections()
 void ConnectionManager::onConnectionRequest(ConnectionInfo con)
 {
     qDebug() << "Connection request for: " << con.name;
-    emit requestConnection(con.user, con.host, con.port);
+    if (isConnected(con.name))
+    {
+        // Already live, switching to it costs nothing.
+        emit hostActivated(con.name);
+        return;
+    }
+    startupClocks[con.name].start();
+    if (parked.contains(con.name))
+    {
+        if (connected.value(con.name, false))
+        {
+            unpark(con.name);
+            return;
+        }
+        // Still connecting in the background, where it cannot prompt. Start over in the foreground.
+        dropPool(con.name);
+        startupClocks[con.name].start();
+    }
+    startups.remove(con.name);
+    SessionPool *pool = pools.value(con.name);
+    if (!pool)
+    {
+        pool = createPool(con.name);
+    }
+    startConnect(pool, con, true);
+}
+
+void ConnectionManager::startConnect(SessionPool *pool, const ConnectionInfo &con, bool interactive)
+{
+    CompressionAdvisor &advisor = compressionAdvisors[con.name];
+    advisor = CompressionAdvisor(con.name);
+    int compressionLevel = advisor.choose(con.compression);
+    if (interactive)
+    {
+        emit compressionStatus(advisor.describe());
+    }
+
+    SSHWrapper *browse = pool->browser();
+    SSHWrapper *transfer = pool->transferer();
+    QMetaObject::invokeMethod(transfer, [transfer, con]() {
+        transfer->setKeepaliveInterval(con.keepaliveInterval);
+    });
+    QMetaObject::invokeMethod(browse, [browse, con, compressionLevel, interactive]() {
+        browse->setKeepaliveInterval(con.keepaliveInterval);
+        browse->connectSession(con.user, con.host, con.port, compressionLevel, con.lastAuthMethod, interactive);
+    });
 }
 
-void ConnectionManager::onConnectionStatus(bool status, bool newConnection)
+void ConnectionManager::onTrafficSampled(const QString &connName, double bytesPerSecond, double ratio, int compressionLevel)
 {
-    emit connectionStatus(status);
+    if (!compressionAdvisors.contains(connName))
+    {
+        return;
+    }
+    CompressionAdvisor &advisor = compressionAdvisors[connName];
+    advisor.addSample(bytesPerSecond, ratio, compressionLevel);
+    emit compressionStatus(advisor.describe());
+}
+
+void ConnectionManager::onConnectionStatus(const QString &connName, bool status, bool newConnection)
+{
+    if (!pools.contains(connName))
+    {
+        return;
+    }
+    connected.insert(connName, status);
+    if (parked.contains(connName))
+    {
+        if (!status)
+        {
+            dropPool(connName);
+        }
+        return;
+    }
+    emit connectionStatus(connName, status);
     if (status && newConnection)
     {
-        emit firstConnection();
+        emit hostConnected(connName);
+        restoreListings(connName);
+    }
+}
+
+///
+/// \brief ConnectionManager::onListRequest collects the directories asked for, a preload asks
+/// for all subdirectories in one go and they are listed together.
+///
+void ConnectionManager::onListRequest(const QString &connName, const QString &directory)
+{
+    if (!pools.contains(connName))
+    {
+        return;
+    }
+    if (pendingListings.isEmpty() && pendingStats.isEmpty())
+    {
+        QTimer::singleShot(0, this, &ConnectionManager::flushListRequests);
+    }
+    QStringList &pending = pendingListings[connName];
+    if (!pending.contains(directory))
+    {
+        pending.append(directory);
     }
 }
 
+///
+/// \brief ConnectionManager::onStatRequest collects the directories to check, they go out
+/// together with the listings asked for in the same event loop pass.
+///
+void ConnectionManager::onStatRequest(const QString &connName, const QString &directory)
+{
+    if (!isConnected(connName))
+    {
+        return;
+    }
+    if (pendingListings.isEmpty() && pendingStats.isEmpty())
+    {
+        QTimer::singleShot(0, this, &ConnectionManager::flushListRequests);
+    }
+    QStringList &pending = pendingStats[connName];
+    if (!pending.contains(directory))
+    {
+        pending.append(directory);
+    }
+}
+
+void ConnectionManager::flushListRequests()
+{
+    for (auto it = pendingStats.cbegin(); it != pendingStats.cend(); it++)
+    {
+        SessionPool *pool = pools.value(it.key());
+        if (!pool)
+        {
+            continue;
+        }
+        SSHWrapper *browse = pool->browser();
+        QStringList directories = it.value();
+        QMetaObject::invokeMethod(browse, [browse, directories]() {
+            browse->sftp_stat_dirs(directories);
+        });
+    }
+    pendingStats.clear();
+    for (auto it = pendingListings.cbegin(); it != pendingListings.cend(); it++)
+    {
+        SessionPool *pool = pools.value(it.key());
+        if (!pool)
+        {
+            continue;
+        }
+        SSHWrapper *browse = pool->browser();
+        QStringList directories = it.value();
+        QMetaObject::invokeMethod(browse, [browse, directories]() {
+            browse->sftp_list_dirs(directories);
+        });
+    }
+    pendingListings.clear();
+}
+
+void ConnectionManager::cancelConnect(const QString &connName)
+{
+    SessionPool *pool = pools.value(connName);
+    if (!pool)
+    {
+        return;
+    }
+    SSHWrapper *browse = pool->browser();
+    QMetaObject::invokeMethod(browse, [browse]() {
+        browse->cancelConnect();
+    });
+}
+
+void ConnectionManager::answerHostKey(const QString &connName, bool trusted)
+{
+    SessionPool *pool = pools.value(connName);
+    if (!pool)
+    {
+        return;
+    }
+    SSHWrapper *browse = pool->browser();
+    QMetaObject::invokeMethod(browse, [browse, trusted]() {
+        browse->answerHostKey(trusted);
+    });
+}
+
+void ConnectionManager::answerPassword(const QString &connName, const QString &password, bool accepted)
+{
+    SessionPool *pool = pools.value(connName);
+    if (!pool)
+    {
+        return;
+    }
+    SSHWrapper *browse = pool->browser();
+    QMetaObject::invokeMethod(browse, [browse, password, accepted]() {
+        browse->answerPassword(password, accepted);
+    });
+}
+
 void ConnectionManager::onFileRequest(QModelIndex index)
 {
-    constexpr qint64 MAX_DOWNLOAD_SIZE = 10 * 1024 * 1024;
-    FileNode* node = static_cast<FileNode*>(index.internalPointer());
-    if (node->entry.isDirectory)
+    SFTPEntry entry = fs->entry(index);
+    if (entry.isDirectory)
     {
         qDebug() << "Double Clicked Directory";
         return;
     }
-    if (node->entry.size > MAX_DOWNLOAD_SIZE)
+    SessionPool *pool = pools.value(fs->hostOf(index));
+    if (!pool)
+    {
+        return;
+    }
+    SSHWrapper *transfer = pool->transferer();
+    if (transferPolicy.opensInEditor(entry.size))
     {
-        qDebug() << "Remote File: " << node->entry.name << "Too big. Not Downloading.";
+        QMetaObject::invokeMethod(transfer, [transfer, entry]() {
+            transfer->onRequestFile(entry.path);
+        });
         return;
     }
-    emit requestFile(node->entry.path);
+
+    // Too big for the editor, save it next to the user's other downloads instead.
+    QString localPath = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation) + "/" + entry.name;
+    int streams = transferPolicy.streamsFor(entry.size);
+    qDebug() << "Remote File: " << entry.name << "Too big for the editor. Downloading to" << localPath;
+    QMetaObject::invokeMethod(transfer, [transfer, entry, localPath, streams]() {
+        transfer->onDownloadFile(entry.path, localPath, entry.size, streams);
+    });
 }
 
 void ConnectionManager::onFileSave(const QString& localPath, const QString& remotePath)
 {
-    emit sendFile(localPath, remotePath);
+    SessionPool *pool = pools.value(openFiles.value(localPath));
+    if (!pool)
+    {
+        qDebug() << "No live connection for" << localPath;
+        return;
+    }
+    SSHWrapper *transfer = pool->transferer();
+    QMetaObject::invokeMethod(transfer, [transfer, localPath, remotePath]() {
+        transfer->onSendFile(localPath, remotePath);
+    });
 }
-
-
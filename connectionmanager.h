@@ -3,16 +3,41 @@
 
 #include "sshwrapper.h"
 #include "remotefilesystem.h"
+#include "sessionpool.h"
+#include "compressionadvisor.h"
+#include "pathindex.h"
 #include <QObject>
 #include <QMap>
+#include <QHash>
 #include <QSettings>
-#include <QThread>
+#include <QSet>
+#include <QTimer>
+#include <QElapsedTimer>
 
 struct ConnectionInfo{
     QString name;
     QString user;
     QString host;
     quint16 port;
+    CompressionSetting compression;
+    int keepaliveInterval = 30; // Seconds idle before a keepalive, 0 for none.
+    QString lastAuthMethod;     // Tried first on the next connect.
+    bool prewarm = false;       // Connect in the background at startup.
+
+    QString scope() const { return QString("%1@%2:%3").arg(user, host).arg(port); }
+};
+
+///
+/// \brief Time from the click on a connection to its listings showing in the tree, in milliseconds.
+///
+struct StartupTimings {
+    ConnectTimings connect;
+    qint64 sessionMs = 0;       // Click to SFTP ready, prompts included.
+    qint64 firstListingMs = -1; // Click to the first entries of the root in the tree, -1 until then.
+    qint64 homeListingMs = -1;  // Same for home, the root's when home is "/".
+    qint64 cachedTreeMs = -1;   // Click to the tree of the last session showing, -1 without one.
+
+    QString summary() const;
 };
 
 class ConnectionManager : public QObject
@@ -25,7 +50,20 @@ public:
     QList<ConnectionInfo> getConnections();
     void removeConnection(QString connection);
     void addConnection(ConnectionInfo connection);
+    void updateConnection(const QString &connName, const ConnectionInfo &connection);
     ConnectionInfo getConnection(const QString &connName) {return connections.value(connName, ConnectionInfo{});}
+    bool isLive(const QString &connName) const {return pools.contains(connName);}
+    bool isConnected(const QString &connName) const {return connected.value(connName, false) && !parked.contains(connName);}
+    int connectedCount() const;
+    double rttMs(const QString &connName) const {return rtts.value(connName, 0);}
+    StartupTimings startupTimings(const QString &connName) const {return startups.value(connName);}
+    void disconnectHost(const QString &connName);
+    void prewarmSaved();
+    TransferManager* transferManager(const QString &connName) const;
+    void indexTree(const QString &connName, const QString &root);
+    QStringList searchIndex(const QString &connName, const QString &pattern, int limit) const;
+    qsizetype indexedPaths(const QString &connName) const;
+    QList<TransferManager*> transferManagers() const;
 private:
     QSettings settings;
     QMap<QString, ConnectionInfo> connections;
@@ -33,22 +71,76 @@ private:
     void loadConnections();
     void saveConnections();
 
-    QThread *workerThread;
-    SSHWrapper *wrap;
+    // One pool of sessions per live connection, keyed by connection name.
+    RemoteFileSystem *fs;
+    QMap<QString, SessionPool*> pools;
+    QMap<QString, bool> connected;
+    QMap<QString, double> rtts;
+    QMap<QString, CompressionAdvisor> compressionAdvisors;
+    QHash<QString, QString> openFiles; // Local copy to the connection it came from.
+    QMap<QString, QString> homes;
+    QMap<QString, PathIndex> pathIndexes; // Of the last tree walked on each connection.
+    QMap<QString, QStringList> pendingListings; // Asked for during this event loop pass, sent together.
+    QMap<QString, QStringList> pendingStats;    // Same for directories to check.
+
+    // Connections on their way to the first listings, timed from the click.
+    QMap<QString, QElapsedTimer> startupClocks;
+    QMap<QString, StartupTimings> startups;
+
+    // Pre-warmed connections nobody opened yet, with their first listings and remaining lifetime.
+    QSet<QString> parked;
+    struct ParkedListing {
+        QList<SFTPEntry> entries;
+        bool complete = false;
+        bool dropped = false; // Too big to keep, listed again when opened.
+        qint64 mtime = -1;
+    };
+    QMap<QString, QMap<QString, ParkedListing>> parkedListings;
+    QMap<QString, QTimer*> parkTimers;
+    TransferPolicy transferPolicy;
+
+    SessionPool* createPool(const QString &connName);
+    void startConnect(SessionPool *pool, const ConnectionInfo &con, bool interactive);
+    void unpark(const QString &connName);
+    void parkListing(const QString &connName, const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime);
+    void dropParkTimer(const QString &connName);
+    void dropPool(const QString &connName);
+    void deliverListing(const QString &connName, const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime);
+    void deliverHome(const QString &connName, const QString &home);
+    void finishStartup(const QString &connName);
+    void restoreListings(const QString &connName);
+    void saveListings(const QString &connName);
+    void flushListRequests();
 signals:
-    void requestConnection(const QString& user, const QString& host, const quint16& port);
-    void requestDir(const QString &directory);
-    void connectionStatus(bool status);
-    void firstConnection();
+    void connectionStatus(const QString &connName, bool status);
+    void connectionRtt(const QString &connName, double ms);
+    void hostConnected(const QString &connName);
+    void hostActivated(const QString &connName);
+    void transfersChanged();
+    void connectProgress(const QString &connName, const QString &phase);
+    void connectFailed(const QString &connName, const QString &message, bool cancelled);
+    void connectTimed(const QString &connName, const ConnectTimings &timings);
+    void homeResolved(const QString &connName, const QString &home);
+    void startupTimed(const QString &connName, const StartupTimings &timings);
+    void indexProgress(const QString &connName, qsizetype paths, bool finished, const QString &error);
+    void hostKeyQuestion(const QString &connName, const QString &message);
+    void passwordQuestion(const QString &connName, const QString &prompt);
     void fileReceived(const QString& localPath, const QString& remotePath);
-    void requestFile(const QString& localPath);
-    void sendFile(const QString& localPath, const QString& remotePath);
+    void fileDownloaded(const QString& localPath, const QString& remotePath);
+    void transferFinished(const TransferStats &stats);
+    void compressionStatus(const QString &status);
 
 public slots:
     void onConnectionRequest(ConnectionInfo con);
-    void onConnectionStatus(bool status, bool newConnection = false);
+    void onConnectionStatus(const QString &connName, bool status, bool newConnection = false);
+    void onListRequest(const QString &connName, const QString &directory);
+    void onStatRequest(const QString &connName, const QString &directory);
+    void cancelConnect(const QString &connName);
+    void answerHostKey(const QString &connName, bool trusted);
+    void answerPassword(const QString &connName, const QString &password, bool accepted);
     void onFileRequest(QModelIndex index);
     void onFileSave(const QString& localPath, const QString& remotePath);
+    void onTrafficSampled(const QString &connName, double bytesPerSecond, double ratio, int compressionLevel);
 
 
 
@@ -0,0 +1,245 @@
+#include "deltaupload.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+
+// Below this a full upload costs less than asking the remote side for hashes.
+#define DELTA_MIN_SIZE (256 * 1024)
+#define MIN_BLOCK_SIZE (64 * 1024)
+#define MAX_BLOCK_SIZE (4 * 1024 * 1024)
+// Keeps the hash list that comes back over the exec channel small.
+#define TARGET_BLOCK_COUNT 2048
+
+DeltaUpload::DeltaUpload(ssh_session session, sftp_session sftp)
+    : session(session), sftp(sftp)
+{
+}
+
+quint64 DeltaUpload::blockSizeFor(quint64 size)
+{
+    quint64 blockSize = MIN_BLOCK_SIZE;
+    while (blockSize < MAX_BLOCK_SIZE && size / blockSize > TARGET_BLOCK_COUNT)
+    {
+        blockSize *= 2;
+    }
+    return blockSize;
+}
+
+static QString shellQuote(const QString &value)
+{
+    QString quoted = value;
+    quoted.replace("'", "'\\''");
+    return "'" + quoted + "'";
+}
+
+///
+/// \brief DeltaUpload::remoteBlockHashes asks the remote host for the MD5 of every block of its copy.
+/// The file is read once, by python3 or perl when available, else by GNU split feeding md5sum.
+/// \return False if the host could not produce one hash per block.
+///
+bool DeltaUpload::remoteBlockHashes(const QString &remotePath, quint64 remoteSize, quint64 blockSize, QByteArrayList *hashes)
+{
+    quint64 blocks = (remoteSize + blockSize - 1) / blockSize;
+    QString command = QString(
+        "f=%1; "
+        "if command -v python3 >/dev/null 2>&1; then "
+        "python3 -c 'import sys,hashlib;f=open(sys.argv[1],\"rb\");b=int(sys.argv[2]);"
+        "[print(hashlib.md5(d).hexdigest()) for d in iter(lambda:f.read(b),b\"\")]' \"$f\" %2; "
+        "elif command -v perl >/dev/null 2>&1; then "
+        "perl -MDigest::MD5=md5_hex -e 'open(F,\"<\",$ARGV[0]) or exit 1;binmode F;"
+        "print md5_hex($d),\"\\n\" while read(F,$d,$ARGV[1])' \"$f\" %2; "
+        "else split -b %2 --filter='md5sum | cut -c1-32' \"$f\"; fi")
+        .arg(shellQuote(remotePath), QString::number(blockSize));
+
+    ssh_channel channel = ssh_channel_new(session);
+    if (channel == NULL)
+    {
+        return false;
+    }
+    if (ssh_channel_open_session(channel) != SSH_OK)
+    {
+        ssh_channel_free(channel);
+        return false;
+    }
+    if (ssh_channel_request_exec(channel, command.toUtf8().constData()) != SSH_OK)
+    {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return false;
+    }
+
+    QByteArray output;
+    char buffer[4096];
+    int nbytes;
+    while ((nbytes = ssh_channel_read(channel, buffer, sizeof(buffer), 0)) > 0)
+    {
+        output.append(buffer, nbytes);
+    }
+    ssh_channel_send_eof(channel);
+    ssh_channel_close(channel);
+    int status = ssh_channel_get_exit_status(channel);
+    ssh_channel_free(channel);
+    if (nbytes < 0 || status != 0)
+    {
+        return false;
+    }
+
+    hashes->clear();
+    for (const QByteArray &line : output.split('\n'))
+    {
+        QByteArray hash = line.trimmed();
+        if (hash.isEmpty())
+        {
+            continue;
+        }
+        if (hash.size() != 32)
+        {
+            return false;
+        }
+        hashes->append(hash);
+    }
+    return static_cast<quint64>(hashes->size()) == blocks;
+}
+
+DeltaUpload::Result DeltaUpload::run(const QString &localPath, const QString &remotePath)
+{
+    lastStats = TransferStats{};
+    error.clear();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    quint64 localSize = QFileInfo(localPath).size();
+    if (localSize < DELTA_MIN_SIZE)
+    {
+        return Unsupported;
+    }
+
+    sftp_attributes attributes = sftp_stat(sftp, remotePath.toUtf8().constData());
+    if (!attributes)
+    {
+        return Unsupported;
+    }
+    bool regular = attributes->type == SSH_FILEXFER_TYPE_REGULAR;
+    quint64 remoteSize = attributes->size;
+    quint32 permissions = attributes->permissions;
+    sftp_attributes_free(attributes);
+    if (!regular || remoteSize == 0)
+    {
+        return Unsupported;
+    }
+
+    quint64 blockSize = blockSizeFor(std::max(localSize, remoteSize));
+    QByteArrayList remoteHashes;
+    if (!remoteBlockHashes(remotePath, remoteSize, blockSize, &remoteHashes))
+    {
+        qDebug() << "Remote host can't hash" << remotePath << ", falling back to a full upload.";
+        return Unsupported;
+    }
+
+    QFile localFile(localPath);
+    if (!localFile.open(QIODevice::ReadOnly))
+    {
+        return Unsupported;
+    }
+
+    // Blocks past the end of the remote copy never match, a shorter or changed tail
+    // hashes differently since it covers different bytes.
+    QList<ByteRange> changed;
+    quint64 changedBytes = 0;
+    for (qsizetype block = 0; !localFile.atEnd(); block++)
+    {
+        quint64 offset = localFile.pos();
+        QByteArray data = localFile.read(blockSize);
+        if (data.isEmpty())
+        {
+            break;
+        }
+        if (block < remoteHashes.size() && QCryptographicHash::hash(data, QCryptographicHash::Md5).toHex() == remoteHashes.at(block))
+        {
+            continue;
+        }
+        changedBytes += data.size();
+        if (!changed.isEmpty() && changed.last().second == offset)
+        {
+            changed.last().second += data.size();
+        }
+        else
+        {
+            changed.append(ByteRange(offset, offset + data.size()));
+        }
+    }
+    localFile.close();
+
+    SftpTransfer transfer(session, sftp);
+    transfer.setCancelFlag(cancelFlag);
+    if (!transfer.uploadRanges(localPath, remotePath, changed, localSize))
+    {
+        // Some blocks may already be written, the remote copy is neither version any more.
+        error = transfer.errorString();
+        QString mixed = QString(" Remote file '%1' may now mix old and new blocks until it is uploaded again.").arg(remotePath);
+        if (cancelFlag && *cancelFlag)
+        {
+            error += mixed;
+            return Failed;
+        }
+        if (!replaceWhole(localPath, remotePath, permissions, mixed))
+        {
+            return Failed;
+        }
+        qDebug() << "Delta upload failed, uploaded in full instead:" << error;
+        error.clear();
+        lastStats.elapsedMs = timer.elapsed();
+        qDebug() << lastStats.summary();
+        return Done;
+    }
+
+    lastStats = transfer.stats();
+    lastStats.unchangedBytes = localSize - changedBytes;
+    lastStats.elapsedMs = timer.elapsed();
+    qDebug() << lastStats.summary();
+    return Done;
+}
+
+///
+/// \brief DeltaUpload::replaceWhole uploads the whole file next to the remote copy and renames it
+/// into place, after a delta upload failed halfway. Until the rename the remote copy stays as it is.
+/// \param mixed Added to the error if the remote copy is left as the failed delta upload made it.
+///
+bool DeltaUpload::replaceWhole(const QString &localPath, const QString &remotePath, quint32 permissions, const QString &mixed)
+{
+    QString tempPath = remotePath + ".sshexplorer-part";
+    QByteArray temp = tempPath.toUtf8();
+    QByteArray target = remotePath.toUtf8();
+
+    SftpTransfer transfer(session, sftp);
+    transfer.setCancelFlag(cancelFlag);
+    if (!transfer.upload(localPath, tempPath))
+    {
+        error += " " + transfer.errorString() + mixed;
+        sftp_unlink(sftp, temp.constData());
+        return false;
+    }
+    sftp_chmod(sftp, temp.constData(), permissions & 07777);
+    // Version 3 servers don't rename over an existing file.
+    if (sftp_rename(sftp, temp.constData(), target.constData()) != SSH_OK)
+    {
+        if (sftp_unlink(sftp, target.constData()) != SSH_OK)
+        {
+            error += QString(" Can't replace it with the full upload '%1': %2.").arg(tempPath, ssh_get_error(session)) + mixed;
+            return false;
+        }
+        if (sftp_rename(sftp, temp.constData(), target.constData()) != SSH_OK)
+        {
+            error += QString(" Remote file '%1' was removed, its new contents are in '%2': %3")
+                         .arg(remotePath, tempPath, ssh_get_error(session));
+            return false;
+        }
+    }
+    lastStats = transfer.stats();
+    lastStats.remotePath = remotePath;
+    return true;
+}
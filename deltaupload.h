@@ -0,0 +1,44 @@
+#ifndef DELTAUPLOAD_H
+#define DELTAUPLOAD_H
+
+#include "sftptransfer.h"
+#include <QByteArrayList>
+
+///
+/// \brief The DeltaUpload class sends only the blocks of a file that differ from the remote copy.
+/// The remote side hashes its copy block by block over an exec channel, the blocks whose
+/// hashes differ from the local ones are written in place over SFTP. Blocks are compared at the
+/// same offsets only, an edit that shifts the rest of the file sends the whole tail.
+///
+class DeltaUpload
+{
+public:
+    enum Result {
+        Done,
+        Unsupported, // Nothing was written, a full upload should be used instead.
+        Failed
+    };
+
+    DeltaUpload(ssh_session session, sftp_session sftp);
+
+    Result run(const QString &localPath, const QString &remotePath);
+    // Passed on to the upload of the changed blocks, see SftpTransfer::setCancelFlag.
+    void setCancelFlag(const std::atomic<bool> *flag) { cancelFlag = flag; }
+
+    const TransferStats& stats() const { return lastStats; }
+    const QString& errorString() const { return error; }
+
+private:
+    ssh_session session;
+    sftp_session sftp;
+    const std::atomic<bool> *cancelFlag = nullptr;
+
+    TransferStats lastStats;
+    QString error;
+
+    static quint64 blockSizeFor(quint64 size);
+    bool remoteBlockHashes(const QString &remotePath, quint64 remoteSize, quint64 blockSize, QByteArrayList *hashes);
+    bool replaceWhole(const QString &localPath, const QString &remotePath, quint32 permissions, const QString &mixed);
+};
+
+#endif // DELTAUPLOAD_H
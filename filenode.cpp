@@ -0,0 +1,81 @@
+#include "filenode.h"
+#include <new>
+
+#define NODES_PER_BLOCK 4096
+
+quint32 NamePool::intern(const QString &name)
+{
+    if (name.isEmpty())
+    {
+        return 0;
+    }
+    auto it = ids.constFind(name);
+    if (it != ids.constEnd())
+    {
+        return it.value();
+    }
+    quint32 id = names.size();
+    names.append(name);
+    ids.insert(name, id);
+    return id;
+}
+
+NodeArena::NodeArena()
+    : usedInBlock(NODES_PER_BLOCK)
+{
+}
+
+///
+/// \brief NodeArena::~NodeArena releases the blocks. Nodes still alive are not destructed,
+/// the owner has to destroy its trees first.
+///
+NodeArena::~NodeArena()
+{
+    for (FileNode *block : std::as_const(blocks))
+    {
+        ::operator delete(block);
+    }
+}
+
+FileNode* NodeArena::create(FileNode *parent)
+{
+    void *slot;
+    if (freeList)
+    {
+        slot = freeList;
+        freeList = *reinterpret_cast<FileNode**>(freeList);
+    }
+    else
+    {
+        if (usedInBlock == NODES_PER_BLOCK)
+        {
+            blocks.append(static_cast<FileNode*>(::operator new(sizeof(FileNode) * NODES_PER_BLOCK)));
+            usedInBlock = 0;
+        }
+        slot = blocks.last() + usedInBlock++;
+    }
+    live++;
+    FileNode *node = new (slot) FileNode;
+    node->parent = parent;
+    return node;
+}
+
+///
+/// \brief NodeArena::destroy destroys the node and everything under it. The node must already be
+/// out of its parent's children.
+///
+void NodeArena::destroy(FileNode *node)
+{
+    if (!node)
+    {
+        return;
+    }
+    for (FileNode *child : std::as_const(node->children))
+    {
+        destroy(child);
+    }
+    node->~FileNode();
+    *reinterpret_cast<FileNode**>(node) = freeList;
+    freeList = node;
+    live--;
+}
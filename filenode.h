@@ -0,0 +1,91 @@
+#ifndef FILENODE_H
+#define FILENODE_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QCollatorSortKey>
+#include <memory>
+
+///
+/// \brief One file or directory of a remote tree. Trees of millions of nodes are normal, so a node
+/// keeps only what cannot be derived: the path is built from the parents, owner and group are ids
+/// into a NamePool and the mtime stays raw until it is shown. A collation key of the name is only
+/// kept under directories the view opened, where sorting is frequent. Nodes live in a NodeArena.
+///
+struct FileNode {
+    QString name;
+    std::unique_ptr<QCollatorSortKey> nameKey; // Set if the parent is keyed, names compare directly otherwise.
+    FileNode *parent = nullptr;
+    QList<FileNode*> children;
+    QHash<QString, FileNode*> childByName;
+    quint64 size = 0;
+    qint64 mtime = 0;
+    quint32 permissions = 0;
+    quint32 owner = 0; // NamePool ids.
+    quint32 group = 0;
+    mutable int row = 0;  // Under the parent. Checked on every use, all siblings are renumbered when it moved.
+    qint64 listedAt = 0;  // Seconds since the epoch of the last complete listing or check that it is current, 0 if never listed.
+    qint64 listedMtime = 0; // Its own mtime at that listing, a stat showing another one means it changed.
+    bool isDirectory = false;
+    bool listing = false; // A listing is arriving in batches.
+    bool stale = false;   // Not seen yet by the listing arriving, removed if it does not show up.
+    bool keyed = false;   // The view opened it, its children carry name keys.
+    bool listFailed = false; // The last listing failed, not fetched again until a stat answers for it.
+
+    FileNode* child(const QString &name) const {
+        return childByName.value(name);
+    }
+
+    // Constant time unless rows were inserted or removed in front of it since the last call.
+    int rowInParent() const {
+        const QList<FileNode*> &siblings = parent->children;
+        if (row >= siblings.size() || siblings.at(row) != this) {
+            for (int i = 0; i < siblings.size(); i++) {
+                siblings.at(i)->row = i;
+            }
+        }
+        return row;
+    }
+};
+
+///
+/// \brief The NamePool class stores every distinct owner and group name once. A listing repeats
+/// the same few names thousands of times, nodes keep a 32 bit id instead.
+///
+class NamePool
+{
+public:
+    quint32 intern(const QString &name);
+    const QString& name(quint32 id) const { return names.at(id); }
+
+private:
+    QStringList names{QString()}; // Id 0 is the empty name.
+    QHash<QString, quint32> ids;
+};
+
+///
+/// \brief The NodeArena class allocates FileNodes in blocks of a few thousand instead of one heap
+/// allocation each, and reuses the slots of destroyed nodes.
+///
+class NodeArena
+{
+public:
+    NodeArena();
+    ~NodeArena();
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    FileNode* create(FileNode *parent);
+    void destroy(FileNode *node);
+    qsizetype liveCount() const { return live; }
+
+private:
+    QList<FileNode*> blocks;
+    int usedInBlock;
+    FileNode *freeList = nullptr; // Destroyed slots, linked through their first bytes.
+    qsizetype live = 0;
+};
+
+#endif // FILENODE_H
@@ -0,0 +1,231 @@
+#include "listingcache.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <cstring>
+#include <tuple>
+
+#define CACHE_MAGIC "SXLC"
+#define CACHE_VERSION 2
+#define CACHE_BYTE_ORDER 0x01020304 // Reads back differently on a machine of the other byte order.
+
+namespace {
+
+struct Header {
+    char magic[4];
+    quint32 version;
+    quint32 byteOrder;
+    quint32 directoryCount;
+    quint32 entryCount;
+    quint32 reserved;
+    quint64 directoriesOffset;
+    quint64 entriesOffset;
+    quint64 stringsOffset;
+    quint64 stringsSize;
+};
+
+struct DirectoryRecord {
+    qint64 listedAt;
+    qint64 mtime;
+    quint32 path;        // Offset into the string table.
+    quint32 pathLength;  // In bytes of UTF-8.
+    quint32 firstEntry;
+    quint32 entryCount;
+};
+
+struct EntryRecord {
+    quint64 size;
+    qint64 mtime;
+    quint32 name;
+    quint32 nameLength;
+    quint32 owner;
+    quint32 ownerLength;
+    quint32 group;
+    quint32 groupLength;
+    quint32 permissions;
+    quint32 isDirectory;
+};
+
+///
+/// \brief Collects the strings of the file, every distinct one is stored once.
+///
+class StringTable
+{
+public:
+    QPair<quint32, quint32> add(const QString &string)
+    {
+        auto it = offsets.constFind(string);
+        if (it != offsets.constEnd())
+        {
+            return it.value();
+        }
+        QByteArray utf8 = string.toUtf8();
+        QPair<quint32, quint32> location(bytes.size(), utf8.size());
+        bytes.append(utf8);
+        offsets.insert(string, location);
+        return location;
+    }
+    const QByteArray& data() const { return bytes; }
+
+private:
+    QByteArray bytes;
+    QHash<QString, QPair<quint32, quint32>> offsets;
+};
+
+}
+
+ListingCache::ListingCache(const QString &scope)
+{
+    QString name = QCryptographicHash::hash(scope.toUtf8(), QCryptographicHash::Sha1).toHex() + ".cache";
+    path = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/listings/" + name;
+}
+
+///
+/// \brief ListingCache::load
+/// \return The cached listings, parents before their children. Empty if there is no usable cache.
+///
+QList<CachedListing> ListingCache::load() const
+{
+    QList<CachedListing> listings;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < qint64(sizeof(Header)))
+    {
+        return listings;
+    }
+    const uchar *data = file.map(0, file.size());
+    if (!data)
+    {
+        return listings;
+    }
+    quint64 fileSize = file.size();
+
+    Header header;
+    std::memcpy(&header, data, sizeof(Header));
+    if (std::memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != CACHE_VERSION || header.byteOrder != CACHE_BYTE_ORDER
+        || header.directoriesOffset + quint64(header.directoryCount) * sizeof(DirectoryRecord) > fileSize
+        || header.entriesOffset + quint64(header.entryCount) * sizeof(EntryRecord) > fileSize
+        || header.stringsOffset + header.stringsSize > fileSize)
+    {
+        qDebug() << "Ignoring listing cache" << path;
+        file.unmap(const_cast<uchar*>(data));
+        return listings;
+    }
+    const DirectoryRecord *directories = reinterpret_cast<const DirectoryRecord*>(data + header.directoriesOffset);
+    const EntryRecord *entries = reinterpret_cast<const EntryRecord*>(data + header.entriesOffset);
+    const char *strings = reinterpret_cast<const char*>(data + header.stringsOffset);
+    auto string = [&](quint32 offset, quint32 length) {
+        if (quint64(offset) + length > header.stringsSize)
+        {
+            return QString();
+        }
+        return QString::fromUtf8(strings + offset, length);
+    };
+
+    // Owners and groups repeat on nearly every entry, decode each once.
+    QHash<quint32, QString> names;
+    auto name = [&](quint32 offset, quint32 length) {
+        auto it = names.constFind(offset);
+        return it != names.constEnd() ? it.value() : names.insert(offset, string(offset, length)).value();
+    };
+
+    listings.reserve(header.directoryCount);
+    for (quint32 i = 0; i < header.directoryCount; i++)
+    {
+        const DirectoryRecord &directory = directories[i];
+        if (quint64(directory.firstEntry) + directory.entryCount > header.entryCount)
+        {
+            break;
+        }
+        CachedListing listing;
+        listing.directory = string(directory.path, directory.pathLength);
+        listing.listedAt = directory.listedAt;
+        listing.mtime = directory.mtime;
+        listing.entries.reserve(directory.entryCount);
+        QString prefix = listing.directory == "/" ? "/" : listing.directory + "/";
+        for (quint32 j = directory.firstEntry; j < directory.firstEntry + directory.entryCount; j++)
+        {
+            const EntryRecord &record = entries[j];
+            SFTPEntry entry{};
+            entry.name = string(record.name, record.nameLength);
+            entry.path = prefix + entry.name;
+            entry.size = record.size;
+            entry.mtime = record.mtime;
+            entry.owner = name(record.owner, record.ownerLength);
+            entry.group = name(record.group, record.groupLength);
+            entry.permissions = record.permissions;
+            entry.isDirectory = record.isDirectory != 0;
+            listing.entries.append(entry);
+        }
+        listings.append(listing);
+    }
+    file.unmap(const_cast<uchar*>(data));
+    return listings;
+}
+
+///
+/// \brief ListingCache::save replaces the cache with the given listings, parents have to come
+/// before their children. The old cache stays if writing fails halfway.
+///
+bool ListingCache::save(const QList<CachedListing> &listings) const
+{
+    StringTable strings;
+    QList<DirectoryRecord> directories;
+    QList<EntryRecord> entries;
+    directories.reserve(listings.size());
+    for (const CachedListing &listing : listings)
+    {
+        DirectoryRecord directory{};
+        std::tie(directory.path, directory.pathLength) = strings.add(listing.directory);
+        directory.listedAt = listing.listedAt;
+        directory.mtime = listing.mtime;
+        directory.firstEntry = entries.size();
+        directory.entryCount = listing.entries.size();
+        for (const SFTPEntry &entry : listing.entries)
+        {
+            EntryRecord record{};
+            record.size = entry.size;
+            record.mtime = entry.mtime;
+            std::tie(record.name, record.nameLength) = strings.add(entry.name);
+            std::tie(record.owner, record.ownerLength) = strings.add(entry.owner);
+            std::tie(record.group, record.groupLength) = strings.add(entry.group);
+            record.permissions = entry.permissions;
+            record.isDirectory = entry.isDirectory;
+            entries.append(record);
+        }
+        directories.append(directory);
+    }
+
+    Header header{};
+    std::memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.byteOrder = CACHE_BYTE_ORDER;
+    header.directoryCount = directories.size();
+    header.entryCount = entries.size();
+    header.directoriesOffset = sizeof(Header);
+    header.entriesOffset = header.directoriesOffset + directories.size() * sizeof(DirectoryRecord);
+    header.stringsOffset = header.entriesOffset + entries.size() * sizeof(EntryRecord);
+    header.stringsSize = strings.data().size();
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "Could not write listing cache" << path << file.errorString();
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    file.write(reinterpret_cast<const char*>(directories.constData()), directories.size() * sizeof(DirectoryRecord));
+    file.write(reinterpret_cast<const char*>(entries.constData()), entries.size() * sizeof(EntryRecord));
+    file.write(strings.data());
+    return file.commit();
+}
+
+void ListingCache::remove() const
+{
+    QFile::remove(path);
+}
@@ -0,0 +1,38 @@
+#ifndef LISTINGCACHE_H
+#define LISTINGCACHE_H
+
+#include <QString>
+#include <QList>
+#include "sshwrapper.h"
+
+///
+/// \brief A directory listing as it was when it was last seen complete.
+///
+struct CachedListing {
+    QString directory;
+    qint64 listedAt = 0; // Seconds since the epoch.
+    qint64 mtime = 0;    // Of the directory itself when it was listed.
+    QList<SFTPEntry> entries;
+};
+
+///
+/// \brief The ListingCache class keeps the directory listings of one host on disk, so a host
+/// browsed before shows its tree right away on the next connect while it is listed again.
+/// The file is a fixed layout of native endian records (header, directories, entries, one string
+/// table) read through a memory map, nothing is parsed beyond following offsets. It is only a
+/// cache: a file that is missing, truncated or from another version is ignored.
+///
+class ListingCache
+{
+public:
+    explicit ListingCache(const QString &scope);
+
+    QList<CachedListing> load() const;
+    bool save(const QList<CachedListing> &listings) const;
+    void remove() const;
+
+private:
+    QString path;
+};
+
+#endif // LISTINGCACHE_H
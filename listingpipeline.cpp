@@ -0,0 +1,481 @@
+#include "listingpipeline.h"
+#include <QDebug>
+#include <QtEndian>
+
+#define MAX_OUTSTANDING 64
+#define READ_TIMEOUT_MS 30000
+#define MAX_PACKET_SIZE (4 * 1024 * 1024) // Servers send at most 256 KiB, anything bigger is garbage.
+#define MAX_SAMPLE_SIZE 65536
+#define FILE_TYPE_MASK 0170000
+#define FILE_TYPE_DIRECTORY 0040000
+
+///
+/// \brief Reads the big endian fields of an SFTP packet, with bounds checks. After the first
+/// read past the end every value is empty and ok() is false.
+///
+class WireReader
+{
+public:
+    WireReader(const QByteArray &data, int offset = 0) : data(data), pos(offset) {}
+
+    bool ok() const { return valid; }
+
+    quint32 u32()
+    {
+        if (!take(4))
+        {
+            return 0;
+        }
+        return qFromBigEndian<quint32>(data.constData() + pos - 4);
+    }
+
+    quint64 u64()
+    {
+        if (!take(8))
+        {
+            return 0;
+        }
+        return qFromBigEndian<quint64>(data.constData() + pos - 8);
+    }
+
+    QByteArray string()
+    {
+        quint32 length = u32();
+        if (!take(length))
+        {
+            return QByteArray();
+        }
+        return data.mid(pos - length, length);
+    }
+
+private:
+    const QByteArray &data;
+    int pos;
+    bool valid = true;
+
+    bool take(quint32 length)
+    {
+        if (!valid || length > static_cast<quint32>(data.size() - pos))
+        {
+            valid = false;
+            return false;
+        }
+        pos += length;
+        return true;
+    }
+};
+
+static void putU32(QByteArray &out, quint32 value)
+{
+    char bytes[4];
+    qToBigEndian<quint32>(value, bytes);
+    out.append(bytes, 4);
+}
+
+static void putString(QByteArray &out, const QByteArray &value)
+{
+    putU32(out, value.size());
+    out.append(value);
+}
+
+///
+/// \brief readAttributes reads an SFTP v3 attribute block into entry.
+/// \return false if the block was cut short.
+///
+static bool readAttributes(WireReader &reader, SFTPEntry &entry)
+{
+    quint32 flags = reader.u32();
+    if (flags & SSH_FILEXFER_ATTR_SIZE)
+    {
+        entry.size = reader.u64();
+    }
+    if (flags & SSH_FILEXFER_ATTR_UIDGID)
+    {
+        entry.uid = reader.u32();
+        entry.gid = reader.u32();
+    }
+    if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    {
+        entry.permissions = reader.u32();
+    }
+    if (flags & SSH_FILEXFER_ATTR_ACMODTIME)
+    {
+        reader.u32(); // atime
+        entry.mtime = reader.u32();
+    }
+    if (flags & SSH_FILEXFER_ATTR_EXTENDED)
+    {
+        quint32 extensions = reader.u32();
+        for (quint32 e = 0; e < extensions && reader.ok(); e++)
+        {
+            reader.string();
+            reader.string();
+        }
+    }
+    entry.isDirectory = (entry.permissions & FILE_TYPE_MASK) == FILE_TYPE_DIRECTORY;
+    return reader.ok();
+}
+
+ListingPipeline::ListingPipeline(ssh_session session)
+    : session(session)
+{
+}
+
+ListingPipeline::~ListingPipeline()
+{
+    close();
+}
+
+bool ListingPipeline::fail(const QString &message)
+{
+    error = message;
+    qDebug() << "Listing pipeline:" << message;
+    close();
+    return false;
+}
+
+///
+/// \brief ListingPipeline::open starts an SFTP subsystem on a channel of its own and agrees on version 3.
+///
+bool ListingPipeline::open()
+{
+    if (channel)
+    {
+        return true;
+    }
+    channel = ssh_channel_new(session);
+    if (!channel)
+    {
+        return fail(QString("Could not create a channel: %1").arg(ssh_get_error(session)));
+    }
+    if (ssh_channel_open_session(channel) != SSH_OK || ssh_channel_request_subsystem(channel, "sftp") != SSH_OK)
+    {
+        return fail(QString("Could not start SFTP: %1").arg(ssh_get_error(session)));
+    }
+
+    // INIT is the one packet without a request id.
+    QByteArray init;
+    putU32(init, 5);
+    init.append(char(SSH_FXP_INIT));
+    putU32(init, LIBSFTP_VERSION);
+    if (ssh_channel_write(channel, init.constData(), init.size()) != init.size())
+    {
+        return fail(QString("Could not start SFTP: %1").arg(ssh_get_error(session)));
+    }
+    quint8 type = 0;
+    QByteArray payload;
+    if (!readPacket(&type, &payload))
+    {
+        return false;
+    }
+    if (type != SSH_FXP_VERSION)
+    {
+        return fail(QString("Server answered INIT with packet type %1.").arg(type));
+    }
+    return true;
+}
+
+void ListingPipeline::close()
+{
+    if (channel)
+    {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        channel = nullptr;
+    }
+    outstanding.clear();
+}
+
+///
+/// \brief ListingPipeline::list lists the directories, reporting their entries with listed() as they arrive.
+/// \return false when the channel broke, directories not reported Complete or Failed by then were cut off.
+///
+bool ListingPipeline::list(const QStringList &directories, const Listed &listed)
+{
+    if (!open())
+    {
+        return false;
+    }
+    wireSample.clear();
+    QList<Listing> listings;
+    listings.reserve(directories.size());
+    int next = 0;
+
+    while (true)
+    {
+        while (outstanding.size() < MAX_OUTSTANDING && next < directories.size())
+        {
+            listings.append(Listing{directories.at(next), QByteArray(), {}, false});
+            QByteArray payload;
+            putString(payload, directories.at(next).toUtf8());
+            // Statted first, in the same round trip. A change after the stat makes the next check
+            // list again, one before it is in the listing.
+            quint32 statId = send(SSH_FXP_STAT, payload);
+            if (!statId)
+            {
+                return false;
+            }
+            outstanding.insert(statId, Request{Stat, next});
+            quint32 id = send(SSH_FXP_OPENDIR, payload);
+            if (!id)
+            {
+                return false;
+            }
+            outstanding.insert(id, Request{OpenDir, next});
+            next++;
+        }
+        if (outstanding.isEmpty())
+        {
+            return true;
+        }
+
+        quint8 type = 0;
+        QByteArray payload;
+        if (!readPacket(&type, &payload))
+        {
+            return false;
+        }
+        WireReader reader(payload);
+        quint32 id = reader.u32();
+        if (!reader.ok() || !outstanding.contains(id))
+        {
+            return fail(QString("Answer to an unknown request %1.").arg(id));
+        }
+        Request request = outstanding.take(id);
+        Listing &listing = listings[request.directory];
+
+        if (request.kind == CloseDir)
+        {
+            continue;
+        }
+        if (request.kind == Stat)
+        {
+            SFTPEntry own{};
+            if (type == SSH_FXP_ATTRS && readAttributes(reader, own))
+            {
+                listing.mtime = own.mtime;
+            }
+            continue;
+        }
+        if (type == SSH_FXP_HANDLE && request.kind == OpenDir)
+        {
+            listing.handle = reader.string();
+        }
+        else if (type == SSH_FXP_NAME && request.kind == ReadDir)
+        {
+            parseNames(payload, 4, listing);
+            if (!listing.reported || listing.entries.size() >= LISTING_BATCH_SIZE)
+            {
+                listed(listing.path, listing.entries, Partial, listing.mtime);
+                listing.entries.clear();
+                listing.reported = true;
+            }
+        }
+        else if (type == SSH_FXP_STATUS)
+        {
+            quint32 status = reader.u32();
+            QString message = QString::fromUtf8(reader.string());
+            bool complete = request.kind == ReadDir && status == SSH_FX_EOF;
+            if (!complete)
+            {
+                qDebug() << "Could not list" << listing.path << message;
+            }
+            listed(listing.path, listing.entries, complete ? Complete : Failed, listing.mtime);
+            listing.entries = QList<SFTPEntry>();
+            if (request.kind == ReadDir)
+            {
+                QByteArray close;
+                putString(close, listing.handle);
+                quint32 closeId = send(SSH_FXP_CLOSE, close);
+                if (!closeId)
+                {
+                    return false;
+                }
+                outstanding.insert(closeId, Request{CloseDir, request.directory});
+            }
+            continue;
+        }
+        else
+        {
+            return fail(QString("Unexpected answer of type %1 for %2.").arg(type).arg(listing.path));
+        }
+
+        // Opened or got a batch of names, ask for the next batch.
+        QByteArray read;
+        putString(read, listing.handle);
+        quint32 readId = send(SSH_FXP_READDIR, read);
+        if (!readId)
+        {
+            return false;
+        }
+        outstanding.insert(readId, Request{ReadDir, request.directory});
+    }
+}
+
+///
+/// \brief ListingPipeline::stat stats the paths with up to 64 STAT requests in flight, far cheaper
+/// than listing them to see whether they changed.
+/// \return false when the channel broke, paths not reported by then were cut off.
+///
+bool ListingPipeline::stat(const QStringList &paths, const Statted &statted)
+{
+    if (!open())
+    {
+        return false;
+    }
+    int next = 0;
+    while (true)
+    {
+        while (outstanding.size() < MAX_OUTSTANDING && next < paths.size())
+        {
+            QByteArray payload;
+            putString(payload, paths.at(next).toUtf8());
+            quint32 id = send(SSH_FXP_STAT, payload);
+            if (!id)
+            {
+                return false;
+            }
+            outstanding.insert(id, Request{Stat, next});
+            next++;
+        }
+        if (outstanding.isEmpty())
+        {
+            return true;
+        }
+
+        quint8 type = 0;
+        QByteArray payload;
+        if (!readPacket(&type, &payload))
+        {
+            return false;
+        }
+        WireReader reader(payload);
+        quint32 id = reader.u32();
+        if (!reader.ok() || !outstanding.contains(id))
+        {
+            return fail(QString("Answer to an unknown request %1.").arg(id));
+        }
+        const QString &path = paths.at(outstanding.take(id).directory);
+        SFTPEntry entry{};
+        if (type == SSH_FXP_ATTRS && readAttributes(reader, entry))
+        {
+            statted(path, entry.mtime);
+        }
+        else if (type == SSH_FXP_STATUS || type == SSH_FXP_ATTRS)
+        {
+            statted(path, -1);
+        }
+        else
+        {
+            return fail(QString("Unexpected answer of type %1 for %2.").arg(type).arg(path));
+        }
+    }
+}
+
+///
+/// \brief ListingPipeline::send writes a request without waiting for its answer.
+/// \return Id of the request, 0 if the channel broke.
+///
+quint32 ListingPipeline::send(quint8 type, const QByteArray &payload)
+{
+    quint32 id = nextId++;
+    if (id == 0)
+    {
+        id = nextId++;
+    }
+    QByteArray packet;
+    packet.reserve(9 + payload.size());
+    putU32(packet, 5 + payload.size());
+    packet.append(char(type));
+    putU32(packet, id);
+    packet.append(payload);
+    if (ssh_channel_write(channel, packet.constData(), packet.size()) != packet.size())
+    {
+        fail(QString("Could not send a request: %1").arg(ssh_get_error(session)));
+        return 0;
+    }
+    return id;
+}
+
+bool ListingPipeline::readPacket(quint8 *type, QByteArray *payload)
+{
+    char header[5];
+    if (!readExactly(header, 4))
+    {
+        return false;
+    }
+    quint32 length = qFromBigEndian<quint32>(header);
+    if (length < 1 || length > MAX_PACKET_SIZE)
+    {
+        return fail(QString("Malformed packet of %1 bytes.").arg(length));
+    }
+    if (!readExactly(header + 4, 1))
+    {
+        return false;
+    }
+    *type = static_cast<quint8>(header[4]);
+    payload->resize(length - 1);
+    return readExactly(payload->data(), length - 1);
+}
+
+bool ListingPipeline::readExactly(char *buffer, quint32 length)
+{
+    quint32 done = 0;
+    while (done < length)
+    {
+        int rc = ssh_channel_read_timeout(channel, buffer + done, length - done, 0, READ_TIMEOUT_MS);
+        if (rc < 0)
+        {
+            return fail(QString("Read failed: %1").arg(ssh_get_error(session)));
+        }
+        if (rc == 0)
+        {
+            return fail(ssh_channel_is_eof(channel) ? QString("The server closed the SFTP channel.")
+                                                     : QString("No answer within %1 s.").arg(READ_TIMEOUT_MS / 1000));
+        }
+        done += rc;
+    }
+    return true;
+}
+
+///
+/// \brief ListingPipeline::parseNames turns an SSH_FXP_NAME answer into entries the same way
+/// libssh does, owner and group come from the long name.
+///
+void ListingPipeline::parseNames(const QByteArray &payload, int offset, Listing &listing)
+{
+    WireReader reader(payload, offset);
+    quint32 count = reader.u32();
+    QString fixedDir = listing.path + "/";
+    for (quint32 i = 0; i < count && reader.ok(); i++)
+    {
+        QByteArray name = reader.string();
+        QByteArray longname = reader.string();
+        SFTPEntry entry{};
+        if (!readAttributes(reader, entry))
+        {
+            qDebug() << "Truncated listing of" << listing.path;
+            break;
+        }
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+
+        entry.name = QString::fromUtf8(name);
+        entry.path = fixedDir + entry.name;
+        // "drwxr-xr-x 2 owner group ..."
+        QList<QByteArray> fields = longname.simplified().split(' ');
+        if (fields.size() > 3)
+        {
+            entry.owner = QString::fromUtf8(fields.at(2));
+            entry.group = QString::fromUtf8(fields.at(3));
+        }
+        listing.entries.append(entry);
+
+        if (wireSample.size() < MAX_SAMPLE_SIZE)
+        {
+            wireSample.append(longname).append('\n');
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef LISTINGPIPELINE_H
+#define LISTINGPIPELINE_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <functional>
+#include <libssh/libssh.h>
+#include "sshwrapper.h"
+
+///
+/// \brief The ListingPipeline class lists many directories at once over its own SFTP channel
+/// of an already connected session. libssh waits for the answer to every OPENDIR and READDIR
+/// before sending the next request, so listing N directories costs several round trips each.
+/// Here up to 64 requests are in flight and answers are matched to their directory by request id.
+/// Entries are reported in batches as they arrive, the first batch of a directory after its first
+/// READDIR answer, so only a batch per directory is ever held. Listing a few hundred directories
+/// takes a few round trips. Stats are pipelined the same way. Runs synchronously on the caller's thread.
+///
+class ListingPipeline
+{
+public:
+    enum Progress { Partial, Complete, Failed };
+    // Called with every batch, the last one of a directory is Complete, or Failed if it could not be listed.
+    // mtime is the directory's own, statted just before it was opened, -1 if unknown.
+    using Listed = std::function<void(const QString &directory, const QList<SFTPEntry> &entries, Progress progress, qint64 mtime)>;
+    // Called once per path with its mtime, -1 if it could not be statted.
+    using Statted = std::function<void(const QString &path, qint64 mtime)>;
+
+    explicit ListingPipeline(ssh_session session);
+    ~ListingPipeline();
+
+    bool open();
+    bool isOpen() const { return channel != nullptr; }
+    void close();
+    bool list(const QStringList &directories, const Listed &listed);
+    bool stat(const QStringList &paths, const Statted &statted);
+
+    // Long names of the first entries of the last list(), what a listing looks like on the wire.
+    const QByteArray& sample() const { return wireSample; }
+    const QString& errorString() const { return error; }
+
+private:
+    enum RequestKind { OpenDir, ReadDir, CloseDir, Stat };
+    struct Request {
+        RequestKind kind;
+        int directory; // Index into the directories being listed or the paths being statted.
+    };
+    struct Listing {
+        QString path;
+        QByteArray handle;
+        QList<SFTPEntry> entries; // Not reported yet.
+        bool reported = false;
+        qint64 mtime = -1;
+    };
+
+    ssh_session session;
+    ssh_channel channel = nullptr;
+    quint32 nextId = 1;
+    QHash<quint32, Request> outstanding;
+    QByteArray wireSample;
+    QString error;
+
+    quint32 send(quint8 type, const QByteArray &payload);
+    bool readPacket(quint8 *type, QByteArray *payload);
+    bool readExactly(char *buffer, quint32 length);
+    void parseNames(const QByteArray &payload, int offset, Listing &listing);
+    bool fail(const QString &message);
+};
+
+#endif // LISTINGPIPELINE_H
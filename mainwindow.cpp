@@ -1,8 +1,18 @@
 #include "mainwindow.h"
 #include "./ui_mainwindow.h"
 #include "connectiondialog.h"
+#include "refreshscheduler.h"
 #include <QThread>
 #include <qlabel.h>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QMenu>
+#include <QMessageBox>
+#include <QInputDialog>
+#include <QElapsedTimer>
+
+// A list to pick from, not a report.
+#define MAX_FIND_RESULTS 1000
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -20,18 +30,121 @@ MainWindow::MainWindow(QWidget *parent)
     });
     QLabel *connectionLabel = new QLabel();
     ui->statusbar->addWidget(connectionLabel);
-    connect(&cm, &ConnectionManager::connectionStatus, connectionLabel, [connectionLabel](bool status){
-        if (status)
+    auto updateConnectionLabel = [this, connectionLabel](){
+        QStringList rtts;
+        for (const ConnectionInfo &c : cm.getConnections())
+        {
+            if (cm.isConnected(c.name))
+            {
+                rtts.append(QString("%1: %2 ms").arg(c.name).arg(cm.rttMs(c.name), 0, 'f', 1));
+            }
+        }
+        connectionLabel->setToolTip(rtts.join("\n"));
+        int count = cm.connectedCount();
+        if (count > 0)
         {
-            connectionLabel->setText("<font color='green'>&#9679;</font> Connected");
+            connectionLabel->setText(QString("<font color='green'>&#9679;</font> Connected to %1 host(s)").arg(count));
         }
         else
         {
             connectionLabel->setText("<font color='red'>&#9679;</font> Not Connected");
 
         }
+    };
+    connect(&cm, &ConnectionManager::connectionStatus, connectionLabel, updateConnectionLabel);
+    connect(&cm, &ConnectionManager::connectionRtt, connectionLabel, updateConnectionLabel);
+    updateConnectionLabel();
+    // Connecting runs on the session's thread, it only asks this thread for answers.
+    connect(&cm, &ConnectionManager::connectProgress, this, [this](const QString &connName, const QString &phase){
+        ui->statusbar->showMessage(QString("%1: %2").arg(connName, phase), 5000);
+    });
+    connect(&cm, &ConnectionManager::connectTimed, this, [this](const QString &connName, const ConnectTimings &timings){
+        ui->statusbar->showMessage(QString("%1: %2").arg(connName, timings.summary()), 10000);
+    });
+    connect(&cm, &ConnectionManager::connectFailed, this, [this](const QString &connName, const QString &message, bool cancelled){
+        ui->statusbar->clearMessage();
+        if (!cancelled)
+        {
+            QMessageBox::warning(this, connName, message);
+        }
+    });
+    connect(&cm, &ConnectionManager::hostKeyQuestion, this, [this](const QString &connName, const QString &message){
+        QMessageBox msgBox(this);
+        msgBox.setWindowTitle(connName);
+        msgBox.setText(message);
+        msgBox.setIcon(QMessageBox::Warning);
+        msgBox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
+        msgBox.setDefaultButton(QMessageBox::No);
+        cm.answerHostKey(connName, msgBox.exec() == QMessageBox::Yes);
+    });
+    connect(&cm, &ConnectionManager::passwordQuestion, this, [this](const QString &connName, const QString &prompt){
+        bool ok = false;
+        QString password = QInputDialog::getText(this, connName, prompt, QLineEdit::Password, QString(), &ok);
+        cm.answerPassword(connName, password, ok);
+    });
+    connect(&cm, &ConnectionManager::hostActivated, this, [this](const QString &connName){
+        QModelIndex index = fs.hostIndex(connName);
+        if (index.isValid())
+        {
+            ui->treeView->setCurrentIndex(index);
+            ui->treeView->scrollTo(index, QAbstractItemView::PositionAtTop);
+        }
+    });
+    connect(&cm, &ConnectionManager::homeResolved, this, [this](const QString &connName, const QString &home){
+        // The session already listed all of the way there.
+        reveal(fs.pathIndex(connName, home));
+    });
+    connect(&cm, &ConnectionManager::startupTimed, this, [this](const QString &connName, const StartupTimings &timings){
+        ui->statusbar->showMessage(QString("%1: %2").arg(connName, timings.summary()), 10000);
     });
 
+    connect(&cm, &ConnectionManager::indexProgress, this, [this](const QString &connName, qsizetype paths, bool finished, const QString &error){
+        if (!finished)
+        {
+            ui->statusbar->showMessage(QString("%1: indexing, %2 paths so far...").arg(connName).arg(paths));
+        }
+        else if (error.isEmpty())
+        {
+            ui->statusbar->showMessage(QString("%1: indexed %2 paths.").arg(connName).arg(paths), 10000);
+        }
+        else
+        {
+            ui->statusbar->showMessage(QString("%1: indexed %2 paths, stopped early: %3").arg(connName).arg(paths).arg(error), 10000);
+        }
+    });
+
+    connect(&cm, &ConnectionManager::transferFinished, this, [this](const TransferStats &stats){
+        ui->statusbar->showMessage(stats.summary(), 10000);
+    });
+
+    QLabel *compressionLabel = new QLabel();
+    ui->statusbar->addPermanentWidget(compressionLabel);
+    connect(&cm, &ConnectionManager::compressionStatus, compressionLabel, &QLabel::setText);
+
+    // Transfer queue state
+    QLabel *transferLabel = new QLabel();
+    ui->statusbar->addPermanentWidget(transferLabel);
+    connect(&cm, &ConnectionManager::transfersChanged, transferLabel, [this, transferLabel](){
+        int queued = 0, active = 0, finished = 0, failed = 0;
+        double bytesPerSecond = 0;
+        for (TransferManager *transfers : cm.transferManagers())
+        {
+            queued += transfers->queuedCount();
+            active += transfers->activeCount();
+            finished += transfers->finishedCount();
+            failed += transfers->failedCount();
+            bytesPerSecond += transfers->bytesPerSecond();
+        }
+        transferLabel->setText(QString("Transfers: %1 queued, %2 active, %3 done, %4 failed, %5 KiB/s")
+                                   .arg(queued)
+                                   .arg(active)
+                                   .arg(finished)
+                                   .arg(failed)
+                                   .arg(bytesPerSecond / 1024, 0, 'f', 1));
+    });
+    ui->treeView->setContextMenuPolicy(Qt::CustomContextMenu);
+    connect(ui->treeView, &QTreeView::customContextMenuRequested, this, &MainWindow::showTreeContextMenu);
+
     // Connect request connection to the connection manager.
     connect(this, &MainWindow::requestConnection, &cm, &ConnectionManager::onConnectionRequest);
     connect(ui->treeView, &QTreeView::expanded, &fs, &RemoteFileSystem::onItemExpanded);
@@ -53,7 +166,12 @@ MainWindow::MainWindow(QWidget *parent)
     ui->treeView->header()->setSectionResizeMode(2, QHeaderView::Stretch);
     ui->treeView->header()->setStretchLastSection(false);
 
+    new RefreshScheduler(&fs, ui->treeView, this);
+
     populateConnectionList();
+
+    // Once the window is up, so connecting doesn't hold up the first paint.
+    QTimer::singleShot(0, &cm, &ConnectionManager::prewarmSaved);
 }
 
 MainWindow::~MainWindow()
@@ -82,8 +200,12 @@ void MainWindow::populateConnectionList()
             QMenu* cMenu = new QMenu(c.name, this);
             QAction* connectAction = new QAction("Connect", cMenu);
             QAction* editAction = new QAction("Edit", cMenu);
+            QAction* cancelAction = new QAction("Cancel Connecting", cMenu);
+            QAction* disconnectAction = new QAction("Disconnect", cMenu);
             QAction* deleteAction = new QAction("Delete", cMenu);
             cMenu->addAction(connectAction);
+            cMenu->addAction(cancelAction);
+            cMenu->addAction(disconnectAction);
             cMenu->addAction(editAction);
             cMenu->addSeparator();
             cMenu->addAction(deleteAction);
@@ -92,6 +214,12 @@ void MainWindow::populateConnectionList()
             connect(connectAction, &QAction::triggered, this, [this, c]() {
                 emit requestConnection(c);
             });
+            connect(cancelAction, &QAction::triggered, this, [this, c]() {
+                cm.cancelConnect(c.name);
+            });
+            connect(disconnectAction, &QAction::triggered, this, [this, c]() {
+                cm.disconnectHost(c.name);
+            });
             connect(editAction, &QAction::triggered, this, [this, c]() {
                 this->popup_connection_editor(c.name);
                 populateConnectionList();
@@ -99,6 +227,7 @@ void MainWindow::populateConnectionList()
             connect(deleteAction, &QAction::triggered, this, [this, c]() {
                 if (QMessageBox::question(this, "", "Are you sure you want to delete " + c.name, QMessageBox::Yes|QMessageBox::No) == QMessageBox::Yes)
                 {
+                    cm.disconnectHost(c.name);
                     cm.removeConnection(c.name);
                     populateConnectionList();
                 }
@@ -110,6 +239,114 @@ void MainWindow::populateConnectionList()
     }
 }
 
+void MainWindow::showTreeContextMenu(const QPoint &pos)
+{
+    QModelIndex index = ui->treeView->indexAt(pos);
+    if (!index.isValid())
+    {
+        return;
+    }
+    SFTPEntry entry = fs.entry(index);
+    TransferManager *transfers = cm.transferManager(fs.hostOf(index));
+    if (!transfers)
+    {
+        return;
+    }
+
+    QMenu menu(this);
+    menu.addAction("Download to...", this, [this, entry, transfers]() {
+        QString localDir = QFileDialog::getExistingDirectory(this, "Download to");
+        if (!localDir.isEmpty())
+        {
+            transfers->download(entry.path, localDir + "/" + entry.name, entry.isDirectory, entry.size);
+        }
+    });
+    if (entry.isDirectory)
+    {
+        menu.addAction("Upload files here...", this, [this, entry, transfers]() {
+            for (const QString &localPath : QFileDialog::getOpenFileNames(this, "Upload files"))
+            {
+                transfers->upload(localPath, entry.path + "/" + QFileInfo(localPath).fileName());
+            }
+        });
+        menu.addAction("Upload folder here...", this, [this, entry, transfers]() {
+            QString localDir = QFileDialog::getExistingDirectory(this, "Upload folder");
+            if (!localDir.isEmpty())
+            {
+                transfers->upload(localDir, entry.path + "/" + QFileInfo(localDir).fileName());
+            }
+        });
+    }
+    QString host = fs.hostOf(index);
+    menu.addSeparator();
+    if (entry.isDirectory)
+    {
+        menu.addAction("Index everything under here", this, [this, host, entry]() {
+            cm.indexTree(host, entry.path);
+        });
+    }
+    if (cm.indexedPaths(host) > 0)
+    {
+        menu.addAction("Find in index...", this, [this, host]() {
+            findInIndex(host);
+        });
+    }
+    menu.exec(ui->treeView->viewport()->mapToGlobal(pos));
+}
+
+///
+/// \brief MainWindow::findInIndex asks for a name, part of one or a glob, searches the index of
+/// the host and shows the picked match in the tree.
+///
+void MainWindow::findInIndex(const QString &host)
+{
+    bool ok = false;
+    QString pattern = QInputDialog::getText(this, "Find", "Name, part of a name or glob (*.log, src/*.cpp):", QLineEdit::Normal, QString(), &ok);
+    if (!ok || pattern.isEmpty())
+    {
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    QStringList matches = cm.searchIndex(host, pattern, MAX_FIND_RESULTS);
+    qint64 ms = timer.elapsed();
+    if (matches.isEmpty())
+    {
+        ui->statusbar->showMessage(QString("No path on %1 matches %2 (%3 ms).").arg(host, pattern).arg(ms), 10000);
+        return;
+    }
+    QString label = QString("%1%2 matches in %3 ms:").arg(matches.size() == MAX_FIND_RESULTS ? "First " : "").arg(matches.size()).arg(ms);
+    QString picked = QInputDialog::getItem(this, "Find", label, matches, 0, false, &ok);
+    if (ok)
+    {
+        // The walk filled in the tree, nothing on the way there needs listing.
+        reveal(fs.pathIndex(host, picked));
+    }
+}
+
+///
+/// \brief MainWindow::reveal opens the tree down to index and selects it, without asking for
+/// listings on the way.
+///
+void MainWindow::reveal(const QModelIndex &index)
+{
+    if (!index.isValid())
+    {
+        return;
+    }
+    const QSignalBlocker blocker(ui->treeView);
+    for (QModelIndex ancestor = index.parent(); ancestor.isValid(); ancestor = ancestor.parent())
+    {
+        ui->treeView->expand(ancestor);
+    }
+    if (fs.hasChildren(index))
+    {
+        ui->treeView->expand(index);
+    }
+    ui->treeView->setCurrentIndex(index);
+    ui->treeView->scrollTo(index, QAbstractItemView::PositionAtTop);
+}
+
 ConnectionInfo MainWindow::popup_connection_editor(QString name)
 {
     ConnectionDialog dlg;
@@ -119,20 +356,25 @@ ConnectionInfo MainWindow::popup_connection_editor(QString name)
         ConnectionInfo c = cm.getConnection(name);
         tag = c.name;
         dlg.setValues(c.user, c.host, c.port);
+        dlg.setCompression(c.compression);
+        dlg.setKeepaliveInterval(c.keepaliveInterval);
+        dlg.setPrewarm(c.prewarm);
     }
 
 
     auto out = dlg.exec();
-    ConnectionInfo newConnection;
+    ConnectionInfo newConnection = cm.getConnection(name); // Keeps what the dialog doesn't edit.
     newConnection.user = dlg.user();
     newConnection.host = dlg.host();
     newConnection.port = dlg.port();
+    newConnection.compression = dlg.compression();
+    newConnection.keepaliveInterval = dlg.keepaliveInterval();
+    newConnection.prewarm = dlg.prewarm();
     newConnection.name = dlg.user() + "@" + dlg.host();
 
     if (out == QDialog::Accepted)
     {
-        cm.removeConnection(tag);
-        cm.addConnection(newConnection);
+        cm.updateConnection(tag, newConnection);
         populateConnectionList();
         return newConnection;
     }
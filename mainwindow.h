@@ -28,6 +28,9 @@ private:
     ConnectionManager cm;
 
     void populateConnectionList();
+    void showTreeContextMenu(const QPoint &pos);
+    void findInIndex(const QString &host);
+    void reveal(const QModelIndex &index);
 signals:
     void requestConnection(const ConnectionInfo& con);
 };
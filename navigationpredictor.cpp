@@ -0,0 +1,167 @@
+#include "navigationpredictor.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cmath>
+
+#define HALF_LIFE_SECONDS (14 * 24 * 3600)
+#define MAX_VISITS 500        // Directories remembered, the least used are forgotten first.
+#define MAX_RECENT 10
+#define SIBLING_WEIGHT 0.5    // Next to something opened last, worth half an open.
+
+NavigationPredictor::NavigationPredictor(const QString &host)
+{
+    QString name = QCryptographicHash::hash(host.toUtf8(), QCryptographicHash::Sha1).toHex() + ".json";
+    path = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/navigation/" + name;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return;
+    }
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    for (const QJsonValue &value : root.value("visits").toArray())
+    {
+        QJsonObject visit = value.toObject();
+        visits.insert(visit.value("path").toString(), Visit{visit.value("count").toDouble(), visit.value("last").toString().toLongLong()});
+    }
+    for (const QJsonValue &value : root.value("recent").toArray())
+    {
+        recent.append(value.toString());
+    }
+}
+
+///
+/// \brief NavigationPredictor::opened records that the user opened the directory at path.
+///
+void NavigationPredictor::opened(const QString &path)
+{
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    if (!visits.contains(path) && visits.size() >= MAX_VISITS)
+    {
+        auto least = std::min_element(visits.cbegin(), visits.cend(), [this, now](const Visit &a, const Visit &b) {
+            return weight(a, now) < weight(b, now);
+        });
+        visits.erase(least);
+    }
+    Visit &visit = visits[path];
+    visit.count = weight(visit, now) + 1;
+    visit.lastOpened = now;
+
+    recent.removeAll(path);
+    recent.prepend(path);
+    if (recent.size() > MAX_RECENT)
+    {
+        recent.removeLast();
+    }
+}
+
+///
+/// \brief NavigationPredictor::predict picks the children of a directory worth listing before
+/// anybody opens them.
+/// \param children Full paths of the subdirectories of directory.
+/// \return At most budget of them, the likeliest first. Children nothing points at are left out.
+///
+QStringList NavigationPredictor::predict(const QString &directory, const QStringList &children, int budget) const
+{
+    if (budget <= 0 || children.isEmpty())
+    {
+        return QStringList();
+    }
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    QString prefix = directory == "/" ? directory : directory + "/";
+    QHash<QString, double> scores;
+
+    // An open anywhere below a child counts for the child, it is on the way there.
+    for (auto it = visits.cbegin(); it != visits.cend(); it++)
+    {
+        if (!it.key().startsWith(prefix) || it.key().size() == prefix.size())
+        {
+            continue;
+        }
+        qsizetype slash = it.key().indexOf('/', prefix.size());
+        scores[slash < 0 ? it.key() : it.key().left(slash)] += weight(it.value(), now);
+    }
+    // The user tends to look around where they just were.
+    for (int i = 0; i < recent.size(); i++)
+    {
+        const QString &opened = recent.at(i);
+        if (opened.size() > prefix.size() && opened.startsWith(prefix) && opened.indexOf('/', prefix.size()) < 0)
+        {
+            double bonus = SIBLING_WEIGHT * (MAX_RECENT - i) / MAX_RECENT;
+            for (const QString &child : children)
+            {
+                if (child != opened)
+                {
+                    scores[child] += bonus / children.size();
+                }
+            }
+        }
+    }
+
+    QList<QPair<double, QString>> ranked;
+    for (const QString &child : children)
+    {
+        double score = scores.value(child);
+        if (score > 0)
+        {
+            ranked.append({score, child});
+        }
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const QPair<double, QString> &a, const QPair<double, QString> &b) {
+        return a.first > b.first;
+    });
+    QStringList picked;
+    for (int i = 0; i < ranked.size() && i < budget; i++)
+    {
+        picked.append(ranked.at(i).second);
+    }
+    return picked;
+}
+
+void NavigationPredictor::save() const
+{
+    QJsonArray jsonVisits;
+    for (auto it = visits.cbegin(); it != visits.cend(); it++)
+    {
+        jsonVisits.append(QJsonObject{
+            {"path", it.key()},
+            {"count", it.value().count},
+            {"last", QString::number(it.value().lastOpened)},
+        });
+    }
+    QJsonObject root;
+    root.insert("visits", jsonVisits);
+    root.insert("recent", QJsonArray::fromStringList(recent));
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "Can't write navigation history" << path << file.errorString();
+        return;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    if (!file.commit())
+    {
+        qDebug() << "Can't write navigation history" << path << file.errorString();
+    }
+}
+
+///
+/// \brief NavigationPredictor::weight
+/// \return The count of the visit as it stands now, each open loses half its weight per half life.
+///
+double NavigationPredictor::weight(const Visit &visit, qint64 now) const
+{
+    return visit.count * std::exp2(-double(now - visit.lastOpened) / HALF_LIFE_SECONDS);
+}
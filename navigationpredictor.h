@@ -0,0 +1,35 @@
+#ifndef NAVIGATIONPREDICTOR_H
+#define NAVIGATIONPREDICTOR_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+
+///
+/// \brief The NavigationPredictor class guesses which directories of a host will be opened next,
+/// from the directories opened on it before. A directory scores for every time it or something
+/// below it was opened, halving every two weeks, and the siblings of the last few opened ones score
+/// a little. The history is a small JSON file per connection that outlives the session.
+///
+class NavigationPredictor
+{
+public:
+    explicit NavigationPredictor(const QString &host);
+
+    void opened(const QString &path);
+    QStringList predict(const QString &directory, const QStringList &children, int budget) const;
+    void save() const;
+
+private:
+    struct Visit {
+        double count = 0;  // Decayed to lastOpened.
+        qint64 lastOpened = 0;
+    };
+    QString path;
+    QHash<QString, Visit> visits;
+    QStringList recent; // Last opened first.
+
+    double weight(const Visit &visit, qint64 now) const;
+};
+
+#endif // NAVIGATIONPREDICTOR_H
@@ -0,0 +1,159 @@
+#include "paralleltransfer.h"
+#include "transferjournal.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <algorithm>
+
+// Ranges start on a boundary so every stream issues full sized requests.
+#define RANGE_ALIGNMENT (1024 * 1024)
+
+ParallelDownload::ParallelDownload(const SessionCredentials &credentials, int streams)
+    : credentials(credentials), streams(std::max(1, streams))
+{
+}
+
+bool ParallelDownload::run(const QString &remotePath, const QString &localPath, quint64 size, qint64 mtime)
+{
+    lastStats = TransferStats{};
+    lastStats.remotePath = remotePath;
+    lastStats.localPath = localPath;
+    error.clear();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    TransferJournal journal(credentials.scope(), remotePath, localPath, false);
+    bool resume = journal.load() && journal.matches(size, mtime) && QFileInfo::exists(localPath);
+    if (resume)
+    {
+        lastStats.resumedBytes = journal.committedBytes();
+        qDebug() << "Resuming" << remotePath << "with" << lastStats.resumedBytes << "bytes already in place";
+    }
+    else
+    {
+        journal.start(size, mtime);
+    }
+
+    // Every stream writes at its own offset, so the file needs its final size up front.
+    QFile localFile(localPath);
+    QIODevice::OpenMode mode = resume ? QIODevice::ReadWrite : (QIODevice::Truncate | QIODevice::WriteOnly);
+    if (!localFile.open(mode) || !localFile.resize(size))
+    {
+        error = QString("Can't open file '%1' for writing: %2").arg(localPath, localFile.errorString());
+        qDebug() << error;
+        return false;
+    }
+    localFile.close();
+
+    quint64 rangeSize = (size / streams + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT * RANGE_ALIGNMENT;
+    rangeSize = std::max<quint64>(rangeSize, RANGE_ALIGNMENT);
+    ranges.clear();
+    for (quint64 offset = 0; offset < size; offset += rangeSize)
+    {
+        ranges.enqueue(ByteRange(offset, std::min(offset + rangeSize, size)));
+    }
+    openedStreams = 0;
+    sessionError.clear();
+
+    QList<QThread*> workers;
+    for (int i = 0; i < std::min<int>(streams, ranges.size()); i++)
+    {
+        QThread *worker = QThread::create([this, &journal]() {
+            runStream(&journal);
+        });
+        workers.append(worker);
+        worker->start();
+    }
+    for (QThread *worker : workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+    if (error.isEmpty() && !ranges.isEmpty())
+    {
+        // Not a single session could be opened.
+        error = sessionError;
+    }
+
+    if (!error.isEmpty())
+    {
+        if (journal.committedBytes() > 0)
+        {
+            // Keep what arrived, the next attempt only fetches the rest.
+            journal.save(true);
+            error += " The partial file was kept and the transfer will resume.";
+            return false;
+        }
+        if (!localFile.remove())
+        {
+            qDebug() << QString("Failed to remove file: '%1'").arg(localPath);
+        }
+        return false;
+    }
+
+    journal.remove();
+    lastStats.streams = openedStreams;
+    lastStats.elapsedMs = timer.elapsed();
+    qDebug() << lastStats.summary();
+    return true;
+}
+
+///
+/// \brief ParallelDownload::runStream opens one session and fetches ranges from the queue
+/// until it is empty or a range fails. A session that can't be opened leaves its share to
+/// the other streams.
+///
+void ParallelDownload::runStream(TransferJournal *journal)
+{
+    ssh_session session = nullptr;
+    sftp_session sftp = nullptr;
+    QString openError;
+    if (!SSHWrapper::openAuxiliarySession(credentials, &session, &sftp, &openError))
+    {
+        qDebug() << "Download stream not opened, continuing with fewer:" << openError;
+        QMutexLocker locker(&mutex);
+        sessionError = openError;
+        return;
+    }
+    {
+        QMutexLocker locker(&mutex);
+        openedStreams++;
+    }
+
+    SftpTransfer transfer(session, sftp);
+    transfer.setJournal(journal);
+    transfer.setCancelFlag(cancelFlag);
+    while (true)
+    {
+        ByteRange range;
+        {
+            QMutexLocker locker(&mutex);
+            if (ranges.isEmpty() || !error.isEmpty())
+            {
+                break;
+            }
+            range = ranges.dequeue();
+        }
+        bool ok = transfer.downloadRange(lastStats.remotePath, lastStats.localPath, range.first, range.second - range.first);
+
+        QMutexLocker locker(&mutex);
+        if (!ok && error.isEmpty())
+        {
+            error = transfer.errorString();
+        }
+        const TransferStats &rangeStats = transfer.stats();
+        lastStats.bytes += rangeStats.bytes;
+        lastStats.windowDepth = std::max(lastStats.windowDepth, rangeStats.windowDepth);
+        lastStats.requestSize = rangeStats.requestSize;
+        lastStats.rttMs = std::max(lastStats.rttMs, rangeStats.rttMs);
+        if (!ok)
+        {
+            break;
+        }
+    }
+
+    SSHWrapper::closeAuxiliarySession(session, sftp);
+}
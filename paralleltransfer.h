@@ -0,0 +1,45 @@
+#ifndef PARALLELTRANSFER_H
+#define PARALLELTRANSFER_H
+
+#include "sshwrapper.h"
+#include "sftptransfer.h"
+#include <QMutex>
+#include <QQueue>
+
+class TransferJournal;
+
+///
+/// \brief The ParallelDownload class splits a large file into byte ranges and fetches
+/// them over several SSH sessions, each on its own thread. A single session is limited
+/// by one cipher stream, several of them can saturate much faster links. Streams take
+/// ranges from a shared queue, so if some sessions can't be opened the others fetch
+/// their ranges too.
+///
+class ParallelDownload
+{
+public:
+    ParallelDownload(const SessionCredentials &credentials, int streams);
+
+    bool run(const QString &remotePath, const QString &localPath, quint64 size, qint64 mtime);
+    // Handed to the transfer of every stream, see SftpTransfer::setCancelFlag.
+    void setCancelFlag(const std::atomic<bool> *flag) { cancelFlag = flag; }
+
+    const TransferStats& stats() const { return lastStats; }
+    const QString& errorString() const { return error; }
+
+private:
+    SessionCredentials credentials;
+    int streams;
+    const std::atomic<bool> *cancelFlag = nullptr;
+
+    QMutex mutex;
+    QQueue<ByteRange> ranges; // Not taken by a stream yet.
+    int openedStreams = 0;
+    QString sessionError;
+    TransferStats lastStats;
+    QString error;
+
+    void runStream(TransferJournal *journal);
+};
+
+#endif // PARALLELTRANSFER_H
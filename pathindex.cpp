@@ -0,0 +1,215 @@
+#include "pathindex.h"
+#include <QRegularExpression>
+#include <algorithm>
+#include <numeric>
+
+void PathIndex::clear()
+{
+    names.clear();
+    records.clear();
+    directories.clear();
+    directoryIds.clear();
+    postings.clear();
+}
+
+void PathIndex::add(const QString &directory, const QList<SFTPEntry> &entries)
+{
+    auto it = directoryIds.constFind(directory);
+    if (it == directoryIds.constEnd())
+    {
+        it = directoryIds.insert(directory, directories.size());
+        directories.append(directory);
+    }
+    quint32 directoryId = it.value();
+    for (const SFTPEntry &entry : entries)
+    {
+        quint32 id = records.size();
+        QByteArray utf8 = entry.name.toUtf8();
+        records.append(Record{quint32(names.size()), quint32(utf8.size()), directoryId});
+        names.append(utf8);
+        for (quint32 trigram : trigrams(entry.name))
+        {
+            postings[trigram].append(id);
+        }
+    }
+}
+
+///
+/// \brief PathIndex::search
+/// \param pattern A part of a name or path, or a glob with * ? and [...]. Case does not matter.
+/// \return Up to limit matching paths, in the order they were added.
+///
+QStringList PathIndex::search(const QString &pattern, int limit) const
+{
+    QStringList found;
+    if (pattern.isEmpty())
+    {
+        return found;
+    }
+    static const QRegularExpression wildcards("[*?\\[]");
+    bool glob = pattern.contains(wildcards);
+    bool wholePath = pattern.contains('/');
+
+    // Only the part after the last '/' is about the name, and only its literal runs are certain to be in it.
+    QString namePart = pattern.mid(pattern.lastIndexOf('/') + 1);
+    static const QRegularExpression notLiteral("\\[[^\\]]*\\]|[*?]");
+    QList<quint32> wanted;
+    for (const QString &literal : namePart.split(notLiteral, Qt::SkipEmptyParts))
+    {
+        wanted += trigrams(literal);
+    }
+
+    // A plain pattern with a '/' is found anywhere in the path. It lies within the directory, or
+    // it runs into the name and then the name starts with its last part. Directories are few, they
+    // are matched one by one and the trigrams only narrow down the second case.
+    QList<bool> directoryMatches;
+    if (wholePath && !glob)
+    {
+        directoryMatches.resize(directories.size());
+        for (qsizetype i = 0; i < directories.size(); i++)
+        {
+            const QString &directory = directories.at(i);
+            directoryMatches[i] = (directory == "/" ? directory : directory + "/").contains(pattern, Qt::CaseInsensitive);
+        }
+    }
+
+    // The shortest posting list first, every other one can only shrink it.
+    QList<const QList<quint32>*> lists;
+    bool unknownTrigram = false;
+    for (quint32 trigram : std::as_const(wanted))
+    {
+        auto it = postings.constFind(trigram);
+        if (it == postings.constEnd())
+        {
+            unknownTrigram = true;
+            break;
+        }
+        lists.append(&it.value());
+    }
+    if (unknownTrigram && !directoryMatches.contains(true))
+    {
+        return found;
+    }
+    std::sort(lists.begin(), lists.end(), [](const QList<quint32>* a, const QList<quint32>* b) {
+        return a->size() < b->size();
+    });
+    QList<quint32> candidates;
+    if (!lists.isEmpty() && !unknownTrigram)
+    {
+        candidates = *lists.first();
+        for (int i = 1; i < lists.size() && !candidates.isEmpty(); i++)
+        {
+            QList<quint32> both;
+            std::set_intersection(candidates.cbegin(), candidates.cend(), lists.at(i)->cbegin(), lists.at(i)->cend(), std::back_inserter(both));
+            candidates = both;
+        }
+    }
+
+    QRegularExpression expression;
+    if (glob)
+    {
+        // A glob with a '/' may start anywhere in the path, one without has to match the whole name.
+        QString regex = wholePath && !pattern.startsWith('/') ? "(^|/)" : "^";
+        for (qsizetype i = 0; i < pattern.size(); i++)
+        {
+            QChar c = pattern.at(i);
+            qsizetype close = c == '[' ? pattern.indexOf(']', i + 1) : -1;
+            if (c == '*')
+            {
+                regex += wholePath ? "[^/]*" : ".*";
+            }
+            else if (c == '?')
+            {
+                regex += ".";
+            }
+            else if (close > i + 1)
+            {
+                QString set = pattern.mid(i + 1, close - i - 1);
+                if (set.startsWith('!'))
+                {
+                    set[0] = '^';
+                }
+                regex += "[" + set + "]";
+                i = close;
+            }
+            else
+            {
+                regex += QRegularExpression::escape(QString(c));
+            }
+        }
+        expression.setPattern(regex + "$");
+        expression.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+    }
+    auto matches = [&](const Record &record) {
+        QString text = wholePath ? path(record) : name(record);
+        return glob ? expression.match(text).hasMatch() : text.contains(pattern, Qt::CaseInsensitive);
+    };
+
+    if (!directoryMatches.isEmpty())
+    {
+        // Every path in order: the ones under a matching directory are in, the others only if
+        // their name is a candidate and they match. A pattern ending in '/' never runs into a name.
+        bool narrowed = namePart.isEmpty() || !lists.isEmpty() || unknownTrigram;
+        auto candidate = candidates.cbegin();
+        for (quint32 id = 0; id < quint32(records.size()) && found.size() < limit; id++)
+        {
+            const Record &record = records.at(id);
+            while (candidate != candidates.cend() && *candidate < id)
+            {
+                candidate++;
+            }
+            bool isCandidate = !narrowed || (candidate != candidates.cend() && *candidate == id);
+            if (directoryMatches.at(record.directory) || (isCandidate && matches(record)))
+            {
+                found.append(path(record));
+            }
+        }
+        return found;
+    }
+    if (lists.isEmpty())
+    {
+        // Nothing literal to narrow it down, every name has to be looked at.
+        candidates.resize(records.size());
+        std::iota(candidates.begin(), candidates.end(), 0);
+    }
+    for (quint32 id : std::as_const(candidates))
+    {
+        if (matches(records.at(id)))
+        {
+            found.append(path(records.at(id)));
+            if (found.size() >= limit)
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+///
+/// \brief PathIndex::trigrams
+/// \return The distinct three byte runs of the case folded UTF-8 text, each packed into an integer.
+///
+QList<quint32> PathIndex::trigrams(const QString &text)
+{
+    QByteArray folded = text.toCaseFolded().toUtf8();
+    QList<quint32> result;
+    for (qsizetype i = 0; i + 2 < folded.size(); i++)
+    {
+        result.append(quint32(quint8(folded.at(i))) << 16 | quint32(quint8(folded.at(i + 1))) << 8 | quint8(folded.at(i + 2)));
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+QString PathIndex::name(const Record &record) const
+{
+    return QString::fromUtf8(names.constData() + record.name, record.nameLength);
+}
+
+QString PathIndex::path(const Record &record) const
+{
+    const QString &directory = directories.at(record.directory);
+    return (directory == "/" ? directory : directory + "/") + name(record);
+}
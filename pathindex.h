@@ -0,0 +1,42 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include "sshwrapper.h"
+
+///
+/// \brief The PathIndex class finds remote paths by substring or glob without going to the host.
+/// Names are kept once in a UTF-8 blob, with the id of their directory, and every case folded
+/// trigram of a name points to the names holding it. A query only looks at the names holding all
+/// trigrams of its literal parts, so it answers in milliseconds over millions of paths. Patterns
+/// with a '/' are matched against the whole path, others against the name.
+///
+class PathIndex
+{
+public:
+    void clear();
+    void add(const QString &directory, const QList<SFTPEntry> &entries);
+    QStringList search(const QString &pattern, int limit) const;
+    qsizetype size() const { return records.size(); }
+
+private:
+    struct Record {
+        quint32 name;       // Offset into names.
+        quint32 nameLength; // In bytes.
+        quint32 directory;  // Index into directories.
+    };
+    QByteArray names;
+    QList<Record> records;
+    QStringList directories;
+    QHash<QString, quint32> directoryIds;
+    QHash<quint32, QList<quint32>> postings; // Trigram to the records holding it, in ascending order.
+
+    static QList<quint32> trigrams(const QString &text);
+    QString name(const Record &record) const;
+    QString path(const Record &record) const;
+};
+
+#endif // PATHINDEX_H
@@ -0,0 +1,93 @@
+#include "refreshscheduler.h"
+#include <QDateTime>
+#include <QSettings>
+#include <algorithm>
+
+#define TICK_MS 250
+#define DEFAULT_REQUESTS_PER_SECOND 2.0
+#define DEFAULT_REFRESH_INTERVAL 60 // Seconds.
+
+RefreshScheduler::RefreshScheduler(RemoteFileSystem *fs, QTreeView *view, QObject *parent)
+    : QObject{parent}, fs(fs), view(view), timer(new QTimer(this))
+{
+    QSettings settings;
+    requestsPerSecond = settings.value("refresh/requestsPerSecond", DEFAULT_REQUESTS_PER_SECOND).toDouble();
+    interval = settings.value("refresh/interval", DEFAULT_REFRESH_INTERVAL).toInt();
+
+    connect(timer, &QTimer::timeout, this, &RefreshScheduler::onTick);
+    if (requestsPerSecond > 0)
+    {
+        timer->start(TICK_MS);
+    }
+}
+
+void RefreshScheduler::onTick()
+{
+    // Unused budget does not pile up beyond a second's worth.
+    budget = std::min(budget + requestsPerSecond * TICK_MS / 1000, std::max(requestsPerSecond, 1.0));
+    if (budget < 1 || !view->isVisible())
+    {
+        return;
+    }
+
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    for (auto it = checkedAt.begin(); it != checkedAt.end();)
+    {
+        it = !it.key().isValid() || now - it.value() >= interval ? checkedAt.erase(it) : std::next(it);
+    }
+
+    QList<QPair<qint64, QModelIndex>> due; // Last known current, directory.
+    for (const QModelIndex &directory : visibleDirectories())
+    {
+        qint64 listedAt = fs->listedAt(directory);
+        if (listedAt == 0 || fs->isListing(directory) || checkedAt.contains(directory))
+        {
+            // Never listed ones are listed when opened, not refreshed.
+            continue;
+        }
+        if (now - listedAt >= interval)
+        {
+            due.append({listedAt, directory});
+        }
+    }
+    std::sort(due.begin(), due.end(), [](const QPair<qint64, QModelIndex> &a, const QPair<qint64, QModelIndex> &b) {
+        return a.first < b.first;
+    });
+    for (const auto &[listedAt, directory] : std::as_const(due))
+    {
+        if (budget < 1)
+        {
+            break;
+        }
+        checkedAt.insert(directory, now);
+        fs->revalidate(directory);
+        budget--;
+    }
+}
+
+///
+/// \brief RefreshScheduler::visibleDirectories
+/// \return The directories with entries in the viewport, and the expanded directories in it.
+///
+QList<QModelIndex> RefreshScheduler::visibleDirectories() const
+{
+    QList<QModelIndex> directories;
+    int height = view->viewport()->height();
+    for (QModelIndex index = view->indexAt(QPoint(0, 0)); index.isValid(); index = view->indexBelow(index))
+    {
+        if (view->visualRect(index).top() >= height)
+        {
+            break;
+        }
+        QModelIndex parent = index.parent();
+        if (parent.isValid() && !directories.contains(parent))
+        {
+            directories.append(parent);
+        }
+        if (view->isExpanded(index) && !directories.contains(index))
+        {
+            directories.append(index);
+        }
+    }
+    return directories;
+}
@@ -0,0 +1,39 @@
+#ifndef REFRESHSCHEDULER_H
+#define REFRESHSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QHash>
+#include <QPersistentModelIndex>
+#include <QTreeView>
+#include "remotefilesystem.h"
+
+///
+/// \brief The RefreshScheduler class keeps the directories on screen current. The directories
+/// whose entries are in the view, and the expanded ones among them, are checked once they were not
+/// for the refresh interval (refresh/interval seconds), oldest first. No more than
+/// refresh/requestsPerSecond checks go out, a check is a stat and only a changed directory is
+/// listed again. A rate of 0 turns refreshing off.
+///
+class RefreshScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    RefreshScheduler(RemoteFileSystem *fs, QTreeView *view, QObject *parent = nullptr);
+
+private slots:
+    void onTick();
+
+private:
+    RemoteFileSystem *fs;
+    QTreeView *view;
+    QTimer *timer;
+    double requestsPerSecond;
+    int interval;
+    double budget = 0; // Checks that may go out now.
+    QHash<QPersistentModelIndex, qint64> checkedAt; // Checks sent, answered or not.
+
+    QList<QModelIndex> visibleDirectories() const;
+};
+
+#endif // REFRESHSCHEDULER_H
@@ -3,17 +3,24 @@
 #include <qapplication.h>
 #include <qstyle.h>
 #include <QDateTime>
+#include <QSettings>
+#include <algorithm>
+#include <functional>
+
+#define DEFAULT_PREFETCH_BUDGET 8
 
 // Public
 
 RemoteFileSystem::RemoteFileSystem(QObject *parent)
     : QAbstractItemModel{parent}
 {
-    SFTPEntry root;
-    root.name = "/";
-    root.path = "/";
-    root.isDirectory = true;
-    rootNode = new FileNode{root, nullptr, {}};
+    rootNode = arena.create(nullptr);
+    rootNode->isDirectory = true;
+    // "file10" after "file9", and case only matters between names that are otherwise equal.
+    collator.setNumericMode(true);
+    collator.setCaseSensitivity(Qt::CaseInsensitive);
+
+    prefetchBudget = QSettings().value("prefetch/budget", DEFAULT_PREFETCH_BUDGET).toInt();
 
     dirIcon =  QApplication::style()->standardIcon(QStyle::SP_DirIcon);
     fileIcon= QApplication::style()->standardIcon(QStyle::SP_FileIcon);
@@ -21,8 +28,12 @@ RemoteFileSystem::RemoteFileSystem(QObject *parent)
 
 RemoteFileSystem::~RemoteFileSystem()
 {
-    clearModel();
-    delete rootNode;
+    for (NavigationPredictor* predictor : std::as_const(predictors))
+    {
+        predictor->save();
+    }
+    qDeleteAll(predictors);
+    arena.destroy(rootNode);
 }
 
 QModelIndex RemoteFileSystem::index(int row, int column, const QModelIndex &parent) const
@@ -48,21 +59,38 @@ QModelIndex RemoteFileSystem::parent(const QModelIndex &index) const
     {
         return QModelIndex();
     }
-    FileNode* grandparentNode = parentNode->parent;
-    int row = 0;
-    if (grandparentNode)
-    {
-        row = grandparentNode->children.indexOf(parentNode);
-    }
-
-    return createIndex(row, 0, parentNode);
+    return createIndex(parentNode->rowInParent(), 0, parentNode);
 }
 
 bool RemoteFileSystem::hasChildren(const QModelIndex &parent) const
 {
     const FileNode *node = nodeFromIndex(parent);
 
-    return node && node->entry.isDirectory;
+    return node && node->isDirectory;
+}
+
+///
+/// \brief RemoteFileSystem::canFetchMore
+/// \return Whether parent is a directory that was never listed and is not being listed.
+/// One whose listing failed is not fetched again every time the view asks.
+///
+bool RemoteFileSystem::canFetchMore(const QModelIndex &parent) const
+{
+    const FileNode* node = nodeFromIndex(parent);
+    if (node == rootNode || !node->isDirectory || node->listedAt != 0 || node->listing || node->listFailed)
+    {
+        return false;
+    }
+    return !requested.contains({hostOf(parent), pathOf(node)});
+}
+
+///
+/// \brief RemoteFileSystem::fetchMore lists a directory the view is about to show the children of.
+///
+void RemoteFileSystem::fetchMore(const QModelIndex &parent)
+{
+    keyChildren(nodeFromIndex(parent));
+    requestListing(hostOf(parent), pathOf(parent));
 }
 
 int RemoteFileSystem::rowCount(const QModelIndex &parent) const
@@ -83,23 +111,27 @@ QVariant RemoteFileSystem::data(const QModelIndex &index, int role) const
 
     if (role == Qt::DisplayRole) {
         switch (index.column()) {
-        case 0: return node->entry.name;
-        case 1: return node->entry.owner;
-        case 2: return node->entry.mtimeString;
-        case 3: return node->entry.size;
-        case 4: return permissionsToString(node->entry.permissions);
+        case 0: return node->name;
+        case 1: return names.name(node->owner);
+        case 2: return QDateTime::fromSecsSinceEpoch(node->mtime).toString();
+        case 3: return node->size;
+        case 4: return permissionsToString(node->permissions);
         }
     }
 
     if (role == Qt::DecorationRole && index.column() == 0) {
-        if (node->entry.isDirectory)
+        if (node->isDirectory)
             return dirIcon;
         else
             return fileIcon;
     }
 
+    if (role == Qt::ToolTipRole && index.column() == 0 && node->listing) {
+        return QString("Listing...");
+    }
+
     if (role == Qt::ForegroundRole) {
-        if (node->entry.isDirectory && !(node->entry.permissions & S_IRUSR)) {
+        if (node->isDirectory && !(node->permissions & S_IRUSR)) {
             return QColor(Qt::gray);
         }
     }
@@ -119,81 +151,871 @@ QVariant RemoteFileSystem::headerData(int section, Qt::Orientation orientation,
     return QVariant();
 }
 
-// Pub Slots
-void RemoteFileSystem::onSftpEntriesListed(const QList<SFTPEntry> &entries, const QString &directory)
+///
+/// \brief RemoteFileSystem::sort puts the children of every directory in the new order. Hosts
+/// keep the order they were connected in. Listings arriving later are merged in this order,
+/// so the tree is never sorted from scratch again until the order changes.
+///
+void RemoteFileSystem::sort(int column, Qt::SortOrder order)
 {
-    qDebug() << "Handling entries under: " << directory;
-    bool preLoad = false;
-    if (preLoadQueue.contains(directory))
+    if (column == sortColumn && order == sortOrder)
     {
-        preLoad = true;
-        preLoadQueue.remove(directory);
-        qDebug() << "Preloading " << directory;
+        return;
     }
+    sortColumn = column;
+    sortOrder = order;
 
+    emit layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+    QModelIndexList before = persistentIndexList();
+    auto less = [this](const FileNode* a, const FileNode* b) { return lessThan(a, b); };
+    QList<FileNode*> pending = rootNode->children;
+    while (!pending.isEmpty())
+    {
+        FileNode* node = pending.takeLast();
+        std::sort(node->children.begin(), node->children.end(), less);
+        for (FileNode* child : std::as_const(node->children))
+        {
+            if (!child->children.isEmpty())
+            {
+                pending.append(child);
+            }
+        }
+    }
+    changePersistentIndexList(before, movedIndexes(before));
+    emit layoutChanged({}, QAbstractItemModel::VerticalSortHint);
+}
 
-    FileNode* directoryNode = findOrCreateNode(directory, true);
-    QModelIndex directoryIndex = indexFromNode(directoryNode);
+///
+/// \brief RemoteFileSystem::hostOf
+/// \return Name of the host the item belongs to.
+///
+QString RemoteFileSystem::hostOf(const QModelIndex &index) const
+{
+    FileNode* node = nodeFromIndex(index);
+    if (node == rootNode)
+    {
+        return QString();
+    }
+    while (node->parent != rootNode)
+    {
+        node = node->parent;
+    }
+    return node->name;
+}
+
+QString RemoteFileSystem::pathOf(const QModelIndex &index) const
+{
+    return pathOf(nodeFromIndex(index));
+}
+
+///
+/// \brief RemoteFileSystem::entry
+/// \return What is known about the item, in the form the sessions take.
+///
+SFTPEntry RemoteFileSystem::entry(const QModelIndex &index) const
+{
+    const FileNode* node = nodeFromIndex(index);
+    SFTPEntry entry{};
+    entry.name = node->name;
+    entry.path = pathOf(node);
+    entry.size = node->size;
+    entry.owner = names.name(node->owner);
+    entry.group = names.name(node->group);
+    entry.permissions = node->permissions;
+    entry.mtime = node->mtime;
+    entry.isDirectory = node->isDirectory;
+    return entry;
+}
+
+bool RemoteFileSystem::isListing(const QModelIndex &index) const
+{
+    return nodeFromIndex(index)->listing;
+}
+
+///
+/// \brief RemoteFileSystem::listedAt
+/// \return When the directory was last known to be current, in seconds since the epoch. 0 if it was never listed.
+///
+qint64 RemoteFileSystem::listedAt(const QModelIndex &index) const
+{
+    return nodeFromIndex(index)->listedAt;
+}
+
+///
+/// \brief RemoteFileSystem::revalidate checks whether a listed directory changed with a stat,
+/// it is only listed again if its mtime moved.
+///
+void RemoteFileSystem::revalidate(const QModelIndex &index)
+{
+    FileNode* node = nodeFromIndex(index);
+    if (node == rootNode || !node->isDirectory || node->listing)
+    {
+        return;
+    }
+    emit request_stat_dir(hostOf(index), pathOf(node));
+}
+
+QModelIndex RemoteFileSystem::hostIndex(const QString &host) const
+{
+    FileNode* node = hostNode(host);
+    return node ? indexFromNode(node) : QModelIndex();
+}
+
+///
+/// \brief RemoteFileSystem::pathIndex
+/// \return Index of the directory at path on host, placeholders are created for the parts not listed yet.
+///
+QModelIndex RemoteFileSystem::pathIndex(const QString &host, const QString &path)
+{
+    if (!hostNode(host))
+    {
+        return QModelIndex();
+    }
+    return indexFromNode(findOrCreateNode(host, path, true));
+}
+
+void RemoteFileSystem::removeHost(const QString &host)
+{
+    FileNode* node = hostNode(host);
+    if (!node)
+    {
+        return;
+    }
+    int row = node->rowInParent();
+    beginRemoveRows(QModelIndex(), row, row);
+    rootNode->children.removeAt(row);
+    rootNode->childByName.remove(host);
+    arena.destroy(node);
+    endRemoveRows();
+
+    forgetRequests(host);
+    walkSeen.remove(host);
+    if (NavigationPredictor* predictor = predictors.take(host))
+    {
+        predictor->save();
+        delete predictor;
+    }
+}
+
+///
+/// \brief RemoteFileSystem::listings
+/// \return Every directory of the host that was listed completely, parents before their children.
+///
+QList<CachedListing> RemoteFileSystem::listings(const QString &host) const
+{
+    QList<CachedListing> result;
+    FileNode* node = hostNode(host);
+    if (!node)
+    {
+        return result;
+    }
+    QList<const FileNode*> pending{node};
+    while (!pending.isEmpty())
+    {
+        const FileNode* directoryNode = pending.takeFirst();
+        if (directoryNode->listedAt == 0)
+        {
+            continue;
+        }
+        CachedListing listing;
+        listing.directory = pathOf(directoryNode);
+        listing.listedAt = directoryNode->listedAt;
+        listing.mtime = directoryNode->listedMtime;
+        listing.entries.reserve(directoryNode->children.size());
+        for (const FileNode* child : directoryNode->children)
+        {
+            SFTPEntry entry{};
+            entry.name = child->name;
+            entry.size = child->size;
+            entry.mtime = child->mtime;
+            entry.owner = names.name(child->owner);
+            entry.group = names.name(child->group);
+            entry.permissions = child->permissions;
+            entry.isDirectory = child->isDirectory;
+            listing.entries.append(entry);
+            if (child->isDirectory)
+            {
+                pending.append(child);
+            }
+        }
+        result.append(listing);
+    }
+    return result;
+}
 
-    QHash<QString, SFTPEntry> incomingMap;
-    for (const SFTPEntry &entry : entries) {
-        incomingMap.insert(entry.name, entry);
-        if (preLoad && entry.isDirectory)
+///
+/// \brief RemoteFileSystem::restoreListings fills the tree of a host with listings kept from an
+/// earlier session, as if they had just arrived but without preloading. The host must have a root.
+/// \return The directories restored, they still have to be listed again.
+///
+QStringList RemoteFileSystem::restoreListings(const QString &host, const QList<CachedListing> &listings)
+{
+    QStringList restored;
+    if (!hostNode(host))
+    {
+        return restored;
+    }
+    for (const CachedListing &listing : listings)
+    {
+        FileNode* directoryNode = findOrCreateNode(host, listing.directory, true);
+        if (directoryNode->listing || directoryNode->listedAt != 0)
         {
-            emit request_list_dir(entry.path);
+            // Already listed by the live session, which is newer.
+            continue;
         }
+        merge(directoryNode, listing.entries, true);
+        directoryNode->listedAt = listing.listedAt;
+        directoryNode->listedMtime = listing.mtime;
+        restored.append(listing.directory);
     }
+    return restored;
+}
 
-    QList<FileNode*> toRemove;
+// Pub Slots
+///
+/// \brief RemoteFileSystem::onSftpEntriesListed merges a batch of a directory listing.
+/// Children are kept in the sort order of the view, so a sorted batch is merged in one pass:
+/// known children whose metadata changed are updated with one dataChanged per run of rows,
+/// new entries are inserted with one insert per run that lands between the same two children. Big directories
+/// arrive in several batches, the node is marked as listing from the first until the complete
+/// one, children that never showed up are removed with the last batch.
+/// \param mtime The directory's own mtime when it was listed, later stats are compared to it.
+///
+void RemoteFileSystem::onSftpEntriesListed(const QString &host, const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime)
+{
+    qDebug() << "Handling entries under: " << host << directory << entries.size() << (complete ? "complete" : "more to come");
+    if (!hostNode(host))
+    {
+        // Listing arrived after the host was disconnected.
+        return;
+    }
+    FileNode* directoryNode = findOrCreateNode(host, directory, true);
+    merge(directoryNode, entries, complete);
+    if (complete)
+    {
+        // Unknown, the one the parent's listing showed is the best there is.
+        directoryNode->listedMtime = mtime >= 0 ? mtime : directoryNode->mtime;
+        requested.remove({host, directory});
+        prefetching.remove({host, directory});
+        prefetch(host, directoryNode);
+    }
+}
 
-    for (FileNode* child : directoryNode->children) {
-        if (incomingMap.contains(child->entry.name)) {
-            child->entry = incomingMap[child->entry.name];
-            incomingMap.remove(child->entry.name);
-        } else {
-            toRemove.append(child);
+///
+/// \brief RemoteFileSystem::merge merges a batch of a listing into the children of directoryNode.
+///
+void RemoteFileSystem::merge(FileNode* directoryNode, const QList<SFTPEntry> &entries, bool complete)
+{
+    if (!directoryNode->listing)
+    {
+        directoryNode->listing = true;
+        for (FileNode* child : directoryNode->children)
+        {
+            child->stale = true;
         }
+        QModelIndex directoryIndex = indexFromNode(directoryNode);
+        if (directoryIndex.isValid())
+        {
+            emit dataChanged(directoryIndex, directoryIndex, {Qt::ToolTipRole});
+        }
+    }
+    upsert(directoryNode, entries);
+    if (complete)
+    {
+        finishListing(directoryNode, true);
     }
+}
 
-    if (!toRemove.isEmpty()) {
-        for (FileNode* child : toRemove) {
-            int row = directoryNode->children.indexOf(child);
-            beginRemoveRows(directoryIndex, row, row);
-            directoryNode->children.removeAt(row);
-            delete child;
-            endRemoveRows();
+///
+/// \brief RemoteFileSystem::upsert updates the children named in entries and inserts the missing
+/// ones in runs of rows. Children that are not named are left alone.
+///
+void RemoteFileSystem::upsert(FileNode* directoryNode, const QList<SFTPEntry> &entries)
+{
+    QModelIndex directoryIndex = indexFromNode(directoryNode);
+    QList<FileNode*> &children = directoryNode->children;
+    QList<FileNode*> added;
+    QList<int> changedRows;
+    bool moved = false; // A changed child may no longer be in order.
+    for (const SFTPEntry &entry : entries)
+    {
+        if (FileNode* child = directoryNode->child(entry.name))
+        {
+            child->stale = false;
+            if (!sameMetadata(child, entry))
+            {
+                changedRows.append(child->rowInParent());
+                assign(child, entry);
+                moved = moved || sortColumn != 0;
+            }
+            continue;
         }
+        FileNode* child = arena.create(directoryNode);
+        assign(child, entry);
+        added.append(child);
     }
+    std::sort(changedRows.begin(), changedRows.end());
 
-    for (const SFTPEntry &entry : entries) {
-        if (incomingMap.contains(entry.name)) {
-            int row = directoryNode->children.size();
-            beginInsertRows(directoryIndex, row, row);
-            FileNode* child = new FileNode{entry, directoryNode, {}};
-            directoryNode->children.append(child);
-            endInsertRows();
+    // Sorted the same way as the children, the search for each can start where the previous went.
+    std::sort(added.begin(), added.end(), [this](const FileNode* a, const FileNode* b) {
+        return lessThan(a, b);
+    });
+    QList<QPair<int, QList<FileNode*>>> insertions; // Row in the children as they are now, nodes going there.
+    int from = 0;
+    for (FileNode* child : std::as_const(added))
+    {
+        int row = childRow(directoryNode, child, from);
+        from = row;
+        if (!insertions.isEmpty() && insertions.last().first == row)
+        {
+            insertions.last().second.append(child);
+        }
+        else
+        {
+            insertions.append({row, {child}});
         }
     }
+
+    for (int i = 0; i < changedRows.size();)
+    {
+        int first = changedRows.at(i);
+        int last = first;
+        while (++i < changedRows.size() && changedRows.at(i) == last + 1)
+        {
+            last++;
+        }
+        emit dataChanged(index(first, 0, directoryIndex), index(last, columnCount(directoryIndex) - 1, directoryIndex));
+    }
+
+    // From the back, so the rows of the runs in front stay where they were computed.
+    for (int i = insertions.size() - 1; i >= 0; i--)
+    {
+        int row = insertions.at(i).first;
+        const QList<FileNode*> &run = insertions.at(i).second;
+        beginInsertRows(directoryIndex, row, row + run.size() - 1);
+        children.insert(row, run.size(), nullptr);
+        for (int j = 0; j < run.size(); j++)
+        {
+            FileNode* child = run.at(j);
+            child->row = row + j;
+            children[row + j] = child;
+            directoryNode->childByName.insert(child->name, child);
+        }
+        endInsertRows();
+    }
+    if (moved)
+    {
+        restoreOrder(directoryNode);
+    }
+}
+
+///
+/// \brief RemoteFileSystem::onListingFailed ends a listing cut off halfway, without removing
+/// anything, what was there may well still be.
+///
+void RemoteFileSystem::onListingFailed(const QString &host, const QString &directory)
+{
+    requested.remove({host, directory});
+    prefetching.remove({host, directory});
+    if (!hostNode(host))
+    {
+        return;
+    }
+    FileNode* directoryNode = findOrCreateNode(host, directory, true);
+    directoryNode->listFailed = true;
+    finishListing(directoryNode, false);
 }
 
+///
+/// \brief RemoteFileSystem::onItemExpanded notes the directory in the navigation history of the
+/// host. A directory never listed is listed through fetchMore(), one listed before or one whose
+/// listing failed is only checked, and the predictor gets to pick what to list ahead below it.
+///
 void RemoteFileSystem::onItemExpanded(const QModelIndex &index)
 {
+    QString host = hostOf(index);
+    QString path = pathOf(index);
+    if (NavigationPredictor* predictor = predictors.value(host))
+    {
+        predictor->opened(path);
+    }
+    // Somebody is waiting for it now, it no longer counts against the prefetch budget.
+    prefetching.remove({host, path});
     FileNode* node = nodeFromIndex(index);
-    preLoadQueue.insert(node->entry.path);
-    emit request_list_dir(node->entry.path);
-    qDebug() << "Requested: " << node->entry.path;
+    keyChildren(node);
+    if (node->listedAt != 0 || node->listFailed)
+    {
+        revalidate(index);
+        prefetch(host, node);
+    }
+}
+
+///
+/// \brief RemoteFileSystem::onDirectoriesStatted takes the answers to revalidate(). A directory
+/// whose mtime still is the one it had when listed is current, the others are listed again.
+/// A directory that could not be statted is likely gone, its parent is listed again instead.
+///
+void RemoteFileSystem::onDirectoriesStatted(const QString &host, const QHash<QString, qint64> &mtimes)
+{
+    if (!hostNode(host))
+    {
+        return;
+    }
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    for (auto it = mtimes.cbegin(); it != mtimes.cend(); it++)
+    {
+        FileNode* node = findNode(host, it.key());
+        if (!node || node->listing)
+        {
+            continue;
+        }
+        // Reachable again or not, a failed listing may be retried once a stat came back.
+        node->listFailed = false;
+        if (it.value() < 0)
+        {
+            if (node->parent != rootNode)
+            {
+                requestListing(host, pathOf(node->parent));
+            }
+            continue;
+        }
+        if (it.value() == node->listedMtime)
+        {
+            node->listedAt = now;
+            continue;
+        }
+        qDebug() << "Changed since listed:" << host << it.key();
+        if (node->mtime != it.value())
+        {
+            node->mtime = it.value();
+            QModelIndex changed = indexFromNode(node).siblingAtColumn(2);
+            emit dataChanged(changed, changed);
+            if (sortColumn == 2 && node->parent != rootNode)
+            {
+                restoreOrder(node->parent);
+            }
+        }
+        requestListing(host, it.key());
+    }
+}
+
+///
+/// \brief RemoteFileSystem::onTreeStreamed fills in a batch of a whole tree walk. Each directory
+/// takes its entries in one upsert, most were never listed and get all of theirs in one insert.
+/// Nothing is preloaded, the walk brings everything below anyway. What the walk saw is kept apart
+/// from the stale marks of listings, a listing of the same directory may start and end meanwhile.
+///
+void RemoteFileSystem::onTreeStreamed(const QString &host, const QHash<QString, QList<SFTPEntry>> &entries)
+{
+    if (!hostNode(host))
+    {
+        return;
+    }
+    // Parents before children, so a directory's node exists with its metadata before it fills.
+    QStringList directories = entries.keys();
+    std::sort(directories.begin(), directories.end());
+    QHash<QString, QSet<QString>> &seen = walkSeen[host];
+    for (const QString &directory : std::as_const(directories))
+    {
+        const QList<SFTPEntry> &batch = entries[directory];
+        upsert(findOrCreateNode(host, directory, true), batch);
+        QSet<QString> &names = seen[directory];
+        for (const SFTPEntry &entry : batch)
+        {
+            names.insert(entry.name);
+        }
+    }
+}
+
+///
+/// \brief RemoteFileSystem::onTreeStreamFinished ends the walk in every directory it went through.
+/// A complete walk saw all their entries, what it did not see is gone and they count as listed.
+///
+void RemoteFileSystem::onTreeStreamFinished(const QString &host, const QStringList &directories, bool complete)
+{
+    QHash<QString, QSet<QString>> seen = walkSeen.take(host);
+    if (!hostNode(host) || !complete)
+    {
+        return;
+    }
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    for (const QString &directory : directories)
+    {
+        FileNode* node = findNode(host, directory);
+        if (!node)
+        {
+            continue;
+        }
+        // Empty directories had nothing to upsert and saw nothing.
+        const QSet<QString> names = seen.value(directory);
+        removeChildren(node, [&names](const FileNode* child) {
+            return !names.contains(child->name);
+        });
+        node->listFailed = false;
+        node->listedAt = now;
+        node->listedMtime = node->mtime;
+        QModelIndex directoryIndex = indexFromNode(node);
+        if (directoryIndex.isValid())
+        {
+            emit dataChanged(directoryIndex, directoryIndex, {Qt::ToolTipRole});
+        }
+    }
+}
 
+///
+/// \brief RemoteFileSystem::onSSHConnected adds a root for the host, if it has none yet.
+/// The session lists the root by itself as soon as it is up. Listings asked for on a session
+/// that dropped are forgotten, they can be asked for again.
+///
+void RemoteFileSystem::onSSHConnected(const QString &host)
+{
+    if (!hostNode(host))
+    {
+        int row = rootNode->children.size();
+        beginInsertRows(QModelIndex(), row, row);
+        FileNode* node = arena.create(rootNode);
+        setName(node, host);
+        node->permissions = S_IFDIR | S_IRUSR | S_IWUSR | S_IXUSR;
+        node->isDirectory = true;
+        node->row = row;
+        rootNode->children.append(node);
+        rootNode->childByName.insert(host, node);
+        endInsertRows();
+    }
+    forgetRequests(host);
+    if (!predictors.contains(host))
+    {
+        predictors.insert(host, new NavigationPredictor(host));
+    }
+    requested.insert({host, "/"});
 }
 
-void RemoteFileSystem::onSSHConnected()
+///
+/// \brief RemoteFileSystem::onHomeResolved makes room for the home directory of the host.
+/// The session lists home by itself. The directories between the root and home are listed too,
+/// so they show their siblings once the tree is opened at home.
+///
+void RemoteFileSystem::onHomeResolved(const QString &host, const QString &home)
 {
-    preLoadQueue.insert("/");
-    emit request_list_dir("/");
+    if (!hostNode(host) || home == "/")
+    {
+        return;
+    }
+    FileNode* homeNode = findOrCreateNode(host, home, true);
+    if (homeNode->listedAt == 0 && !homeNode->listing)
+    {
+        requested.insert({host, home});
+    }
+
+    QStringList parts = home.split('/', Qt::SkipEmptyParts);
+    QString ancestor;
+    for (int i = 0; i < parts.size() - 1; i++)
+    {
+        ancestor += "/" + parts.at(i);
+        requestListing(host, ancestor);
+    }
 }
 
 
 
 // Private
+void RemoteFileSystem::forgetRequests(const QString &host)
+{
+    for (QSet<QPair<QString, QString>>* pending : {&requested, &prefetching})
+    {
+        for (auto it = pending->begin(); it != pending->end();)
+        {
+            it = it->first == host ? pending->erase(it) : std::next(it);
+        }
+    }
+}
+
+void RemoteFileSystem::requestListing(const QString &host, const QString &path, bool speculative)
+{
+    if (requested.contains({host, path}))
+    {
+        return;
+    }
+    requested.insert({host, path});
+    if (speculative)
+    {
+        prefetching.insert({host, path});
+    }
+    emit request_list_dir(host, path);
+}
+
+///
+/// \brief RemoteFileSystem::prefetch lists ahead the subdirectories of a listed directory the
+/// navigation history says are likely to be opened, as long as the host has prefetch budget left.
+/// Each prefetched listing gets its own turn when it arrives, so a path opened often is followed
+/// down a level at a time.
+///
+void RemoteFileSystem::prefetch(const QString &host, const FileNode* directoryNode)
+{
+    NavigationPredictor* predictor = predictors.value(host);
+    if (!predictor)
+    {
+        return;
+    }
+    int budget = prefetchBudget;
+    for (const QPair<QString, QString> &pending : std::as_const(prefetching))
+    {
+        if (pending.first == host)
+        {
+            budget--;
+        }
+    }
+    if (budget <= 0)
+    {
+        return;
+    }
+    QString directory = pathOf(directoryNode);
+    QString prefix = directory == "/" ? directory : directory + "/";
+    QStringList children;
+    for (const FileNode* child : directoryNode->children)
+    {
+        if (child->isDirectory && child->listedAt == 0 && !child->listing && !requested.contains({host, prefix + child->name}))
+        {
+            children.append(prefix + child->name);
+        }
+    }
+    for (const QString &path : predictor->predict(directory, children, budget))
+    {
+        qDebug() << "Prefetching" << host << path;
+        requestListing(host, path, true);
+    }
+}
+
+///
+/// \brief RemoteFileSystem::finishListing ends the listing of a directory.
+/// \param removeStale Whether the children the listing did not mention are gone.
+///
+void RemoteFileSystem::finishListing(FileNode* directoryNode, bool removeStale)
+{
+    if (!directoryNode->listing)
+    {
+        return;
+    }
+    directoryNode->listing = false;
+    if (removeStale)
+    {
+        directoryNode->listFailed = false;
+        directoryNode->listedAt = QDateTime::currentSecsSinceEpoch();
+        removeChildren(directoryNode, [](const FileNode* child) {
+            return child->stale;
+        });
+    }
+    for (FileNode* child : directoryNode->children)
+    {
+        child->stale = false;
+    }
+    QModelIndex directoryIndex = indexFromNode(directoryNode);
+    if (directoryIndex.isValid())
+    {
+        emit dataChanged(directoryIndex, directoryIndex, {Qt::ToolTipRole});
+    }
+}
+
+///
+/// \brief RemoteFileSystem::removeChildren removes the children for which gone is true.
+/// Runs of rows go from the back, so the rows in front keep their numbers.
+///
+void RemoteFileSystem::removeChildren(FileNode* directoryNode, const std::function<bool(const FileNode*)> &gone)
+{
+    QModelIndex directoryIndex = indexFromNode(directoryNode);
+    QList<FileNode*> &children = directoryNode->children;
+    for (int row = children.size() - 1; row >= 0;)
+    {
+        if (!gone(children.at(row)))
+        {
+            row--;
+            continue;
+        }
+        int last = row;
+        while (row > 0 && gone(children.at(row - 1)))
+        {
+            row--;
+        }
+        beginRemoveRows(directoryIndex, row, last);
+        for (int i = row; i <= last; i++)
+        {
+            directoryNode->childByName.remove(children.at(i)->name);
+            arena.destroy(children.at(i));
+        }
+        children.remove(row, last - row + 1);
+        endRemoveRows();
+        row--;
+    }
+}
+
+///
+/// \brief RemoteFileSystem::childRow
+/// \return Row node has to be inserted at under directoryNode to keep the sort order.
+///
+int RemoteFileSystem::childRow(const FileNode* directoryNode, const FileNode* node, int from) const
+{
+    const QList<FileNode*> &children = directoryNode->children;
+    auto it = std::lower_bound(children.begin() + from, children.end(), node,
+                               [this](const FileNode* a, const FileNode* b) { return lessThan(a, b); });
+    return it - children.begin();
+}
+
+///
+/// \brief RemoteFileSystem::lessThan orders siblings by the sort column, then by name.
+/// Sizes, times and permissions compare as raw numbers, names through their keys where they have one.
+///
+bool RemoteFileSystem::lessThan(const FileNode* a, const FileNode* b) const
+{
+    if (sortOrder == Qt::DescendingOrder)
+    {
+        std::swap(a, b);
+    }
+    switch (sortColumn)
+    {
+    case 1:
+        if (a->owner != b->owner)
+        {
+            int order = QString::compare(names.name(a->owner), names.name(b->owner), Qt::CaseInsensitive);
+            if (order != 0)
+            {
+                return order < 0;
+            }
+        }
+        break;
+    case 2:
+        if (a->mtime != b->mtime)
+        {
+            return a->mtime < b->mtime;
+        }
+        break;
+    case 3:
+        if (a->size != b->size)
+        {
+            return a->size < b->size;
+        }
+        break;
+    case 4:
+        if (a->permissions != b->permissions)
+        {
+            return a->permissions < b->permissions;
+        }
+        break;
+    }
+    int order = compareNames(a, b);
+    // Names the collator considers equal still need an order of their own.
+    return order != 0 ? order < 0 : a->name < b->name;
+}
+
+///
+/// \brief RemoteFileSystem::compareNames compares with the precomputed keys where both nodes have
+/// one, which gives the same order as comparing the names.
+///
+int RemoteFileSystem::compareNames(const FileNode* a, const FileNode* b) const
+{
+    if (a->nameKey && b->nameKey)
+    {
+        return a->nameKey->compare(*b->nameKey);
+    }
+    return collator.compare(a->name, b->name);
+}
+
+///
+/// \brief RemoteFileSystem::keyChildren gives the children of a directory the view opened a key
+/// of their name, so sorting and merging the listings it shows compare keys. The keys cost more
+/// than the name itself, the rest of the tree (e.g. everything a full index walked) goes without.
+///
+void RemoteFileSystem::keyChildren(FileNode* directoryNode)
+{
+    if (directoryNode == rootNode || directoryNode->keyed)
+    {
+        return;
+    }
+    directoryNode->keyed = true;
+    for (FileNode* child : std::as_const(directoryNode->children))
+    {
+        child->nameKey = std::make_unique<QCollatorSortKey>(collator.sortKey(child->name));
+    }
+}
+
+///
+/// \brief RemoteFileSystem::restoreOrder moves the children of a directory back into sort order,
+/// keeping the persistent indexes (selection, current item, expanded rows) on their nodes.
+///
+void RemoteFileSystem::restoreOrder(FileNode* directoryNode)
+{
+    auto less = [this](const FileNode* a, const FileNode* b) { return lessThan(a, b); };
+    QList<FileNode*> &children = directoryNode->children;
+    if (std::is_sorted(children.begin(), children.end(), less))
+    {
+        return;
+    }
+    QList<QPersistentModelIndex> parents{QPersistentModelIndex(indexFromNode(directoryNode))};
+    emit layoutAboutToBeChanged(parents, QAbstractItemModel::VerticalSortHint);
+    QModelIndexList before = persistentIndexList();
+    std::stable_sort(children.begin(), children.end(), less);
+    changePersistentIndexList(before, movedIndexes(before));
+    emit layoutChanged(parents, QAbstractItemModel::VerticalSortHint);
+}
+
+QModelIndexList RemoteFileSystem::movedIndexes(const QModelIndexList &before) const
+{
+    QModelIndexList after;
+    after.reserve(before.size());
+    for (const QModelIndex &index : before)
+    {
+        FileNode* node = nodeFromIndex(index);
+        after.append(createIndex(node->rowInParent(), index.column(), node));
+    }
+    return after;
+}
+
+bool RemoteFileSystem::sameMetadata(const FileNode* node, const SFTPEntry &entry) const
+{
+    return node->size == entry.size
+           && node->permissions == entry.permissions
+           && node->mtime == entry.mtime
+           && node->isDirectory == entry.isDirectory
+           && names.name(node->owner) == entry.owner
+           && names.name(node->group) == entry.group;
+}
+
+void RemoteFileSystem::assign(FileNode* node, const SFTPEntry &entry)
+{
+    if (node->name != entry.name)
+    {
+        setName(node, entry.name);
+    }
+    node->size = entry.size;
+    node->mtime = entry.mtime;
+    node->permissions = entry.permissions;
+    node->owner = names.intern(entry.owner);
+    node->group = names.intern(entry.group);
+    node->isDirectory = entry.isDirectory;
+}
+
+void RemoteFileSystem::setName(FileNode* node, const QString &name)
+{
+    node->name = name;
+    node->nameKey.reset();
+    if (node->parent && node->parent->keyed)
+    {
+        node->nameKey = std::make_unique<QCollatorSortKey>(collator.sortKey(name));
+    }
+}
+
+///
+/// \brief RemoteFileSystem::pathOf builds the path of a node from its parents, nodes do not store it.
+///
+QString RemoteFileSystem::pathOf(const FileNode* node) const
+{
+    QStringList parts;
+    for (; node != rootNode && node->parent != rootNode; node = node->parent)
+    {
+        parts.prepend(node->name);
+    }
+    return "/" + parts.join('/');
+}
+
 QModelIndex RemoteFileSystem::parent(const FileNode &node) const
 {
 
@@ -202,43 +1024,40 @@ QModelIndex RemoteFileSystem::parent(const FileNode &node) const
     {
         return QModelIndex();
     }
-    FileNode* grandparentNode = parentNode->parent;
-    int row = 0;
-    if (grandparentNode)
-    {
-        row = grandparentNode->children.indexOf(parentNode);
-    }
+    return createIndex(parentNode->rowInParent(), 0, parentNode);
+}
 
-    return createIndex(row, 0, parentNode);
+FileNode* RemoteFileSystem::hostNode(const QString &host) const
+{
+    return rootNode->child(host);
 }
 
 ///
 /// \brief RemoteFileSystem::findOrCreateNode
+/// \param host Host the path is on, it must have a root already.
 /// \param path Path to Node
 /// \param create Should this attempt to create unkown Nodes
 /// \return FileNode at given path.
 ///
-FileNode* RemoteFileSystem::findOrCreateNode(const QString &path, bool create)
+FileNode* RemoteFileSystem::findOrCreateNode(const QString &host, const QString &path, bool create)
 {
+    FileNode *current = hostNode(host);
     if (path == "/")
     {
-        return rootNode;
+        return current;
     }
 
     QStringList parts = path.split('/', Qt::SkipEmptyParts);
-    FileNode *current = rootNode;
 
-    QString currentPath = "/";
 
     for (auto mit = parts.begin(); mit != parts.end(); mit++)
     {
         const QString &part = *mit;
         // Search for child
-        auto it = std::find_if(current->children.begin(), current->children.end(),
-                               [&](FileNode* child) {return child->entry.name == part;});
+        FileNode* existing = current->child(part);
 
         // Didn't find
-        if (it == current->children.end())
+        if (!existing)
         {
             if (!create)
             {
@@ -246,28 +1065,44 @@ FileNode* RemoteFileSystem::findOrCreateNode(const QString &path, bool create)
             }
 
             // Now create a default entry for the directory.
-            SFTPEntry subDir;
-            subDir.name = part;
-            subDir.path = currentPath + part + "/";
-            subDir.isDirectory = true;
-
-            FileNode* child = new FileNode{subDir, current, {}};
-
-            int row = current->children.size();
+            FileNode* child = arena.create(current);
+            setName(child, part);
+            child->isDirectory = true;
+            int row = childRow(current, child);
+            child->row = row;
 
             beginInsertRows(indexFromNode(current), row, row);
-            current->children.append(child);
+            current->children.insert(row, child);
+            current->childByName.insert(part, child);
             current = child;
             endInsertRows();
         }
         else
         {
-            current = *it;
+            current = existing;
         }
-        currentPath += part + "/";
     }
     return current;
 }
+///
+/// \brief RemoteFileSystem::findNode
+/// \return FileNode at path on host, nullptr if it is not in the tree.
+///
+FileNode* RemoteFileSystem::findNode(const QString &host, const QString &path) const
+{
+    FileNode* current = hostNode(host);
+    const QStringList parts = path.split('/', Qt::SkipEmptyParts);
+    for (const QString &part : parts)
+    {
+        if (!current)
+        {
+            break;
+        }
+        current = current->child(part);
+    }
+    return current;
+}
+
 FileNode* RemoteFileSystem::nodeFromIndex(const QModelIndex &index) const
 {
     if (!index.isValid())
@@ -280,8 +1115,12 @@ FileNode* RemoteFileSystem::nodeFromIndex(const QModelIndex &index) const
 
 void RemoteFileSystem::clearModel()
 {
-    qDeleteAll(rootNode->children);
+    for (FileNode* host : std::as_const(rootNode->children))
+    {
+        arena.destroy(host);
+    }
     rootNode->children.clear();
+    rootNode->childByName.clear();
 }
 
 QModelIndex RemoteFileSystem::indexFromNode(FileNode* node) const
@@ -293,8 +1132,7 @@ QModelIndex RemoteFileSystem::indexFromNode(FileNode* node) const
     if (!parentNode)
         return QModelIndex();
 
-    int row = parentNode->children.indexOf(node);
-    return createIndex(row, 0, node);
+    return createIndex(node->rowInParent(), 0, node);
 }
 
 QString RemoteFileSystem::permissionsToString(quint32 permissions) const
@@ -2,24 +2,16 @@
 #define REMOTEFILESYSTEM_H
 
 #include <QAbstractItemModel>
+#include <QHash>
+#include <QCollator>
+#include <QSet>
+#include <functional>
 #include "sshwrapper.h"
+#include "filenode.h"
+#include "listingcache.h"
+#include "navigationpredictor.h"
 
 
-struct FileNode {
-    SFTPEntry entry;
-    FileNode *parent = nullptr;
-    QList<FileNode*> children;
-
-    ~FileNode() {
-        clearChildren();
-    }
-
-    void clearChildren() {
-        qDeleteAll(children);
-        children.clear();
-    }
-};
-
 
 class RemoteFileSystem : public QAbstractItemModel
 {
@@ -33,24 +25,57 @@ public:
     QModelIndex parent(const QModelIndex &index) const override;
 
     bool hasChildren(const QModelIndex &parent) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
     int rowCount(const QModelIndex &parent) const override;
     int columnCount(const QModelIndex &parent) const override;
     QVariant data(const QModelIndex &index, int role) const override;
     QVariant headerData(int section, Qt::Orientation orientation, int role) const override;
+    void sort(int column, Qt::SortOrder order = Qt::AscendingOrder) override;
 
     // Qt::ItemFlags flags(const QModelIndex &index) const override;
 
+    QString hostOf(const QModelIndex &index) const;
+    QString pathOf(const QModelIndex &index) const;
+    SFTPEntry entry(const QModelIndex &index) const;
+    QModelIndex hostIndex(const QString &host) const;
+    bool isListing(const QModelIndex &index) const;
+    qint64 listedAt(const QModelIndex &index) const;
+    void revalidate(const QModelIndex &index);
+    QModelIndex pathIndex(const QString &host, const QString &path);
+    void removeHost(const QString &host);
+    QList<CachedListing> listings(const QString &host) const;
+    QStringList restoreListings(const QString &host, const QList<CachedListing> &listings);
+
 signals:
-    void request_list_dir(const QString &directory);
+    void request_list_dir(const QString &host, const QString &directory);
+    void request_stat_dir(const QString &host, const QString &directory);
 public slots:
-    void onSftpEntriesListed(const QList<SFTPEntry> &entries, const QString &directory);
+    void onSftpEntriesListed(const QString &host, const QList<SFTPEntry> &entries, const QString &directory, bool complete = true, qint64 mtime = -1);
+    void onListingFailed(const QString &host, const QString &directory);
+    void onDirectoriesStatted(const QString &host, const QHash<QString, qint64> &mtimes);
+    void onTreeStreamed(const QString &host, const QHash<QString, QList<SFTPEntry>> &entries);
+    void onTreeStreamFinished(const QString &host, const QStringList &directories, bool complete);
     void onItemExpanded(const QModelIndex &index);
 
-    void onSSHConnected();
+    void onSSHConnected(const QString &host);
+    void onHomeResolved(const QString &host, const QString &home);
 
 private:
+    // Invisible root, its children are the roots of the connected hosts.
+    NodeArena arena;
+    NamePool names;
     FileNode* rootNode;
-    QSet<QString> preLoadQueue;
+    QSet<QPair<QString, QString>> requested;   // Host and directory, listings asked for and not finished.
+    QSet<QPair<QString, QString>> prefetching; // The ones among them nobody opened yet.
+    QHash<QString, NavigationPredictor*> predictors;
+    int prefetchBudget; // Prefetches in flight per host.
+    QHash<QString, QHash<QString, QSet<QString>>> walkSeen; // Host, directory and the names a tree walk in progress saw there.
+
+    // Children are always kept in this order, listings are merged into it.
+    int sortColumn = 0;
+    Qt::SortOrder sortOrder = Qt::AscendingOrder;
+    QCollator collator;
 
     QIcon dirIcon;
     QIcon fileIcon;
@@ -60,7 +85,26 @@ private:
     QString permissionsToString(quint32 mode) const;
 
 
-    FileNode* findOrCreateNode(const QString &path, bool create=false);
+    FileNode* hostNode(const QString &host) const;
+    void forgetRequests(const QString &host);
+    void requestListing(const QString &host, const QString &path, bool speculative = false);
+    void prefetch(const QString &host, const FileNode* directoryNode);
+    void merge(FileNode* directoryNode, const QList<SFTPEntry> &entries, bool complete);
+    void upsert(FileNode* directoryNode, const QList<SFTPEntry> &entries);
+    void finishListing(FileNode* directoryNode, bool removeStale);
+    void removeChildren(FileNode* directoryNode, const std::function<bool(const FileNode*)> &gone);
+    int childRow(const FileNode* directoryNode, const FileNode* node, int from = 0) const;
+    bool lessThan(const FileNode* a, const FileNode* b) const;
+    int compareNames(const FileNode* a, const FileNode* b) const;
+    void keyChildren(FileNode* directoryNode);
+    void restoreOrder(FileNode* directoryNode);
+    QModelIndexList movedIndexes(const QModelIndexList &before) const;
+    void setName(FileNode* node, const QString &name);
+    bool sameMetadata(const FileNode* node, const SFTPEntry &entry) const;
+    void assign(FileNode* node, const SFTPEntry &entry);
+    QString pathOf(const FileNode* node) const;
+    FileNode* findNode(const QString &host, const QString &path) const;
+    FileNode* findOrCreateNode(const QString &host, const QString &path, bool create=false);
     FileNode* nodeFromIndex(const QModelIndex &index) const;
     QModelIndex indexFromNode(FileNode* node) const;
     void clearModel();
@@ -0,0 +1,230 @@
+#include "remoteindexer.h"
+#include <QDebug>
+#include <sys/stat.h>
+
+// Entries handed over at a time, big enough that each batch fills many nodes at once.
+#define INDEX_BATCH_SIZE 5000
+#define READ_SLICE_MS 500          // Reads wake up this often to notice a cancel.
+#define READ_TIMEOUT_MS 60000      // find can think for a while on a slow disk, but not forever.
+#define READ_BUFFER_SIZE (64 * 1024)
+
+// Type, mode, size, mtime, owner, group and path of every entry under the root, NUL terminated
+// so any name survives. Unreadable directories are skipped, find then exits with 1.
+#define FIND_FORMAT "%y %m %s %T@ %u %g %p\\0"
+
+static QString shellQuote(const QString &value)
+{
+    QString quoted = value;
+    quoted.replace("'", "'\\''");
+    return "'" + quoted + "'";
+}
+
+RemoteIndexer::RemoteIndexer(QObject *parent)
+    : QObject{parent}
+{
+}
+
+RemoteIndexer::~RemoteIndexer()
+{
+    dropSession();
+}
+
+void RemoteIndexer::setCredentials(const SessionCredentials &credentials)
+{
+    if (credentials.scope() != this->credentials.scope())
+    {
+        dropSession();
+    }
+    this->credentials = credentials;
+}
+
+bool RemoteIndexer::ensureSession(QString *error)
+{
+    if (session && ssh_is_connected(session))
+    {
+        return true;
+    }
+    dropSession();
+    return SSHWrapper::openAuxiliarySession(credentials, &session, &sftp, error);
+}
+
+void RemoteIndexer::dropSession()
+{
+    SSHWrapper::closeAuxiliarySession(session, sftp);
+    session = nullptr;
+    sftp = nullptr;
+}
+
+///
+/// \brief RemoteIndexer::indexTree runs find from root and reports what it prints as it arrives.
+///
+void RemoteIndexer::indexTree(const QString &root)
+{
+    cancelled = false;
+    QString top = root.size() > 1 && root.endsWith('/') ? root.chopped(1) : root;
+    QStringList directories{top};
+    QString error;
+    if (!ensureSession(&error))
+    {
+        emit indexFinished(top, directories, false, error);
+        return;
+    }
+    ssh_channel channel = ssh_channel_new(session);
+    if (!channel || ssh_channel_open_session(channel) != SSH_OK)
+    {
+        error = QString("Could not open a channel: %1").arg(ssh_get_error(session));
+        if (channel)
+        {
+            ssh_channel_free(channel);
+        }
+        dropSession();
+        emit indexFinished(top, directories, false, error);
+        return;
+    }
+    QString command = QString("LC_ALL=C find %1 -mindepth 1 -printf '%2' 2>/dev/null").arg(shellQuote(top), FIND_FORMAT);
+    if (ssh_channel_request_exec(channel, command.toUtf8().constData()) != SSH_OK)
+    {
+        error = QString("Could not run find: %1").arg(ssh_get_error(session));
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        emit indexFinished(top, directories, false, error);
+        return;
+    }
+
+    QHash<QString, QList<SFTPEntry>> batch;
+    int batched = 0;
+    qint64 found = 0;
+    QByteArray pending; // A record cut off at the end of the last read.
+    char buffer[READ_BUFFER_SIZE];
+    int waitedMs = 0;
+    while (!cancelled)
+    {
+        int nbytes = ssh_channel_read_timeout(channel, buffer, sizeof(buffer), 0, READ_SLICE_MS);
+        if (nbytes < 0)
+        {
+            error = QString("Reading from find failed: %1").arg(ssh_get_error(session));
+            break;
+        }
+        if (nbytes == 0)
+        {
+            if (ssh_channel_is_eof(channel))
+            {
+                break;
+            }
+            waitedMs += READ_SLICE_MS;
+            if (waitedMs >= READ_TIMEOUT_MS)
+            {
+                error = QString("find printed nothing for %1 s.").arg(READ_TIMEOUT_MS / 1000);
+                break;
+            }
+            continue;
+        }
+        waitedMs = 0;
+        pending.append(buffer, nbytes);
+
+        qsizetype start = 0;
+        qsizetype end;
+        while ((end = pending.indexOf('\0', start)) >= 0)
+        {
+            SFTPEntry entry{};
+            QString directory;
+            if (parseRecord(QByteArray::fromRawData(pending.constData() + start, end - start), &entry, &directory))
+            {
+                if (entry.isDirectory)
+                {
+                    directories.append(entry.path);
+                }
+                batch[directory].append(entry);
+                batched++;
+            }
+            start = end + 1;
+        }
+        pending.remove(0, start);
+        if (batched >= INDEX_BATCH_SIZE)
+        {
+            found += batched;
+            emit entriesFound(top, batch);
+            batch.clear();
+            batched = 0;
+        }
+    }
+    if (!batch.isEmpty())
+    {
+        found += batched;
+        emit entriesFound(top, batch);
+    }
+
+    ssh_channel_send_eof(channel);
+    ssh_channel_close(channel);
+    int status = ssh_channel_get_exit_status(channel);
+    ssh_channel_free(channel);
+    bool complete = false;
+    if (cancelled)
+    {
+        error = "Cancelled.";
+    }
+    else if (error.isEmpty())
+    {
+        complete = status == 0;
+        if (status != 0 && found == 0)
+        {
+            error = QString("find failed with status %1, it may not support -printf.").arg(status);
+        }
+    }
+    if (!error.isEmpty() && !ssh_is_connected(session))
+    {
+        dropSession();
+    }
+    qDebug() << "Indexed" << found << "entries under" << top << (complete ? "completely" : "partly") << error;
+    emit indexFinished(top, directories, complete, error);
+}
+
+///
+/// \brief RemoteIndexer::parseRecord reads one "type mode size mtime owner group path" record.
+/// \return false for a malformed record.
+///
+bool RemoteIndexer::parseRecord(const QByteArray &record, SFTPEntry *entry, QString *directory)
+{
+    // The path is last and may hold spaces, only the first six separate fields.
+    QList<QByteArray> fields;
+    qsizetype start = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        qsizetype space = record.indexOf(' ', start);
+        if (space < 0)
+        {
+            return false;
+        }
+        fields.append(record.mid(start, space - start));
+        start = space + 1;
+    }
+    QString path = QString::fromUtf8(record.mid(start));
+    qsizetype slash = path.lastIndexOf('/');
+    if (slash < 0 || slash == path.size() - 1 || fields.at(0).size() != 1)
+    {
+        return false;
+    }
+
+    quint32 type = 0;
+    switch (fields.at(0).at(0))
+    {
+    case 'd': type = S_IFDIR; break;
+    case 'f': type = S_IFREG; break;
+    case 'l': type = S_IFLNK; break;
+    case 'p': type = S_IFIFO; break;
+    case 's': type = S_IFSOCK; break;
+    case 'c': type = S_IFCHR; break;
+    case 'b': type = S_IFBLK; break;
+    }
+    bool ok = false;
+    entry->permissions = type | fields.at(1).toUInt(&ok, 8);
+    entry->size = fields.at(2).toULongLong();
+    entry->mtime = fields.at(3).split('.').constFirst().toLongLong();
+    entry->owner = QString::fromUtf8(fields.at(4));
+    entry->group = QString::fromUtf8(fields.at(5));
+    entry->isDirectory = type == S_IFDIR;
+    entry->name = path.mid(slash + 1);
+    entry->path = path;
+    *directory = slash == 0 ? QString("/") : path.left(slash);
+    return ok;
+}
@@ -0,0 +1,47 @@
+#ifndef REMOTEINDEXER_H
+#define REMOTEINDEXER_H
+
+#include "sshwrapper.h"
+#include <QObject>
+#include <QHash>
+#include <atomic>
+
+///
+/// \brief The RemoteIndexer class walks a whole remote tree with one find over an exec channel
+/// instead of an OPENDIR and READDIRs per directory. The output is parsed as it streams in and
+/// reported in batches grouped by directory, for the tree and the path index to take. Runs on its
+/// own thread and session, opened on first use from the credentials of the browsing session.
+/// Needs a find with -printf (GNU findutils).
+///
+class RemoteIndexer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RemoteIndexer(QObject *parent = nullptr);
+    ~RemoteIndexer();
+
+    // Thread safe, stops a running walk at its next read.
+    void cancel() { cancelled = true; }
+
+public slots:
+    void setCredentials(const SessionCredentials &credentials);
+    void indexTree(const QString &root);
+
+signals:
+    // Entries keyed by the directory they are in.
+    void entriesFound(const QString &root, const QHash<QString, QList<SFTPEntry>> &entries);
+    // Every directory the walk went through, root included. Complete when find read all of them.
+    void indexFinished(const QString &root, const QStringList &directories, bool complete, const QString &error);
+
+private:
+    SessionCredentials credentials;
+    ssh_session session = nullptr;
+    sftp_session sftp = nullptr;
+    std::atomic<bool> cancelled{false};
+
+    bool ensureSession(QString *error);
+    void dropSession();
+    static bool parseRecord(const QByteArray &record, SFTPEntry *entry, QString *directory);
+};
+
+#endif // REMOTEINDEXER_H
@@ -0,0 +1,468 @@
+#include "sessionconnector.h"
+#include <QDebug>
+#include <QSettings>
+#include <algorithm>
+
+#define FALLBACK_TICK_MS 250     // In case libssh buffered data the socket won't signal again.
+
+QString ConnectTimings::summary() const
+{
+    return QString("Connected in %1 ms via %2 (resolve %3, tcp %4, handshake %5, %6 auth %7, sftp %8 ms)")
+        .arg(totalMs()).arg(address).arg(resolveMs).arg(tcpMs).arg(handshakeMs)
+        .arg(authMethod).arg(authMs).arg(sftpMs);
+}
+
+SessionConnector::SessionConnector(QObject *parent)
+    : QObject{parent}
+{
+    phaseTimer = new QTimer(this);
+    phaseTimer->setSingleShot(true);
+    connect(phaseTimer, &QTimer::timeout, this, &SessionConnector::onPhaseTimeout);
+
+    tickTimer = new QTimer(this);
+    tickTimer->setInterval(FALLBACK_TICK_MS);
+    connect(tickTimer, &QTimer::timeout, this, &SessionConnector::step);
+
+    racer = new AddressRacer(this);
+    connect(racer, &AddressRacer::resolved, this, [this]() {
+        setPhase(OpeningSocket);
+    });
+    connect(racer, &AddressRacer::won, this, &SessionConnector::onSocketWon);
+    connect(racer, &AddressRacer::failed, this, [this](const QString &message) {
+        fail(message);
+    });
+}
+
+SessionConnector::~SessionConnector()
+{
+    abort();
+}
+
+QString SessionConnector::phaseName(Phase phase)
+{
+    switch (phase)
+    {
+    case Idle: return "idle";
+    case Resolving: return "resolving the host name";
+    case OpeningSocket: return "opening a connection";
+    case Connecting: return "exchanging keys";
+    case VerifyingHost: return "verifying the host key";
+    case WaitingHostKey: return "waiting for the host key to be accepted";
+    case AuthenticatingKey: return "authenticating with a key";
+    case WaitingPassword: return "waiting for the password";
+    case AuthenticatingPassword: return "authenticating with the password";
+    case StartingSftp: return "starting SFTP";
+    }
+    return QString();
+}
+
+///
+/// \brief SessionConnector::start begins connecting, dropping any attempt still in progress.
+/// The result is reported with succeeded() or failed().
+/// \param preferredAuth Method to try first, the one that succeeded last time.
+/// \param interactive False for background connects, which fail instead of prompting.
+///
+void SessionConnector::start(const QString &user, const QString &host, quint16 port, int compressionLevel, const QString &preferredAuth, bool interactive)
+{
+    abort();
+    this->interactive = interactive;
+    this->user = user;
+    this->host = host;
+    userPassword.clear();
+    authOrder = QStringList{"publickey", "password"};
+    if (authOrder.removeOne(preferredAuth))
+    {
+        authOrder.prepend(preferredAuth);
+    }
+    lastTimings = ConnectTimings{};
+    clock.start();
+    phaseStart = 0;
+    timeoutMs = QSettings().value("connect/phaseTimeout", DEFAULT_PHASE_TIMEOUT).toInt() * 1000;
+
+    session = ssh_new();
+    if (session == NULL)
+    {
+        fail("Failed to allocate SSH session.");
+        return;
+    }
+    unsigned int portNumber = port;
+    ssh_options_set(session, SSH_OPTIONS_HOST, host.toUtf8().constData());
+    ssh_options_set(session, SSH_OPTIONS_USER, user.toUtf8().constData());
+    ssh_options_set(session, SSH_OPTIONS_PORT, &portNumber);
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, compressionLevel > 0 ? "yes" : "no");
+    if (compressionLevel > 0)
+    {
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION_LEVEL, &compressionLevel);
+    }
+    ssh_set_blocking(session, 0);
+
+    setPhase(Resolving);
+    racer->start(host, port);
+}
+
+///
+/// \brief SessionConnector::onSocketWon hands the raced TCP connection to libssh and starts the handshake.
+///
+void SessionConnector::onSocketWon(socket_t fd, const QString &address)
+{
+    lastTimings.address = address;
+    ssh_options_set(session, SSH_OPTIONS_FD, &fd);
+    setPhase(Connecting);
+    step();
+}
+
+///
+/// \brief SessionConnector::cancel stops the attempt on the user's request and reports it as failed.
+///
+void SessionConnector::cancel()
+{
+    if (current != Idle)
+    {
+        fail("Connection cancelled.", true);
+    }
+}
+
+///
+/// \brief SessionConnector::abort drops the attempt without reporting anything.
+///
+void SessionConnector::abort()
+{
+    racer->abort();
+    unwatchSocket();
+    tickTimer->stop();
+    phaseTimer->stop();
+    current = Idle;
+    if (sftp)
+    {
+        sftp_free(sftp);
+        sftp = nullptr;
+    }
+    if (session)
+    {
+        if (ssh_is_connected(session))
+        {
+            ssh_disconnect(session);
+        }
+        ssh_free(session);
+        session = nullptr;
+    }
+}
+
+void SessionConnector::answerHostKey(bool trusted)
+{
+    if (current != WaitingHostKey)
+    {
+        return;
+    }
+    if (!trusted)
+    {
+        fail("Host key rejected.", true);
+        return;
+    }
+    if (ssh_session_update_known_hosts(session) < 0)
+    {
+        fail(QString("Error %1\n").arg(strerror(errno)));
+        return;
+    }
+    nextAuth();
+}
+
+void SessionConnector::answerPassword(const QString &password, bool accepted)
+{
+    if (current != WaitingPassword)
+    {
+        return;
+    }
+    if (!accepted)
+    {
+        fail("Authentication cancelled.", true);
+        return;
+    }
+    userPassword = password;
+    setPhase(AuthenticatingPassword);
+    step();
+}
+
+///
+/// \brief SessionConnector::takeSession hands the connected session over to the caller, who frees it.
+///
+void SessionConnector::takeSession(ssh_session *sessionOut, sftp_session *sftpOut)
+{
+    *sessionOut = session;
+    *sftpOut = sftp;
+    session = nullptr;
+    sftp = nullptr;
+}
+
+///
+/// \brief SessionConnector::step advances the current phase as far as libssh can without waiting.
+///
+void SessionConnector::step()
+{
+    int rc;
+    switch (current)
+    {
+    case Connecting:
+        rc = ssh_connect(session);
+        if (rc == SSH_AGAIN)
+        {
+            break;
+        }
+        if (rc != SSH_OK)
+        {
+            fail(QString("Error connecting ssh: %1").arg(ssh_get_error(session)));
+            return;
+        }
+        verifyHost();
+        return;
+
+    case AuthenticatingKey:
+        rc = ssh_userauth_publickey_auto(session, NULL, NULL);
+        if (rc == SSH_AUTH_AGAIN)
+        {
+            break;
+        }
+        if (rc == SSH_AUTH_SUCCESS)
+        {
+            lastTimings.authMethod = "publickey";
+            startSftp();
+            return;
+        }
+        if (rc == SSH_AUTH_ERROR)
+        {
+            fail(QString("Authentication failed: %1").arg(ssh_get_error(session)));
+            return;
+        }
+        qDebug("Agent authentication failed.");
+        nextAuth();
+        return;
+
+    case AuthenticatingPassword:
+        rc = ssh_userauth_password(session, user.toUtf8().constData(), userPassword.toUtf8().constData());
+        if (rc == SSH_AUTH_AGAIN)
+        {
+            break;
+        }
+        if (rc == SSH_AUTH_ERROR || (rc != SSH_AUTH_SUCCESS && authOrder.isEmpty()))
+        {
+            fail(QString("Authentication failed: %1").arg(ssh_get_error(session)));
+            return;
+        }
+        if (rc != SSH_AUTH_SUCCESS)
+        {
+            // Password tried first from habit, the key may still work.
+            userPassword.clear();
+            nextAuth();
+            return;
+        }
+        lastTimings.authMethod = "password";
+        startSftp();
+        return;
+
+    default:
+        // Nothing to drive while idle or waiting for the user.
+        return;
+    }
+    watchSocket();
+}
+
+void SessionConnector::onPhaseTimeout()
+{
+    qDebug() << "Connection to" << host << "timed out while" << phaseName(current);
+    fail(QString("Timed out while %1.").arg(phaseName(current)));
+}
+
+///
+/// \brief SessionConnector::nextAuth moves on to the next authentication method not tried yet.
+///
+void SessionConnector::nextAuth()
+{
+    if (authOrder.isEmpty())
+    {
+        fail("Authentication failed.");
+        return;
+    }
+    QString method = authOrder.takeFirst();
+    if (method == "password")
+    {
+        if (!interactive)
+        {
+            nextAuth();
+            return;
+        }
+        qDebug("Requesting user password.");
+        setPhase(WaitingPassword);
+        emit passwordPrompt(QString("Password for %1@%2").arg(user, host));
+        return;
+    }
+    setPhase(AuthenticatingKey);
+    step();
+}
+
+void SessionConnector::account(Phase phase, qint64 ms)
+{
+    switch (phase)
+    {
+    case Resolving: lastTimings.resolveMs += ms; break;
+    case OpeningSocket: lastTimings.tcpMs += ms; break;
+    case Connecting:
+    case VerifyingHost: lastTimings.handshakeMs += ms; break;
+    case AuthenticatingKey:
+    case AuthenticatingPassword: lastTimings.authMs += ms; break;
+    case StartingSftp: lastTimings.sftpMs += ms; break;
+    default: break; // Waiting on the user doesn't count.
+    }
+}
+
+void SessionConnector::setPhase(Phase phase)
+{
+    qint64 now = clock.elapsed();
+    account(current, now - phaseStart);
+    phaseStart = now;
+    current = phase;
+    if (phase == Idle || phase == WaitingHostKey || phase == WaitingPassword)
+    {
+        // The user may take as long as they like, and the socket is not read meanwhile.
+        phaseTimer->stop();
+        tickTimer->stop();
+        unwatchSocket();
+    }
+    else
+    {
+        phaseTimer->start(timeoutMs);
+        tickTimer->start();
+    }
+    if (phase != Idle)
+    {
+        emit phaseChanged(phaseName(phase));
+    }
+}
+
+///
+/// \brief SessionConnector::watchSocket steps again when the socket becomes readable, or writable
+/// while libssh has something to send.
+///
+void SessionConnector::watchSocket()
+{
+    socket_t fd = ssh_get_fd(session);
+    if (fd == SSH_INVALID_SOCKET)
+    {
+        return;
+    }
+    if (!readNotifier)
+    {
+        readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        writeNotifier = new QSocketNotifier(fd, QSocketNotifier::Write, this);
+        connect(readNotifier, &QSocketNotifier::activated, this, &SessionConnector::step);
+        connect(writeNotifier, &QSocketNotifier::activated, this, &SessionConnector::step);
+    }
+    readNotifier->setEnabled(true);
+    writeNotifier->setEnabled(ssh_get_poll_flags(session) & SSH_WRITE_PENDING);
+}
+
+void SessionConnector::unwatchSocket()
+{
+    // Possibly called from their own activated() signal, so not deleted right away.
+    for (QSocketNotifier *notifier : {readNotifier, writeNotifier})
+    {
+        if (notifier)
+        {
+            notifier->setEnabled(false);
+            notifier->deleteLater();
+        }
+    }
+    readNotifier = nullptr;
+    writeNotifier = nullptr;
+}
+
+void SessionConnector::verifyHost()
+{
+    setPhase(VerifyingHost);
+
+    ssh_key srv_pubkey = NULL;
+    unsigned char *hash = NULL;
+    size_t hlen;
+    if (ssh_get_server_publickey(session, &srv_pubkey) < 0)
+    {
+        fail("Error getting server pubkey.");
+        return;
+    }
+    int rc = ssh_get_publickey_hash(srv_pubkey, SSH_PUBLICKEY_HASH_SHA1, &hash, &hlen);
+    ssh_key_free(srv_pubkey);
+    if (rc < 0)
+    {
+        fail("Error getting server pubkey hash.");
+        return;
+    }
+    char *hexa = ssh_get_hexa(hash, hlen);
+    QString fingerprint = QString::fromUtf8(hexa);
+    ssh_string_free_char(hexa);
+    ssh_clean_pubkey_hash(&hash);
+
+    switch (ssh_session_is_known_server(session))
+    {
+    case SSH_KNOWN_HOSTS_OK:
+        nextAuth();
+        return;
+    case SSH_KNOWN_HOSTS_CHANGED:
+        fail(QString("Host key for server changed it is now:\n%1\nFor security reasons, connection will be stopped.").arg(fingerprint));
+        return;
+    case SSH_KNOWN_HOSTS_OTHER:
+        fail("The host key for this server was not ofund but an other type of key exists. An attacker might change the default server key to confuse your client into thinking the key does not exits.");
+        return;
+    case SSH_KNOWN_HOSTS_NOT_FOUND:
+    case SSH_KNOWN_HOSTS_UNKNOWN:
+        if (!interactive)
+        {
+            fail("The host key is not known yet.");
+            return;
+        }
+        setPhase(WaitingHostKey);
+        emit hostKeyPrompt(QString("The server is unkown. Do you trust the host key?\nPublic key hash: %1").arg(fingerprint));
+        return;
+    case SSH_KNOWN_HOSTS_ERROR:
+        fail(QString("Error %1\n").arg(ssh_get_error(session)));
+        return;
+    }
+}
+
+///
+/// \brief SessionConnector::startSftp opens the SFTP channel. The SFTP API needs a blocking session,
+/// so for this last phase the phase timeout is applied through the session timeout.
+///
+void SessionConnector::startSftp()
+{
+    setPhase(StartingSftp);
+    unwatchSocket();
+    tickTimer->stop();
+    phaseTimer->stop();
+
+    long timeoutSeconds = std::max(1, timeoutMs / 1000);
+    ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeoutSeconds);
+    ssh_set_blocking(session, 1);
+
+    sftp = sftp_new(session);
+    if (sftp == NULL)
+    {
+        fail(QString("failed to allocate SFTP session: %1").arg(ssh_get_error(session)));
+        return;
+    }
+    if (sftp_init(sftp) != SSH_OK)
+    {
+        fail(QString("Error initializing sftp: %1").arg(sftp_get_error(sftp)));
+        return;
+    }
+
+    // Transfers and listings can legitimately wait much longer for a reply than connecting may.
+    long replyTimeout = SESSION_REPLY_TIMEOUT;
+    ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &replyTimeout);
+    setPhase(Idle);
+    emit succeeded();
+}
+
+void SessionConnector::fail(const QString &message, bool cancelled)
+{
+    qDebug() << "Connecting to" << host << "failed:" << message;
+    abort();
+    emit failed(message, cancelled);
+}
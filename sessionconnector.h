@@ -0,0 +1,107 @@
+#ifndef SESSIONCONNECTOR_H
+#define SESSIONCONNECTOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSocketNotifier>
+#include <QStringList>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include "addressracer.h"
+
+#define DEFAULT_PHASE_TIMEOUT 10 // Seconds, overridden by connect/phaseTimeout.
+// Seconds a connected session waits for any one reply. A timeout of 0 is not "none" but libssh's
+// 10 s default, too short for a busy server writing out a large file.
+#define SESSION_REPLY_TIMEOUT 300
+
+///
+/// \brief Where the time of one connect went, in milliseconds. Time spent waiting on the user is left out.
+///
+struct ConnectTimings {
+    QString address;    // Address that won the race.
+    QString authMethod; // "publickey" or "password".
+    qint64 resolveMs = 0;
+    qint64 tcpMs = 0;
+    qint64 handshakeMs = 0; // Banner, key exchange and host key check.
+    qint64 authMs = 0;
+    qint64 sftpMs = 0;
+
+    qint64 totalMs() const { return resolveMs + tcpMs + handshakeMs + authMs + sftpMs; }
+    QString summary() const;
+};
+
+///
+/// \brief The SessionConnector class opens and authenticates a session without blocking its thread.
+/// libssh runs in non blocking mode and is stepped whenever the socket is ready. Every phase has
+/// its own timeout. The TCP connection is raced over all resolved addresses by an AddressRacer
+/// and handed to libssh, and the authentication method that worked last time is tried first.
+/// Questions for the user (unknown host key, password) are emitted as signals
+/// and the connector waits for the answer, so the dialogs can run on the GUI thread.
+/// SFTP itself has no non blocking API, its start is bounded by the session timeout instead.
+///
+class SessionConnector : public QObject
+{
+    Q_OBJECT
+public:
+    enum Phase { Idle, Resolving, OpeningSocket, Connecting, VerifyingHost, WaitingHostKey, AuthenticatingKey, WaitingPassword, AuthenticatingPassword, StartingSftp };
+
+    explicit SessionConnector(QObject *parent = nullptr);
+    ~SessionConnector();
+
+    void start(const QString &user, const QString &host, quint16 port, int compressionLevel, const QString &preferredAuth = QString(), bool interactive = true);
+    void cancel();
+    void abort();
+    void answerHostKey(bool trusted);
+    void answerPassword(const QString &password, bool accepted);
+
+    void takeSession(ssh_session *sessionOut, sftp_session *sftpOut);
+    const QString& password() const { return userPassword; }
+    const ConnectTimings& timings() const { return lastTimings; }
+    Phase phase() const { return current; }
+    static QString phaseName(Phase phase);
+
+signals:
+    void phaseChanged(const QString &name);
+    void hostKeyPrompt(const QString &message);
+    void passwordPrompt(const QString &prompt);
+    void succeeded();
+    void failed(const QString &message, bool cancelled); // Cancelled by the user, nothing to show.
+
+private slots:
+    void step();
+    void onPhaseTimeout();
+    void onSocketWon(socket_t fd, const QString &address);
+
+private:
+    ssh_session session = nullptr;
+    sftp_session sftp = nullptr;
+    QSocketNotifier *readNotifier = nullptr;
+    QSocketNotifier *writeNotifier = nullptr;
+    QTimer *phaseTimer;
+    QTimer *tickTimer;
+    AddressRacer *racer;
+    Phase current = Idle;
+    int timeoutMs = 0;
+
+    QStringList authOrder; // Methods not tried yet, in order.
+    bool interactive = true; // Otherwise fail where the user would be asked.
+    ConnectTimings lastTimings;
+    QElapsedTimer clock;
+    qint64 phaseStart = 0;
+
+    QString user;
+    QString host;
+    QString userPassword;
+
+    void setPhase(Phase phase);
+    void watchSocket();
+    void unwatchSocket();
+    void verifyHost();
+    void nextAuth();
+    void account(Phase phase, qint64 ms);
+    void startSftp();
+    void fail(const QString &message, bool cancelled = false);
+};
+
+#endif // SESSIONCONNECTOR_H
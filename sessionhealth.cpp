@@ -0,0 +1,138 @@
+#include "sessionhealth.h"
+#include "sessionconnector.h"
+#include <QElapsedTimer>
+#include <QDebug>
+
+#define DEFAULT_IDLE_INTERVAL 30
+#define KEEPALIVE_TIMEOUT 5 // Seconds a keepalive may take before the session counts as down.
+
+SessionHealth::SessionHealth(QObject *parent)
+    : QObject{parent}
+{
+    idleTimer = new QTimer(this);
+    idleTimer->setSingleShot(true);
+    idleTimer->setInterval(DEFAULT_IDLE_INTERVAL * 1000);
+    connect(idleTimer, &QTimer::timeout, this, &SessionHealth::onIdle);
+}
+
+///
+/// \brief SessionHealth::setSession starts watching a freshly connected session, or stops with nullptr.
+/// Does not report, whoever connected the session already knows.
+///
+void SessionHealth::setSession(ssh_session session, sftp_session sftp)
+{
+    this->session = session;
+    this->sftp = sftp;
+    alive = session != nullptr;
+    smoothedRtt = 0;
+    if (alive)
+    {
+        noteActivity();
+    }
+    else
+    {
+        idleTimer->stop();
+    }
+}
+
+///
+/// \brief SessionHealth::setIdleInterval
+/// \param seconds Idle time before a keepalive is sent, 0 disables keepalives.
+///
+void SessionHealth::setIdleInterval(int seconds)
+{
+    idleTimer->setInterval(seconds * 1000);
+    if (seconds <= 0)
+    {
+        idleTimer->stop();
+    }
+}
+
+void SessionHealth::noteActivity()
+{
+    setAlive(true);
+    if (idleTimer->interval() > 0)
+    {
+        idleTimer->start();
+    }
+}
+
+///
+/// \brief SessionHealth::noteRtt folds a round trip into the smoothed RTT, the same way TCP does.
+///
+void SessionHealth::noteRtt(double ms)
+{
+    if (ms <= 0)
+    {
+        return;
+    }
+    smoothedRtt = smoothedRtt > 0 ? smoothedRtt * 7 / 8 + ms / 8 : ms;
+    emit rttChanged(smoothedRtt);
+}
+
+///
+/// \brief SessionHealth::noteFailure is called after a request failed. Only a dropped connection
+/// counts, a missing file or a denied permission is still an answer from a live session.
+///
+void SessionHealth::noteFailure()
+{
+    if (!session || !ssh_is_connected(session))
+    {
+        idleTimer->stop();
+        setAlive(false);
+    }
+}
+
+///
+/// \brief SessionHealth::onIdle sends a keepalive. It runs on the thread of the session and blocks
+/// it while waiting, so the wait is cut to KEEPALIVE_TIMEOUT instead of libssh's own timeout. An
+/// answer that does not come in time reports the session as down, the next request that gets
+/// through reports it alive again.
+///
+void SessionHealth::onIdle()
+{
+    if (!session || !ssh_is_connected(session))
+    {
+        setAlive(false);
+        return;
+    }
+
+    // A stat is the cheapest request that has to be answered, unlike an SSH ignore packet.
+    long timeout = KEEPALIVE_TIMEOUT;
+    ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+    QElapsedTimer clock;
+    clock.start();
+    sftp_attributes attributes = sftp_stat(sftp, ".");
+    double ms = clock.nsecsElapsed() / 1e6;
+    long replyTimeout = SESSION_REPLY_TIMEOUT;
+    ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &replyTimeout);
+    bool answered = attributes != nullptr;
+    if (attributes)
+    {
+        sftp_attributes_free(attributes);
+    }
+    bool connected = ssh_is_connected(session);
+    if (!connected || (!answered && ms >= KEEPALIVE_TIMEOUT * 1000))
+    {
+        qDebug() << "Keepalive failed after" << ms << "ms:" << ssh_get_error(session);
+        setAlive(false);
+        if (connected && idleTimer->interval() > 0)
+        {
+            // Still connected as far as libssh knows, try again after another idle interval.
+            idleTimer->start();
+        }
+        return;
+    }
+    noteRtt(ms);
+    noteActivity();
+}
+
+void SessionHealth::setAlive(bool alive)
+{
+    if (this->alive == alive)
+    {
+        return;
+    }
+    this->alive = alive;
+    emit statusChanged(alive);
+}
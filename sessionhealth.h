@@ -0,0 +1,48 @@
+#ifndef SESSIONHEALTH_H
+#define SESSIONHEALTH_H
+
+#include <QObject>
+#include <QTimer>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+///
+/// \brief The SessionHealth class tracks whether a session is alive and how long a round trip takes.
+/// Requests that succeed already prove the session works, so a keepalive is only sent once the
+/// session has been idle for the configured interval. Status is reported when it changes.
+/// Lives on the thread of the session it watches.
+///
+class SessionHealth : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SessionHealth(QObject *parent = nullptr);
+
+    void setSession(ssh_session session, sftp_session sftp);
+    void setIdleInterval(int seconds);
+
+    void noteActivity();
+    void noteRtt(double ms);
+    void noteFailure();
+
+    bool isAlive() const { return alive; }
+    double rttMs() const { return smoothedRtt; }
+
+signals:
+    void statusChanged(bool alive);
+    void rttChanged(double ms);
+
+private slots:
+    void onIdle();
+
+private:
+    ssh_session session = nullptr;
+    sftp_session sftp = nullptr;
+    QTimer *idleTimer;
+    bool alive = false;
+    double smoothedRtt = 0;
+
+    void setAlive(bool alive);
+};
+
+#endif // SESSIONHEALTH_H
@@ -0,0 +1,68 @@
+#include "sessionpool.h"
+#include <QDebug>
+#include <QDeadlineTimer>
+
+#define STOP_TIMEOUT_MS 2000 // Longest the GUI thread waits for the session threads.
+
+SessionPool::SessionPool(QObject *parent)
+    : QObject{parent}
+{
+    transfers = new TransferManager(this);
+    browse = new SSHWrapper();
+    transfer = new SSHWrapper();
+    index = new RemoteIndexer();
+    browseThread = startWorker(browse, this);
+    transferThread = startWorker(transfer, this);
+    indexThread = startWorker(index, this);
+
+    // The transfer session follows the browse session to whichever host it authenticated on.
+    connect(browse, &SSHWrapper::authenticated, transfer, &SSHWrapper::attachSession);
+    connect(browse, &SSHWrapper::authenticated, transfers, &TransferManager::setCredentials);
+    connect(browse, &SSHWrapper::authenticated, index, &RemoteIndexer::setCredentials);
+}
+
+///
+/// \brief SessionPool::~SessionPool stops the sessions without waiting on a transfer or walk in
+/// progress. Their work is cancelled first, a thread that is still busy when the time is up is
+/// left to finish on its own, cut off from whatever it would still report.
+///
+SessionPool::~SessionPool()
+{
+    index->cancel();
+    browse->cancelTransfers();
+    transfer->cancelTransfers();
+    for (QObject *worker : std::initializer_list<QObject*>{browse, transfer, index})
+    {
+        worker->disconnect();
+    }
+    for (QThread *thread : {browseThread, transferThread, indexThread})
+    {
+        thread->requestInterruption();
+        thread->quit();
+    }
+
+    QDeadlineTimer deadline(STOP_TIMEOUT_MS);
+    for (QThread *thread : {browseThread, transferThread, indexThread})
+    {
+        if (thread->wait(deadline))
+        {
+            continue;
+        }
+        qDebug() << "Session thread did not stop in time, leaving it to finish on its own.";
+        thread->setParent(nullptr);
+        connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+        if (thread->isFinished())
+        {
+            thread->deleteLater();
+        }
+    }
+}
+
+QThread* SessionPool::startWorker(QObject *worker, QObject *parent)
+{
+    QThread *thread = new QThread(parent);
+    connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+    worker->moveToThread(thread);
+    thread->start();
+    return thread;
+}
@@ -0,0 +1,42 @@
+#ifndef SESSIONPOOL_H
+#define SESSIONPOOL_H
+
+#include "sshwrapper.h"
+#include "transfermanager.h"
+#include "remoteindexer.h"
+#include <QObject>
+#include <QThread>
+
+///
+/// \brief The SessionPool class holds the sessions open to one host, each on its own thread.
+/// The browse session is the interactive one: it connects, authenticates and serves listings
+/// and other metadata requests. Once it is authenticated a transfer session is attached with
+/// the same credentials for opening, saving and downloading files, and queued transfers run on
+/// the transfer manager's workers. A long download therefore never sits in front of a listing.
+/// Whole tree walks for the path index run on a session of their own too.
+///
+class SessionPool : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SessionPool(QObject *parent = nullptr);
+    ~SessionPool();
+
+    SSHWrapper* browser() const { return browse; }
+    SSHWrapper* transferer() const { return transfer; }
+    TransferManager* transferManager() const { return transfers; }
+    RemoteIndexer* indexer() const { return index; }
+
+private:
+    QThread *browseThread;
+    QThread *transferThread;
+    QThread *indexThread;
+    SSHWrapper *browse;
+    SSHWrapper *transfer;
+    TransferManager *transfers;
+    RemoteIndexer *index;
+
+    static QThread* startWorker(QObject *worker, QObject *parent);
+};
+
+#endif // SESSIONPOOL_H
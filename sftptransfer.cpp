@@ -0,0 +1,745 @@
+#include "sftptransfer.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QQueue>
+#include <fcntl.h>
+#include <algorithm>
+#include <memory>
+#include <limits>
+
+// Every SFTP server has to accept requests of this size.
+#define MIN_REQUEST_SIZE 32768
+#define MAX_REQUEST_SIZE (256 * 1024)
+#define MIN_WINDOW_DEPTH 4
+#define MAX_WINDOW_DEPTH 64
+#define MAX_WINDOW_BYTES (16 * 1024 * 1024)
+// Bandwidth assumed before anything has been measured, used for the first window.
+#define INITIAL_BANDWIDTH (8 * 1024 * 1024)
+
+double TransferStats::bytesPerSecond() const
+{
+    if (elapsedMs <= 0)
+    {
+        return 0;
+    }
+    return bytes * 1000.0 / elapsedMs;
+}
+
+QString TransferStats::summary() const
+{
+    return QString("%1 %2 (%3): %4 KiB in %5 ms (%6 KiB/s, %7 stream(s), %8 x %9 KiB window, RTT %10 ms)")
+        .arg(upload ? "Uploaded" : "Downloaded", remotePath, localPath)
+        .arg(bytes / 1024)
+        .arg(elapsedMs)
+        .arg(bytesPerSecond() / 1024, 0, 'f', 1)
+        .arg(streams)
+        .arg(windowDepth)
+        .arg(requestSize / 1024)
+        .arg(rttMs, 0, 'f', 1)
+        + (resumedBytes > 0 ? QString(", resumed with %1 KiB already in place").arg(resumedBytes / 1024) : QString())
+        + (unchangedBytes > 0 ? QString(", %1 KiB unchanged").arg(unchangedBytes / 1024) : QString());
+}
+
+int TransferPolicy::streamsFor(quint64 size) const
+{
+    if (size < parallelThreshold)
+    {
+        return 1;
+    }
+    return std::clamp<int>(static_cast<int>(size / bytesPerStream), 2, maxStreams);
+}
+
+SftpTransfer::SftpTransfer(ssh_session session, sftp_session sftp)
+    : session(session), sftp(sftp)
+{
+}
+
+bool SftpTransfer::fail(const QString &message)
+{
+    error = message;
+    qDebug() << message;
+    return false;
+}
+
+///
+/// \brief SftpTransfer::tune picks the request size and the initial window.
+/// \param serverMaxLength Largest read or write the server advertised via limits@openssh.com.
+///
+void SftpTransfer::tune(quint64 serverMaxLength)
+{
+    requestSize = MIN_REQUEST_SIZE;
+    if (serverMaxLength > MIN_REQUEST_SIZE)
+    {
+        requestSize = static_cast<quint32>(std::min<quint64>(serverMaxLength, MAX_REQUEST_SIZE));
+    }
+    maxWindowDepth = std::clamp<int>(MAX_WINDOW_BYTES / requestSize, MIN_WINDOW_DEPTH, MAX_WINDOW_DEPTH);
+
+    // Bandwidth-delay product of a modest link, grown later from what is measured.
+    double windowBytes = INITIAL_BANDWIDTH * lastStats.rttMs / 1000.0;
+    windowDepth = std::clamp<int>(static_cast<int>(windowBytes / requestSize) + 1, MIN_WINDOW_DEPTH, maxWindowDepth);
+
+    lastStats.requestSize = requestSize;
+    lastStats.windowDepth = windowDepth;
+}
+
+///
+/// \brief SftpTransfer::growWindow widens the window while it is the bottleneck.
+/// If the throughput times the RTT is close to the bytes we keep in flight, the link
+/// could carry more than we ask for, so one more request is added.
+///
+void SftpTransfer::growWindow(quint64 bytesDone, qint64 elapsedMs)
+{
+    if (windowDepth >= maxWindowDepth || elapsedMs <= 0 || lastStats.rttMs <= 0)
+    {
+        return;
+    }
+    double bytesPerMs = static_cast<double>(bytesDone) / elapsedMs;
+    double inFlightBytes = static_cast<double>(windowDepth) * requestSize;
+    if (bytesPerMs * lastStats.rttMs >= 0.75 * inFlightBytes)
+    {
+        windowDepth++;
+        lastStats.windowDepth = windowDepth;
+    }
+}
+
+void SftpTransfer::reset(const QString &remotePath, const QString &localPath, bool upload)
+{
+    lastStats = TransferStats{};
+    lastStats.remotePath = remotePath;
+    lastStats.localPath = localPath;
+    lastStats.upload = upload;
+    error.clear();
+    clock.start();
+    readEnd = std::numeric_limits<quint64>::max();
+}
+
+///
+/// \brief SftpTransfer::reserveLocal makes sure [offset, offset + length) of the local file
+/// has disk space behind it. A sparse range of a writable mapping that can't be allocated
+/// faults with SIGBUS on the first store, a write call fails with ENOSPC instead.
+///
+bool SftpTransfer::reserveLocal(QFile &localFile, quint64 offset, quint64 length)
+{
+#ifdef _WIN32
+    // SetEndOfFile allocates the new space, files aren't sparse unless asked to be.
+    return static_cast<quint64>(localFile.size()) >= offset + length || localFile.resize(offset + length);
+#else
+    return posix_fallocate(localFile.handle(), offset, length) == 0;
+#endif
+}
+
+///
+/// \brief SftpTransfer::mapLocal maps [offset, offset + length) of a download target so the
+/// read pipeline stores replies straight into the page cache, without a bounce buffer and a
+/// write call per chunk. The range is reserved on disk first. Sources of uploads are never
+/// mapped: reading a mapping of a file another program truncates faults instead of failing.
+/// Transfers fall back to buffered I/O when mapping is not possible.
+///
+bool SftpTransfer::mapLocal(QFile &localFile, quint64 offset, quint64 length)
+{
+    if (length == 0 || !localFile.isWritable() || !reserveLocal(localFile, offset, length))
+    {
+        return false;
+    }
+    mapBase = localFile.map(offset, length);
+    mapOffset = offset;
+    mapLength = mapBase ? length : 0;
+    return mapBase != nullptr;
+}
+
+void SftpTransfer::unmapLocal(QFile &localFile)
+{
+    if (mapBase)
+    {
+        localFile.unmap(mapBase);
+    }
+    mapBase = nullptr;
+    mapLength = 0;
+}
+
+uchar *SftpTransfer::mapped(quint64 offset, quint64 length) const
+{
+    if (!mapBase || offset < mapOffset || offset + length > mapOffset + mapLength)
+    {
+        return nullptr;
+    }
+    return mapBase + (offset - mapOffset);
+}
+
+///
+/// \brief SftpTransfer::probe measures the RTT and tunes the window for an open file.
+/// A single fstat is exactly one round trip, which makes it a cheap RTT probe.
+/// \return Size of the remote file, 0 if unknown. The mtime is kept in remoteMtime.
+///
+quint64 SftpTransfer::probe(sftp_file file)
+{
+    QElapsedTimer rttTimer;
+    rttTimer.start();
+    sftp_attributes attributes = sftp_fstat(file);
+    lastStats.rttMs = rttTimer.nsecsElapsed() / 1e6;
+    quint64 remoteSize = 0;
+    remoteMtime = 0;
+    if (attributes)
+    {
+        remoteSize = attributes->size;
+        remoteMtime = attributes->mtime;
+        sftp_attributes_free(attributes);
+    }
+
+    sftp_limits_t limits = sftp_limits(sftp);
+    quint64 serverMaxLength = 0;
+    if (limits)
+    {
+        serverMaxLength = lastStats.upload ? limits->max_write_length : limits->max_read_length;
+        sftp_limits_free(limits);
+    }
+    tune(serverMaxLength);
+    return remoteSize;
+}
+
+bool SftpTransfer::download(const QString &remotePath, const QString &localPath)
+{
+    reset(remotePath, localPath, false);
+
+    sftp_file file = sftp_open(sftp, remotePath.toUtf8().constData(), O_RDONLY, 0);
+    if (!file)
+    {
+        return fail(QString("Can't open remote file '%1' for reading: %2")
+                        .arg(remotePath, ssh_get_error(session)));
+    }
+
+    quint64 remoteSize = probe(file);
+
+    // Only files with a known size can be resumed, the journal is keyed on it.
+    std::unique_ptr<TransferJournal> ownJournal;
+    bool resume = false;
+    if (!journalScope.isEmpty() && remoteSize > 0)
+    {
+        ownJournal.reset(new TransferJournal(journalScope, remotePath, localPath, false));
+        resume = ownJournal->load() && ownJournal->matches(remoteSize, remoteMtime) && QFileInfo::exists(localPath);
+        if (!resume)
+        {
+            ownJournal->start(remoteSize, remoteMtime);
+        }
+        journal = ownJournal.get();
+    }
+
+    // Opened for reading too, a writable mapping needs it. Unbuffered, so a range is in the
+    // kernel once it is committed to the journal and the journal's sync covers it.
+    QFile localFile(localPath);
+    QIODevice::OpenMode mode = QIODevice::ReadWrite | QIODevice::Unbuffered;
+    if (!resume)
+    {
+        mode |= QIODevice::Truncate;
+    }
+    if (!localFile.open(mode))
+    {
+        journal = nullptr;
+        sftp_close(file);
+        return fail(QString("Can't open file '%1' for writing: %2").arg(localPath, localFile.errorString()));
+    }
+    mapLocal(localFile, 0, remoteSize);
+
+    // Some files (e.g. under /proc) report a size of zero, those are read until EOF.
+    QList<ByteRange> ranges{ByteRange(0, remoteSize)};
+    if (resume)
+    {
+        ranges = journal->missing(0, remoteSize);
+        lastStats.resumedBytes = journal->committedBytes();
+        qDebug() << "Resuming" << remotePath << "with" << lastStats.resumedBytes << "bytes already in place";
+    }
+
+    bool ok = true;
+    for (const ByteRange &range : ranges)
+    {
+        if (!readRange(file, localFile, range.first, range.second))
+        {
+            ok = false;
+            break;
+        }
+    }
+    journal = nullptr;
+    unmapLocal(localFile);
+    // The file shrank since it was sized up front, cut the preallocated tail.
+    if (ok && readEnd < static_cast<quint64>(localFile.size()))
+    {
+        localFile.resize(readEnd);
+    }
+
+    if (!ok)
+    {
+        sftp_close(file);
+        localFile.close();
+        if (ownJournal && ownJournal->committedBytes() > 0)
+        {
+            // Keep what arrived, the next attempt only fetches the rest.
+            ownJournal->save(true);
+            error += " The partial file was kept and the transfer will resume.";
+            return false;
+        }
+        if (!localFile.remove())
+        {
+            qDebug() << QString("Failed to remove file: '%1'").arg(localPath);
+        }
+        return false;
+    }
+
+    if (ownJournal)
+    {
+        ownJournal->remove();
+    }
+    return finish(file, localFile);
+}
+
+///
+/// \brief SftpTransfer::downloadRange fetches [offset, offset + length) of a remote file into
+/// the same range of an existing local file. The local file is left in place on failure,
+/// whoever split the transfer decides what to do with it. Parts already committed to the
+/// journal set with setJournal are skipped. Fails if the file now ends inside the range.
+///
+bool SftpTransfer::downloadRange(const QString &remotePath, const QString &localPath, quint64 offset, quint64 length)
+{
+    reset(remotePath, localPath, false);
+
+    sftp_file file = sftp_open(sftp, remotePath.toUtf8().constData(), O_RDONLY, 0);
+    if (!file)
+    {
+        return fail(QString("Can't open remote file '%1' for reading: %2")
+                        .arg(remotePath, ssh_get_error(session)));
+    }
+    probe(file);
+
+    QFile localFile(localPath);
+    if (!localFile.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        sftp_close(file);
+        return fail(QString("Can't open file '%1' for writing: %2").arg(localPath, localFile.errorString()));
+    }
+
+    mapLocal(localFile, offset, length);
+
+    QList<ByteRange> ranges{ByteRange(offset, offset + length)};
+    if (journal)
+    {
+        ranges = journal->missing(offset, offset + length);
+        lastStats.resumedBytes = length;
+        for (const ByteRange &range : ranges)
+        {
+            lastStats.resumedBytes -= range.second - range.first;
+        }
+    }
+    bool ok = true;
+    for (const ByteRange &range : ranges)
+    {
+        if (!readRange(file, localFile, range.first, range.second))
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    // An empty reply inside the range: the file no longer is what the range was cut from,
+    // the bytes past that point would stay zeros in the local file.
+    if (ok && readEnd < offset + length)
+    {
+        sftp_attributes attributes = sftp_fstat(file);
+        quint64 currentSize = attributes ? attributes->size : readEnd;
+        if (attributes)
+        {
+            sftp_attributes_free(attributes);
+        }
+        ok = fail(currentSize < offset + length
+                      ? QString("Remote file '%1' shrank to %2 bytes while it was downloaded.").arg(remotePath).arg(currentSize)
+                      : QString("Remote file '%1' ended early at %2 bytes while it was downloaded.").arg(remotePath).arg(readEnd));
+    }
+
+    unmapLocal(localFile);
+    if (!ok)
+    {
+        sftp_close(file);
+        localFile.close();
+        return false;
+    }
+    return finish(file, localFile);
+}
+
+///
+/// \brief SftpTransfer::readRange runs the read pipeline.
+/// \param start First byte to read.
+/// \param end One past the last byte to read, 0 to read until EOF.
+///
+bool SftpTransfer::readRange(sftp_file file, QFile &localFile, quint64 start, quint64 end)
+{
+    struct PendingRead {
+        sftp_aio aio;
+        quint64 offset;
+        quint32 length;
+    };
+    QQueue<PendingRead> inFlight;
+    bool endKnown = end > 0;
+    QByteArray buffer;
+    if (!endKnown || !mapped(start, end - start))
+    {
+        buffer.resize(requestSize);
+    }
+    quint64 nextOffset = start;
+    bool eof = false;
+    bool ok = true;
+
+    sftp_seek64(file, start);
+    while (ok)
+    {
+        if (cancelled())
+        {
+            ok = fail(QString("Transfer of '%1' cancelled.").arg(lastStats.remotePath));
+            break;
+        }
+        while (!eof && inFlight.size() < windowDepth && (!endKnown || nextOffset < end))
+        {
+            // Never ask past the known end, that would cost an extra round trip on the tail.
+            quint32 length = requestSize;
+            if (endKnown)
+            {
+                length = static_cast<quint32>(std::min<quint64>(requestSize, end - nextOffset));
+            }
+            sftp_aio aio = nullptr;
+            ssize_t requested = sftp_aio_begin_read(file, length, &aio);
+            if (requested == SSH_ERROR)
+            {
+                ok = fail(QString("Error reading remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session)));
+                break;
+            }
+            inFlight.enqueue({aio, nextOffset, static_cast<quint32>(requested)});
+            nextOffset += requested;
+        }
+        if (!ok || inFlight.isEmpty())
+        {
+            break;
+        }
+
+        PendingRead pending = inFlight.dequeue();
+        uchar *target = mapped(pending.offset, pending.length);
+        ssize_t nbytes = target ? sftp_aio_wait_read(&pending.aio, target, pending.length)
+                                : sftp_aio_wait_read(&pending.aio, buffer.data(), buffer.size());
+        if (nbytes < 0)
+        {
+            ok = fail(QString("Error reading remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session)));
+            break;
+        }
+        if (nbytes == 0)
+        {
+            // Anything still in flight lies past the end and comes back empty.
+            eof = true;
+            readEnd = std::min(readEnd, pending.offset);
+            continue;
+        }
+
+        if (!target && (!localFile.seek(pending.offset) || localFile.write(buffer.constData(), nbytes) != nbytes))
+        {
+            ok = fail(QString("Error writing to local file '%1': %2").arg(lastStats.localPath, localFile.errorString()));
+            break;
+        }
+        lastStats.bytes += nbytes;
+        if (journal)
+        {
+            journal->commit(pending.offset, nbytes);
+        }
+
+        if (static_cast<quint64>(nbytes) < pending.length)
+        {
+            // Short reply in the middle of the file: ask again for the remainder
+            // without disturbing the offset the pipeline continues from.
+            sftp_aio aio = nullptr;
+            sftp_seek64(file, pending.offset + nbytes);
+            ssize_t requested = sftp_aio_begin_read(file, pending.length - nbytes, &aio);
+            sftp_seek64(file, nextOffset);
+            if (requested == SSH_ERROR)
+            {
+                ok = fail(QString("Error reading remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session)));
+                break;
+            }
+            inFlight.enqueue({aio, pending.offset + nbytes, static_cast<quint32>(requested)});
+        }
+
+        growWindow(lastStats.bytes, clock.elapsed());
+    }
+
+    for (PendingRead &pending : inFlight)
+    {
+        sftp_aio_free(pending.aio);
+    }
+    return ok;
+}
+
+///
+/// \brief SftpTransfer::writeRange runs the write pipeline.
+/// Writes are sent as soon as they are issued, so the buffer is free again
+/// and the next local chunk is read while the earlier ones are on the wire.
+/// \param start First byte to send.
+/// \param end One past the last byte to send, 0 to send until the end of the local file.
+///
+bool SftpTransfer::writeRange(sftp_file file, QFile &localFile, quint64 start, quint64 end)
+{
+    struct PendingWrite {
+        sftp_aio aio;
+        quint64 offset;
+    };
+    QQueue<PendingWrite> inFlight;
+    quint64 nextOffset = start;
+    bool endKnown = end > 0;
+    bool ok = true;
+    QByteArray buffer(requestSize, Qt::Uninitialized);
+
+    if (!localFile.seek(start))
+    {
+        return fail(QString("Error reading local file '%1': %2").arg(lastStats.localPath, localFile.errorString()));
+    }
+    sftp_seek64(file, start);
+
+    auto moreToSend = [&]() {
+        return endKnown ? nextOffset < end : !localFile.atEnd();
+    };
+    while (ok && (moreToSend() || !inFlight.isEmpty()))
+    {
+        if (cancelled())
+        {
+            ok = fail(QString("Transfer of '%1' cancelled.").arg(lastStats.remotePath));
+            break;
+        }
+        if (moreToSend() && inFlight.size() < windowDepth)
+        {
+            qint64 length = requestSize;
+            if (endKnown)
+            {
+                length = static_cast<qint64>(std::min<quint64>(requestSize, end - nextOffset));
+            }
+            qint64 nbytes = localFile.read(buffer.data(), length);
+            if (nbytes < 0)
+            {
+                ok = fail(QString("Error reading local file '%1': %2").arg(lastStats.localPath, localFile.errorString()));
+                break;
+            }
+            if (nbytes == 0 && endKnown)
+            {
+                ok = fail(QString("Local file '%1' shrank while it was uploaded.").arg(lastStats.localPath));
+                break;
+            }
+            if (nbytes == 0)
+            {
+                continue;
+            }
+            sftp_aio aio = nullptr;
+            if (sftp_aio_begin_write(file, buffer.constData(), nbytes, &aio) != nbytes)
+            {
+                ok = fail(QString("Error writing to remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session)));
+                break;
+            }
+            inFlight.enqueue({aio, nextOffset});
+            nextOffset += nbytes;
+            continue;
+        }
+
+        PendingWrite pending = inFlight.dequeue();
+        ssize_t nwritten = sftp_aio_wait_write(&pending.aio);
+        if (nwritten < 0)
+        {
+            ok = fail(QString("Error writing to remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session)));
+            break;
+        }
+        lastStats.bytes += nwritten;
+        if (journal)
+        {
+            journal->commit(pending.offset, nwritten);
+        }
+        growWindow(lastStats.bytes, clock.elapsed());
+    }
+
+    for (PendingWrite &pending : inFlight)
+    {
+        sftp_aio_free(pending.aio);
+    }
+    return ok;
+}
+
+///
+/// \brief SftpTransfer::uploadRanges overwrites only the given ranges of an existing remote
+/// file with the same ranges of the local file, then cuts the remote file to finalSize.
+///
+bool SftpTransfer::uploadRanges(const QString &localPath, const QString &remotePath, const QList<ByteRange> &ranges, quint64 finalSize)
+{
+    reset(remotePath, localPath, true);
+
+    QFile localFile(localPath);
+    if (!localFile.open(QIODevice::ReadOnly))
+    {
+        return fail(QString("Can't open local file '%1' for reading: %2")
+                        .arg(localPath, localFile.errorString()));
+    }
+    sftp_file file = sftp_open(sftp, remotePath.toUtf8().constData(), O_WRONLY, 0);
+    if (!file)
+    {
+        localFile.close();
+        return fail(QString("Can't open remote file '%1' for writing: %2")
+                        .arg(remotePath, ssh_get_error(session)));
+    }
+    quint64 remoteSize = probe(file);
+    QDateTime localMtime = QFileInfo(localPath).lastModified();
+
+    for (const ByteRange &range : ranges)
+    {
+        if (!writeRange(file, localFile, range.first, range.second))
+        {
+            sftp_close(file);
+            localFile.close();
+            return false;
+        }
+    }
+    if (localChanged(localPath, finalSize, localMtime))
+    {
+        sftp_close(file);
+        localFile.close();
+        return false;
+    }
+
+    if (remoteSize > finalSize)
+    {
+        struct sftp_attributes_struct attributes = {};
+        attributes.flags = SSH_FILEXFER_ATTR_SIZE;
+        attributes.size = finalSize;
+        if (sftp_setstat(sftp, remotePath.toUtf8().constData(), &attributes) != SSH_OK)
+        {
+            sftp_close(file);
+            localFile.close();
+            return fail(QString("Can't truncate remote file '%1': %2").arg(remotePath, ssh_get_error(session)));
+        }
+    }
+
+    return finish(file, localFile);
+}
+
+///
+/// \brief SftpTransfer::localChanged tells whether the source of an upload was resized or
+/// rewritten while it was sent, the remote copy would then mix two versions of it.
+///
+bool SftpTransfer::localChanged(const QString &localPath, quint64 size, const QDateTime &mtime)
+{
+    QFileInfo info(localPath);
+    if (static_cast<quint64>(info.size()) == size && info.lastModified() == mtime)
+    {
+        return false;
+    }
+    fail(QString("Local file '%1' changed while it was uploaded.").arg(localPath));
+    return true;
+}
+
+///
+/// \brief SftpTransfer::finish closes both ends of a successful transfer.
+/// The data is complete at this point, so a failing close is reported but not fatal.
+///
+bool SftpTransfer::finish(sftp_file file, QFile &localFile)
+{
+    if (sftp_close(file) != SSH_OK)
+    {
+        error = QString("Can't close remote file '%1': %2").arg(lastStats.remotePath, ssh_get_error(session));
+        qDebug() << error;
+    }
+    localFile.close();
+
+    lastStats.elapsedMs = clock.elapsed();
+    qDebug() << lastStats.summary();
+    return true;
+}
+
+bool SftpTransfer::upload(const QString &localPath, const QString &remotePath)
+{
+    reset(remotePath, localPath, true);
+
+    QFile localFile(localPath);
+    if (!localFile.open(QIODevice::ReadOnly))
+    {
+        return fail(QString("Can't open local file '%1' for reading: %2")
+                        .arg(localPath, localFile.errorString()));
+    }
+
+    // An upload resumes from the longest committed prefix, the local file is the source
+    // so its size and mtime decide whether the journal still applies.
+    QFileInfo localInfo(localPath);
+    quint64 localSize = localInfo.size();
+    qint64 localMtime = localInfo.lastModified().toSecsSinceEpoch();
+    std::unique_ptr<TransferJournal> ownJournal;
+    quint64 startOffset = 0;
+    if (!journalScope.isEmpty())
+    {
+        ownJournal.reset(new TransferJournal(journalScope, remotePath, localPath, true));
+        if (ownJournal->load() && ownJournal->matches(localSize, localMtime))
+        {
+            startOffset = ownJournal->committedPrefix();
+        }
+        else
+        {
+            ownJournal->start(localSize, localMtime);
+        }
+    }
+
+    sftp_file file = nullptr;
+    if (startOffset > 0)
+    {
+        file = sftp_open(sftp, remotePath.toUtf8().constData(), O_WRONLY, 0);
+        quint64 remoteSize = file ? probe(file) : 0;
+        // Someone else touched the remote file in the meantime, start over.
+        if (file && (remoteSize < startOffset || remoteSize > localSize))
+        {
+            sftp_close(file);
+            file = nullptr;
+        }
+        if (!file)
+        {
+            startOffset = 0;
+            ownJournal->start(localSize, localMtime);
+        }
+    }
+    if (!file)
+    {
+        int access_type = O_WRONLY | O_CREAT | O_TRUNC;
+        file = sftp_open(sftp, remotePath.toUtf8().constData(), access_type, 0);
+        if (!file)
+        {
+            localFile.close();
+            return fail(QString("Can't open remote file '%1' for writing: %2")
+                            .arg(remotePath, ssh_get_error(session)));
+        }
+        probe(file);
+    }
+
+    if (startOffset > 0)
+    {
+        qDebug() << "Resuming upload of" << localPath << "at offset" << startOffset;
+        lastStats.resumedBytes = startOffset;
+    }
+
+    // A file with a known size is sent up to that size, otherwise until the local file ends.
+    journal = ownJournal.get();
+    bool ok = writeRange(file, localFile, startOffset, localSize);
+    journal = nullptr;
+    ok = ok && !localChanged(localPath, localSize, localInfo.lastModified());
+
+    if (!ok)
+    {
+        sftp_close(file);
+        localFile.close();
+        if (ownJournal)
+        {
+            ownJournal->save(true);
+        }
+        return false;
+    }
+
+    if (ownJournal)
+    {
+        ownJournal->remove();
+    }
+    return finish(file, localFile);
+}
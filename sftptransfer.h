@@ -0,0 +1,109 @@
+#ifndef SFTPTRANSFER_H
+#define SFTPTRANSFER_H
+
+#include <QString>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QDateTime>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include "transferjournal.h"
+#include <atomic>
+
+struct TransferStats {
+    QString remotePath;
+    QString localPath;
+    bool upload = false;
+    quint64 bytes = 0;
+    qint64 elapsedMs = 0;
+    double rttMs = 0;
+    quint32 requestSize = 0;
+    int windowDepth = 0;
+    int streams = 1;
+    quint64 resumedBytes = 0;
+    quint64 unchangedBytes = 0; // Skipped by a delta upload.
+
+    double bytesPerSecond() const;
+    QString summary() const;
+};
+
+///
+/// \brief Decides how a remote file is fetched from its size.
+/// Small files open in the editor, larger ones are saved to disk and the
+/// largest are split over several sessions.
+///
+struct TransferPolicy {
+    quint64 maxEditorSize = 10 * 1024 * 1024;
+    quint64 parallelThreshold = 64 * 1024 * 1024;
+    quint64 bytesPerStream = 32 * 1024 * 1024;
+    int maxStreams = 4;
+
+    bool opensInEditor(quint64 size) const { return size <= maxEditorSize; }
+    int streamsFor(quint64 size) const;
+};
+
+///
+/// \brief The SftpTransfer class moves a single file over an already initialized
+/// SFTP session. Instead of waiting a round trip for every chunk it keeps a window
+/// of asynchronous requests in flight, sized from the server limits and the RTT
+/// measured while opening the file. Runs synchronously on the caller's thread.
+///
+class SftpTransfer
+{
+public:
+    SftpTransfer(ssh_session session, sftp_session sftp);
+
+    bool download(const QString &remotePath, const QString &localPath);
+    bool downloadRange(const QString &remotePath, const QString &localPath, quint64 offset, quint64 length);
+    bool upload(const QString &localPath, const QString &remotePath);
+    bool uploadRanges(const QString &localPath, const QString &remotePath, const QList<ByteRange> &ranges, quint64 finalSize);
+
+    // Transfers record their progress in journals under this scope (e.g. user@host:port),
+    // an empty scope disables resuming.
+    void setJournalScope(const QString &scope) { journalScope = scope; }
+    // Journal shared by the ranges of one split download.
+    void setJournal(TransferJournal *journal) { this->journal = journal; }
+    // Checked between replies, set from another thread to stop the transfer as failed.
+    void setCancelFlag(const std::atomic<bool> *flag) { cancelFlag = flag; }
+
+    const TransferStats& stats() const { return lastStats; }
+    const QString& errorString() const { return error; }
+
+private:
+    ssh_session session;
+    sftp_session sftp;
+
+    TransferStats lastStats;
+    QString error;
+    QElapsedTimer clock;
+    QString journalScope;
+    TransferJournal *journal = nullptr;
+    const std::atomic<bool> *cancelFlag = nullptr;
+    qint64 remoteMtime = 0;
+    quint64 readEnd = 0; // Offset of the first empty reply, the real end of a file that shrank.
+
+    uchar *mapBase = nullptr;
+    quint64 mapOffset = 0;
+    quint64 mapLength = 0;
+
+    quint32 requestSize = 0;
+    int windowDepth = 0;
+    int maxWindowDepth = 0;
+
+    void reset(const QString &remotePath, const QString &localPath, bool upload);
+    bool reserveLocal(QFile &localFile, quint64 offset, quint64 length);
+    bool mapLocal(QFile &localFile, quint64 offset, quint64 length);
+    void unmapLocal(QFile &localFile);
+    uchar *mapped(quint64 offset, quint64 length) const;
+    quint64 probe(sftp_file file);
+    void tune(quint64 serverMaxLength);
+    void growWindow(quint64 bytesDone, qint64 elapsedMs);
+    bool readRange(sftp_file file, QFile &localFile, quint64 start, quint64 end);
+    bool writeRange(sftp_file file, QFile &localFile, quint64 start, quint64 end);
+    bool localChanged(const QString &localPath, quint64 size, const QDateTime &mtime);
+    bool finish(sftp_file file, QFile &localFile);
+    bool fail(const QString &message);
+    bool cancelled() const { return cancelFlag && *cancelFlag; }
+};
+
+#endif // SFTPTRANSFER_H
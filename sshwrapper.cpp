@@ -1,11 +1,16 @@
 #include "sshwrapper.h"
+#include "sftptransfer.h"
+#include "paralleltransfer.h"
+#include "deltaupload.h"
+#include "listingpipeline.h"
 #include <QDateTime>
 #include<QStandardPaths>
 #include <QFile>
 #include <QFileInfo>
 #include <QDir>
-
-#define MAX_XFER_BUF_SIZE 16384
+#include <QSet>
+#include <QSettings>
+#include <algorithm>
 
 
 SSHWrapper::SSHWrapper(QObject *parent)
@@ -13,45 +18,40 @@ SSHWrapper::SSHWrapper(QObject *parent)
 {
     session = nullptr;
     sftp = nullptr;
-    statusTimer = new QTimer(this);
-    connect(statusTimer, &QTimer::timeout, this, &SSHWrapper::checkConnection);
-    statusTimer->start(500);
+    health = new SessionHealth(this);
+    connect(health, &SessionHealth::statusChanged, this, [this](bool alive) {
+        emit connectionStatus(alive);
+    });
+    connect(health, &SessionHealth::rttChanged, this, &SSHWrapper::rttMeasured);
+
+    connector = new SessionConnector(this);
+    connect(connector, &SessionConnector::succeeded, this, &SSHWrapper::onConnected);
+    connect(connector, &SessionConnector::failed, this, &SSHWrapper::onConnectFailed);
+    connect(connector, &SessionConnector::phaseChanged, this, &SSHWrapper::connectPhase);
+    connect(connector, &SessionConnector::hostKeyPrompt, this, &SSHWrapper::hostKeyPrompt);
+    connect(connector, &SessionConnector::passwordPrompt, this, &SSHWrapper::passwordPrompt);
 }
 
 SSHWrapper::~SSHWrapper()
 {
-    statusTimer->stop();
     this->clearSession();
 }
 
-void SSHWrapper::checkConnection()
+void SSHWrapper::setKeepaliveInterval(int seconds)
 {
-    if (!session)
-    {
-        emit connectionStatus(false);
-        return;
-    }
-    if (!ssh_is_connected(session))
-    {
-        emit connectionStatus(false);
-        return;
-    }
-
-    // Send SSH keepalive packet
-    int rc = ssh_send_ignore(session, "keepalive");
-    if (rc != SSH_OK) {
-        emit connectionStatus(false);
-        return;
-    }
-    emit connectionStatus(true, !sessionSeen);
-    sessionSeen = true;
+    health->setIdleInterval(seconds);
 }
 
 void SSHWrapper::clearSession()
 {
+    connector->abort();
+    delete pipeline;
+    pipeline = nullptr;
+    pipelineRefused = false;
     if (sftp)
     {
         sftp_free(sftp);
+        sftp = nullptr;
     }
     if (session)
     {
@@ -60,74 +60,321 @@ void SSHWrapper::clearSession()
             ssh_disconnect(session);
         }
         ssh_free(session);
+        session = nullptr;
+    }
+    credentials = SessionCredentials{};
+    if (health->isAlive())
+    {
+        emit connectionStatus(false);
     }
-    sessionSeen = false;
+    health->setSession(nullptr, nullptr);
 }
 
 
-void SSHWrapper::connectSession(const QString &user, const QString& host, const quint16& port)
+///
+/// \brief compressibility estimates how well zlib shrinks a payload.
+/// \return Uncompressed over compressed size, 0 if the sample is too small to tell.
+///
+static double compressibility(const QByteArray &sample)
+{
+    constexpr int MIN_SAMPLE_SIZE = 4096;
+    if (sample.size() < MIN_SAMPLE_SIZE)
+    {
+        return 0;
+    }
+    return static_cast<double>(sample.size()) / qCompress(sample, 6).size();
+}
+
+///
+/// \brief SSHWrapper::connectSession starts connecting and returns right away.
+/// The connector reports back through onConnected() or onConnectFailed().
+///
+void SSHWrapper::connectSession(const QString &user, const QString& host, const quint16& port, int compressionLevel, const QString &preferredAuth, bool interactive)
 {
     clearSession(); // Get rid of the old in favor of the new
-    session = ssh_new();
     qDebug() << "SSHWrapper connection : " << user << " " << host << " " << port;
-    if (session == NULL)
+    pendingCredentials = SessionCredentials{user, host, port, QString(), compressionLevel};
+    connector->start(user, host, port, compressionLevel, preferredAuth, interactive);
+}
+
+void SSHWrapper::cancelConnect()
+{
+    connector->cancel();
+}
+
+void SSHWrapper::answerHostKey(bool trusted)
+{
+    connector->answerHostKey(trusted);
+}
+
+void SSHWrapper::answerPassword(const QString &password, bool accepted)
+{
+    connector->answerPassword(password, accepted);
+}
+
+void SSHWrapper::onConnected()
+{
+    connector->takeSession(&session, &sftp);
+    credentials = pendingCredentials;
+    credentials.password = connector->password();
+    health->setSession(session, sftp);
+    qDebug() << connector->timings().summary();
+    emit connectTimed(connector->timings());
+    emit connectionStatus(true, true);
+    emit authenticated(credentials);
+
+    // Start on the first listings right away instead of waiting for the GUI thread to ask.
+    QMetaObject::invokeMethod(this, [this]() {
+        sftp_list_dir("/");
+        resolveHome();
+    }, Qt::QueuedConnection);
+    resumeInterrupted();
+}
+
+///
+/// \brief SSHWrapper::resolveHome finds the directory the session started in and lists it.
+/// Reports "/" when the server will not say.
+///
+void SSHWrapper::resolveHome()
+{
+    if (!requireSession())
     {
-        emit errorOccured("Failed to allocate SSH session.");
-        clearSession();
         return;
     }
+    QString home = "/";
+    char *path = sftp_canonicalize_path(sftp, ".");
+    if (path)
+    {
+        home = QString::fromUtf8(path);
+        ssh_string_free_char(path);
+    }
+    else
+    {
+        qDebug() << "Could not resolve the home directory:" << ssh_get_error(session);
+    }
+    emit homeResolved(home);
+    if (home != "/")
+    {
+        sftp_list_dir(home);
+    }
+}
 
-    ssh_options_set(session, SSH_OPTIONS_HOST, host.toUtf8());
-    ssh_options_set(session, SSH_OPTIONS_USER, user.toUtf8());
-    ssh_options_set(session, SSH_OPTIONS_PORT, &port);
-    int rc = ssh_connect(session);
-    if (rc != SSH_OK)
+void SSHWrapper::onConnectFailed(const QString &message, bool cancelled)
+{
+    if (!cancelled)
     {
-        emit errorOccured(QString("Error connecting ssh: %1").arg(ssh_get_error(session)));
-        return;
+        emit errorOccured(message);
     }
-    if (!verify_knownhost())
+    emit connectFailed(message, cancelled);
+}
+
+///
+/// \brief SSHWrapper::attachSession opens this wrapper's session without prompting, on a host
+/// another wrapper already authenticated to. Transfers interrupted on the previous session to
+/// the same host are replayed.
+///
+void SSHWrapper::attachSession(const SessionCredentials &credentials)
+{
+    clearSession();
+    QString error;
+    if (!openAuxiliarySession(credentials, &session, &sftp, &error))
     {
-        clearSession();
+        qDebug() << "Attaching session failed:" << error;
+        emit errorOccured(error);
         return;
     }
-    rc = ssh_userauth_publickey_auto(session, NULL, NULL);
-    if (rc != SSH_AUTH_SUCCESS)
+    this->credentials = credentials;
+    health->setSession(session, sftp);
+    resumeInterrupted();
+}
+
+bool SSHWrapper::requireSession()
+{
+    if (sftp)
     {
-        qDebug("Agent authentication failed. Requesting user password.");
-        QString password = QInputDialog::getText(nullptr, "", QString("Password for %1@%2").arg(user, host), QLineEdit::Password);
+        return true;
+    }
+    emit errorOccured("Not connected.");
+    return false;
+}
 
-        rc = ssh_userauth_password(session, user.toUtf8().constData(), password.toUtf8().constData());
-        if (rc != SSH_AUTH_SUCCESS)
-        {
-            return;
-        }
+///
+/// \brief SSHWrapper::sampleTransfer reports throughput and compressibility of a finished transfer.
+/// Small files are dominated by round trips and only contribute their compressibility.
+///
+void SSHWrapper::sampleTransfer(const TransferStats &stats)
+{
+    constexpr quint64 MIN_BANDWIDTH_SAMPLE = 256 * 1024;
+    QFile localFile(stats.localPath);
+    QByteArray sample;
+    if (localFile.open(QIODevice::ReadOnly))
+    {
+        sample = localFile.read(65536);
     }
+    double bytesPerSecond = stats.bytes >= MIN_BANDWIDTH_SAMPLE ? stats.bytesPerSecond() : 0;
+    emit trafficSampled(bytesPerSecond, compressibility(sample), credentials.compressionLevel);
 
-    sftp = sftp_new(session);
-    if (sftp == NULL)
+    // The transfer measured a round trip when it opened the file.
+    health->noteRtt(stats.rttMs);
+    health->noteActivity();
+}
+
+///
+/// \brief SSHWrapper::rememberIfInterrupted queues a failed transfer for replay if it failed
+/// because the session went away. Its journal lets the replay skip what already moved.
+///
+void SSHWrapper::rememberIfInterrupted(const InterruptedTransfer &transfer)
+{
+    health->noteFailure();
+    if (session && ssh_is_connected(session))
     {
-        emit errorOccured("failed to allocate SFTP session.");
-        qDebug("failed to allocate SFTP session.");
-        clearSession();
         return;
     }
+    if (interruptedScope != credentials.scope())
+    {
+        interrupted.clear();
+        interruptedScope = credentials.scope();
+    }
+    qDebug() << "Transfer of" << transfer.remotePath << "interrupted, resuming after reconnect.";
+    interrupted.append(transfer);
+}
 
-    rc = sftp_init(sftp);
-    if (rc != SSH_OK)
+void SSHWrapper::resumeInterrupted()
+{
+    QList<InterruptedTransfer> pending;
+    pending.swap(interrupted);
+    if (interruptedScope != credentials.scope())
     {
-        emit errorOccured(QString("Error initializing sftp: %1").arg(sftp_get_error(sftp)));
-        qDebug() << QString("Error initializing sftp: %1").arg(sftp_get_error(sftp));
-        clearSession();
         return;
     }
-    return;
+
+    // Queued so the connect finishes (and reports) before the transfers start.
+    for (const InterruptedTransfer &transfer : pending)
+    {
+        QMetaObject::invokeMethod(this, [this, transfer]() {
+            switch (transfer.kind)
+            {
+            case InterruptedTransfer::Open:
+                onRequestFile(transfer.remotePath);
+                break;
+            case InterruptedTransfer::Download:
+                onDownloadFile(transfer.remotePath, transfer.localPath, transfer.size, transfer.streams);
+                break;
+            case InterruptedTransfer::Upload:
+                onSendFile(transfer.localPath, transfer.remotePath);
+                break;
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+///
+/// \brief SSHWrapper::openAuxiliarySession opens an extra, non interactive session to a host
+/// the main session already connected to. Used for transfers that run on other threads.
+/// The host key has to be known already, nothing is prompted. The session compresses like the
+/// main one, and connecting is bounded by the same phase timeout as the main session's phases.
+///
+bool SSHWrapper::openAuxiliarySession(const SessionCredentials &credentials, ssh_session *sessionOut, sftp_session *sftpOut, QString *error)
+{
+    *sessionOut = nullptr;
+    *sftpOut = nullptr;
+
+    ssh_session auxSession = ssh_new();
+    if (auxSession == NULL)
+    {
+        *error = "Failed to allocate SSH session.";
+        return false;
+    }
+    unsigned int port = credentials.port;
+    ssh_options_set(auxSession, SSH_OPTIONS_HOST, credentials.host.toUtf8().constData());
+    ssh_options_set(auxSession, SSH_OPTIONS_USER, credentials.user.toUtf8().constData());
+    ssh_options_set(auxSession, SSH_OPTIONS_PORT, &port);
+    int compressionLevel = credentials.compressionLevel;
+    ssh_options_set(auxSession, SSH_OPTIONS_COMPRESSION, compressionLevel > 0 ? "yes" : "no");
+    if (compressionLevel > 0)
+    {
+        ssh_options_set(auxSession, SSH_OPTIONS_COMPRESSION_LEVEL, &compressionLevel);
+    }
+    long timeoutSeconds = std::max(1, QSettings().value("connect/phaseTimeout", DEFAULT_PHASE_TIMEOUT).toInt());
+    ssh_options_set(auxSession, SSH_OPTIONS_TIMEOUT, &timeoutSeconds);
+
+    if (ssh_connect(auxSession) != SSH_OK)
+    {
+        *error = QString("Error connecting ssh: %1").arg(ssh_get_error(auxSession));
+        ssh_free(auxSession);
+        return false;
+    }
+    if (ssh_session_is_known_server(auxSession) != SSH_KNOWN_HOSTS_OK)
+    {
+        *error = QString("Host key of %1 is not known, refusing auxiliary session.").arg(credentials.host);
+        closeAuxiliarySession(auxSession, nullptr);
+        return false;
+    }
+
+    // Same method as the main session, a password is only kept when that is what worked.
+    int rc;
+    if (!credentials.password.isEmpty())
+    {
+        rc = ssh_userauth_password(auxSession, credentials.user.toUtf8().constData(), credentials.password.toUtf8().constData());
+    }
+    else
+    {
+        rc = ssh_userauth_publickey_auto(auxSession, NULL, NULL);
+    }
+    if (rc != SSH_AUTH_SUCCESS)
+    {
+        *error = QString("Authentication of auxiliary session failed: %1").arg(ssh_get_error(auxSession));
+        closeAuxiliarySession(auxSession, nullptr);
+        return false;
+    }
+
+    sftp_session auxSftp = sftp_new(auxSession);
+    if (auxSftp == NULL)
+    {
+        *error = "failed to allocate SFTP session.";
+        closeAuxiliarySession(auxSession, nullptr);
+        return false;
+    }
+    if (sftp_init(auxSftp) != SSH_OK)
+    {
+        *error = QString("Error initializing sftp: %1").arg(sftp_get_error(auxSftp));
+        closeAuxiliarySession(auxSession, auxSftp);
+        return false;
+    }
+
+    // Transfers can legitimately wait much longer for a reply than connecting may.
+    long replyTimeout = SESSION_REPLY_TIMEOUT;
+    ssh_options_set(auxSession, SSH_OPTIONS_TIMEOUT, &replyTimeout);
+    *sessionOut = auxSession;
+    *sftpOut = auxSftp;
+    return true;
+}
+
+void SSHWrapper::closeAuxiliarySession(ssh_session session, sftp_session sftp)
+{
+    if (sftp)
+    {
+        sftp_free(sftp);
+    }
+    if (session)
+    {
+        if (ssh_is_connected(session))
+        {
+            ssh_disconnect(session);
+        }
+        ssh_free(session);
+    }
 }
 
 void SSHWrapper::sftp_list_dir(const QString &directory)
 {
     QString fixedDir = directory + "/";
     qDebug() << "Requested directory: " << fixedDir;
+    if (!requireSession())
+    {
+        emit sftpListingFailed(directory);
+        return;
+    }
     sftp_dir dir;
     sftp_attributes attributes;
     int rc;
@@ -136,14 +383,25 @@ void SSHWrapper::sftp_list_dir(const QString &directory)
     if (!dir)
     {
         qDebug() << "Directory not opened: " << fixedDir;
+        emit sftpListingFailed(directory);
         emit errorOccured(QString("Directory not opened: %1").arg(fixedDir));
+        health->noteFailure();
         return;
     }
     QList<SFTPEntry> entries;
+    qint64 mtime = -1; // Of the directory itself, from its "." entry.
+    QByteArray sample; // What a listing looks like on the wire, to judge compression.
+    // About one READDIR answer first, so something shows after a round trip, then bigger batches.
+    int batchSize = FIRST_LISTING_BATCH_SIZE;
     while ((attributes = sftp_readdir(sftp, dir)) != NULL)
     {
         if (strcmp(attributes->name, ".") == 0 || strcmp(attributes->name, "..") == 0)
         {
+            if (attributes->name[1] == '\0')
+            {
+                mtime = attributes->mtime;
+            }
+            sftp_attributes_free(attributes);
             continue;
         }
         SFTPEntry entry;
@@ -156,20 +414,48 @@ void SSHWrapper::sftp_list_dir(const QString &directory)
         entry.gid = attributes->gid;
         entry.isDirectory = (attributes->type == SSH_FILEXFER_TYPE_DIRECTORY);
         entry.path = fixedDir + QString::fromUtf8(attributes->name);
-        entry.mtimeString = QDateTime::fromSecsSinceEpoch(attributes->mtime).toString();
+        entry.mtime = attributes->mtime;
         entry.createtime = attributes->createtime;
 
         entries.append(entry);
+        if (sample.size() < 65536 && attributes->longname)
+        {
+            sample.append(attributes->longname).append('\n');
+        }
         sftp_attributes_free(attributes);
+        if (entries.size() >= batchSize)
+        {
+            emit sftpEntriesListed(entries, directory, false, -1);
+            entries.clear();
+            batchSize = LISTING_BATCH_SIZE;
+        }
+    }
+    if (double ratio = compressibility(sample))
+    {
+        emit trafficSampled(0, ratio, credentials.compressionLevel);
     }
-    emit sftpEntriesListed(entries, directory);
 
     if (!sftp_dir_eof(dir))
     {
+        emit sftpEntriesListed(entries, directory, false, -1);
+        emit sftpListingFailed(directory);
         emit errorOccured(QString("Can't list directory: %1").arg(ssh_get_error(session)));
+        health->noteFailure();
         sftp_closedir(dir);
         return;
     }
+    if (mtime < 0)
+    {
+        // The server left "." out, a stat this late may miss a change made during the listing.
+        sftp_attributes own = sftp_stat(sftp, fixedDir.toUtf8().constData());
+        if (own)
+        {
+            mtime = own->mtime;
+            sftp_attributes_free(own);
+        }
+    }
+    emit sftpEntriesListed(entries, directory, true, mtime);
+    health->noteActivity();
 
     rc = sftp_closedir(dir);
     if (rc != SSH_OK)
@@ -179,252 +465,259 @@ void SSHWrapper::sftp_list_dir(const QString &directory)
         return;
     }
 }
-bool SSHWrapper::verify_knownhost()
-{
-    enum ssh_known_hosts_e state;
-    unsigned char *hash = NULL;
-    ssh_key srv_pubkey = NULL;
-    size_t hlen;
-    char buf[10];
-    char *hexa;
-    char *p;
-    int cmp;
-    int rc;
-
-    rc = ssh_get_server_publickey(session, &srv_pubkey);
-    if (rc < 0) {
-        emit errorOccured("Error getting server pubkey.");
-        return false;
-    }
 
-    rc = ssh_get_publickey_hash(srv_pubkey,
-                                SSH_PUBLICKEY_HASH_SHA1,
-                                &hash,
-                                &hlen);
-    ssh_key_free(srv_pubkey);
-    if (rc < 0) {
-        emit errorOccured("Error getting server pubkey hash.");
-        return false;
+///
+/// \brief SSHWrapper::sftp_list_dirs lists several directories with their requests in flight
+/// together, each is reported in batches as its entries arrive. Falls back to one after another when
+/// the server will not open a second SFTP channel.
+///
+void SSHWrapper::sftp_list_dirs(const QStringList &directories)
+{
+    if (!requireSession())
+    {
+        for (const QString &directory : directories)
+        {
+            emit sftpListingFailed(directory);
+        }
+        return;
     }
-
-
-    state = ssh_session_is_known_server(session);
-    switch (state) {
-    case SSH_KNOWN_HOSTS_OK:
-        /* OK */
-
-        break;
-    case SSH_KNOWN_HOSTS_CHANGED:
+    QSet<QString> finished;
+    bool ok = false;
+    if (openPipeline())
     {
-        hexa = ssh_get_hexa(hash, hlen);
-        QMessageBox msgBox;
-        msgBox.setText(QString("Host key for server changed it is now:\n%1\nFor security reasons, connection will be stopped.").arg(QString::fromUtf8(hexa)));
-        msgBox.setIcon(QMessageBox::Critical);
-        msgBox.exec();
-        emit errorOccured("Host key changed.");
-        ssh_string_free_char(hexa);
-
-        ssh_clean_pubkey_hash(&hash);
-        return false;
+        ok = pipeline->list(directories, [this, &finished](const QString &directory, const QList<SFTPEntry> &entries, ListingPipeline::Progress progress, qint64 mtime) {
+            if (progress != ListingPipeline::Partial)
+            {
+                finished.insert(directory);
+            }
+            switch (progress)
+            {
+            case ListingPipeline::Partial:
+                emit sftpEntriesListed(entries, directory, false, -1);
+                break;
+            case ListingPipeline::Complete:
+                emit sftpEntriesListed(entries, directory, true, mtime);
+                break;
+            case ListingPipeline::Failed:
+                emit sftpListingFailed(directory);
+                emit errorOccured(QString("Directory not opened: %1").arg(directory));
+                break;
+            }
+        });
+        if (double ratio = compressibility(pipeline->sample()))
+        {
+            emit trafficSampled(0, ratio, credentials.compressionLevel);
+        }
     }
-    case SSH_KNOWN_HOSTS_OTHER:
+    if (ok)
     {
-        QMessageBox msgBox;
-        msgBox.setText("The host key for this server was not ofund but an other type of key exists. An attacker might change the default server key to confuse your client into thinking the key does not exits.");
-        msgBox.setIcon(QMessageBox::Critical);
-        msgBox.exec();
-        emit errorOccured("Host key other.");
-
-        ssh_clean_pubkey_hash(&hash);
-
-        return false;
+        health->noteActivity();
+        return;
     }
-    case SSH_KNOWN_HOSTS_NOT_FOUND:
-        /* FALL THROUGH to SSH_SERVER_NOT_KNOWN behavior */
-
-    case SSH_KNOWN_HOSTS_UNKNOWN:
+    // A directory cut off halfway is listed again in full, its tree node is still taking batches.
+    for (const QString &directory : directories)
     {
-        hexa = ssh_get_hexa(hash, hlen);
-        QMessageBox msgBox;
-        msgBox.setText(QString("The server is unkown. Do you trust the host key?\nPublic key hash: %1").arg(QString::fromUtf8(hexa)));
-        msgBox.setIcon(QMessageBox::Warning);
-        msgBox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
-        msgBox.setDefaultButton(QMessageBox::No);
-
-        ssh_string_free_char(hexa);
-        ssh_clean_pubkey_hash(&hash);
-
-        if (msgBox.exec() ==  QMessageBox::No)
+        if (!finished.contains(directory))
         {
-            return false;
+            sftp_list_dir(directory);
         }
+    }
+}
 
-        rc = ssh_session_update_known_hosts(session);
-        if (rc < 0) {
-            emit errorOccured(QString("Error %1\n").arg(strerror(errno)));
-            return false;
+///
+/// \brief SSHWrapper::sftp_stat_dirs reports the mtime of each directory, -1 for the ones that
+/// could not be statted. Tells whether a listing is still current without listing again.
+///
+void SSHWrapper::sftp_stat_dirs(const QStringList &directories)
+{
+    if (!requireSession())
+    {
+        return;
+    }
+    QHash<QString, qint64> mtimes;
+    bool ok = false;
+    if (openPipeline())
+    {
+        ok = pipeline->stat(directories, [&mtimes](const QString &directory, qint64 mtime) {
+            mtimes.insert(directory, mtime);
+        });
+    }
+    for (const QString &directory : directories)
+    {
+        if (mtimes.contains(directory))
+        {
+            continue;
         }
-
-        break;
+        sftp_attributes attributes = sftp_stat(sftp, directory.toUtf8().constData());
+        mtimes.insert(directory, attributes ? qint64(attributes->mtime) : -1);
+        sftp_attributes_free(attributes);
     }
-    case SSH_KNOWN_HOSTS_ERROR:
-        emit errorOccured(QString("Error %1\n").arg(ssh_get_error(session)));
-        ssh_clean_pubkey_hash(&hash);
-        return false;
+    if (ok)
+    {
+        health->noteActivity();
     }
+    emit sftpDirectoriesStatted(mtimes);
+}
 
-    ssh_clean_pubkey_hash(&hash);
-    return true;
+///
+/// \brief SSHWrapper::openPipeline opens the listing pipeline on first use.
+/// \return false if the server will not open a second SFTP channel, it is not asked again.
+///
+bool SSHWrapper::openPipeline()
+{
+    if (!pipeline && !pipelineRefused)
+    {
+        pipeline = new ListingPipeline(session);
+        if (!pipeline->open())
+        {
+            qDebug() << "Listing one directory at a time:" << pipeline->errorString();
+            delete pipeline;
+            pipeline = nullptr;
+            pipelineRefused = true;
+        }
+    }
+    return pipeline != nullptr;
 }
 
 void SSHWrapper::onRequestFile(const QString& remotePath)
 {
     QFileInfo remoteFile(remotePath);
-    QString tempPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation) + "/SSHExplorer";
+    // One directory per host, so files of the same name on two hosts don't overwrite each other.
+    QString hostDir = credentials.scope().replace(':', '_');
+    QString tempPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation) + "/SSHExplorer/" + hostDir;
 
     qDebug() << "Requesting remote file:" << remotePath;
-
-    sftp_file file = nullptr;
-    int fd = -1;
-    char buffer[MAX_XFER_BUF_SIZE];
-    int nbytes = 0, nwritten = 0, rc = 0;
-
-    // Open remote file for reading
-    file = sftp_open(sftp, remotePath.toUtf8().constData(), O_RDONLY, 0);
-    if (!file) {
-        QString errMsg = QString("Can't open remote file '%1' for reading: %2")
-        .arg(remotePath, ssh_get_error(session));
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
+    if (!requireSession())
+    {
         return;
     }
 
     QString localFilename = "local_" + remoteFile.fileName();
     QString localPath = tempPath + "/" + localFilename;
-    QFile localFile(localPath);
-    QFileInfo fileInfo(localFile);
+    QFileInfo fileInfo(localPath);
     QDir dir;
     if (!dir.mkpath(fileInfo.absolutePath())) {
         qWarning() << "Failed to create directory:" << fileInfo.absolutePath();
     }
-    if (!localFile.open(QIODevice::Truncate | QIODevice::WriteOnly | QIODevice::Text))
+
+    SftpTransfer transfer(session, sftp);
+    transfer.setJournalScope(credentials.scope());
+    transfer.setCancelFlag(&transfersCancelled);
+    if (!transfer.download(remotePath, localPath))
     {
-        QString errMsg = QString("Can't open file '%1' for writing: %2").arg(localPath, localFile.errorString());
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
+        emit errorOccured(transfer.errorString());
+        rememberIfInterrupted({InterruptedTransfer::Open, remotePath, localPath});
         return;
     }
-
-    while (true) {
-        nbytes = sftp_read(file, buffer, sizeof(buffer));
-        if (nbytes == 0) {
-            // EOF
-            break;
-        } else if (nbytes < 0) {
-            QString errMsg = QString("Error reading remote file '%1': %2")
-            .arg(remotePath, ssh_get_error(session));
-            qDebug() << errMsg;
-            emit errorOccured(errMsg);
-            sftp_close(file);
-            localFile.close();
-            if (!localFile.remove())
-            {
-                qDebug() << QString("Failed to remove file: '%1'").arg(localPath);
-            }
-            return;
-        }
-
-        nwritten = localFile.write(buffer, nbytes);
-        if (nwritten != nbytes) {
-            QString errMsg = QString("Error writing to local file '%1': %2")
-            .arg(localPath, strerror(errno));
-            qDebug() << errMsg;
-            emit errorOccured(errMsg);
-            sftp_close(file);
-            localFile.close();
-            if (!localFile.remove())
-            {
-                qDebug() << QString("Failed to remove file: '%1'").arg(localPath);
-            }
-            return;
-        }
-    }
-
-    rc = sftp_close(file);
-    if (rc != SSH_OK) {
-        QString errMsg = QString("Can't close remote file '%1': %2")
-        .arg(remotePath, ssh_get_error(session));
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
+    if (!transfer.errorString().isEmpty())
+    {
+        emit errorOccured(transfer.errorString());
     }
 
-    localFile.close();
-
     qDebug() << "Successfully downloaded " << remotePath << " to " << localPath;
+    sampleTransfer(transfer.stats());
+    emit transferFinished(transfer.stats());
     emit fileReceived(localPath, remotePath);
 }
 
-void SSHWrapper::onSendFile(const QString& localPath, const QString& remotePath)
+///
+/// \brief SSHWrapper::onDownloadFile saves a remote file to localPath without opening it.
+/// \param streams Number of sessions the file is split over, 1 uses this session only.
+///
+void SSHWrapper::onDownloadFile(const QString& remotePath, const QString& localPath, quint64 size, int streams)
 {
-    QFileInfo localFileInfo(localPath);
-    QFile localFile(localPath);
-    char buffer[MAX_XFER_BUF_SIZE];
-    int nbytes = 0, nwritten = 0, rc = 0;
-
-    qDebug() << "Sending local file:" << localPath << "to remote path:" << remotePath;
-
-    if (!localFile.open(QIODevice::ReadOnly)) {
-        QString errMsg = QString("Can't open local file '%1' for reading: %2")
-        .arg(localPath, localFile.errorString());
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
+    qDebug() << "Downloading remote file:" << remotePath << "to" << localPath << "over" << streams << "stream(s)";
+    if (!requireSession())
+    {
         return;
     }
 
-    int access_type = O_WRONLY | O_CREAT | O_TRUNC;
-    sftp_file file = sftp_open(sftp, remotePath.toUtf8().constData(), access_type, 0);
-    if (!file) {
-        QString errMsg = QString("Can't open remote file '%1' for writing: %2")
-        .arg(remotePath, ssh_get_error(session));
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
-        localFile.close();
-        return;
+    QFileInfo fileInfo(localPath);
+    QDir dir;
+    if (!dir.mkpath(fileInfo.absolutePath())) {
+        qWarning() << "Failed to create directory:" << fileInfo.absolutePath();
     }
 
-    while (!localFile.atEnd()) {
-        nbytes = localFile.read(buffer, sizeof(buffer));
-        if (nbytes < 0) {
-            QString errMsg = QString("Error reading local file '%1': %2")
-            .arg(localPath, localFile.errorString());
-            qDebug() << errMsg;
-            emit errorOccured(errMsg);
-            sftp_close(file);
-            localFile.close();
+    InterruptedTransfer retry{InterruptedTransfer::Download, remotePath, localPath, size, streams};
+    TransferStats stats;
+    sftp_attributes attributes = streams > 1 ? sftp_stat(sftp, remotePath.toUtf8().constData()) : nullptr;
+    if (attributes)
+    {
+        // The journal of a split download is keyed on what the file looks like now.
+        quint64 currentSize = attributes->size;
+        qint64 mtime = attributes->mtime;
+        sftp_attributes_free(attributes);
+
+        ParallelDownload transfer(credentials, streams);
+        transfer.setCancelFlag(&transfersCancelled);
+        if (!transfer.run(remotePath, localPath, currentSize, mtime))
+        {
+            emit errorOccured(transfer.errorString());
+            rememberIfInterrupted(retry);
             return;
         }
-
-        nwritten = sftp_write(file, buffer, nbytes);
-        if (nwritten != nbytes) {
-            QString errMsg = QString("Error writing to remote file '%1': %2")
-            .arg(remotePath, ssh_get_error(session));
-            qDebug() << errMsg;
-            emit errorOccured(errMsg);
-            sftp_close(file);
-            localFile.close();
+        stats = transfer.stats();
+    }
+    else
+    {
+        SftpTransfer transfer(session, sftp);
+        transfer.setJournalScope(credentials.scope());
+        transfer.setCancelFlag(&transfersCancelled);
+        if (!transfer.download(remotePath, localPath))
+        {
+            emit errorOccured(transfer.errorString());
+            rememberIfInterrupted(retry);
             return;
         }
+        stats = transfer.stats();
+    }
+
+    sampleTransfer(stats);
+    emit transferFinished(stats);
+    emit fileDownloaded(localPath, remotePath);
+}
+
+void SSHWrapper::onSendFile(const QString& localPath, const QString& remotePath)
+{
+    qDebug() << "Sending local file:" << localPath << "to remote path:" << remotePath;
+    if (!requireSession())
+    {
+        return;
     }
 
-    rc = sftp_close(file);
-    if (rc != SSH_OK) {
-        QString errMsg = QString("Can't close remote file '%1': %2")
-        .arg(remotePath, ssh_get_error(session));
-        qDebug() << errMsg;
-        emit errorOccured(errMsg);
+    // Small edits to big files only send the blocks that changed.
+    DeltaUpload delta(session, sftp);
+    delta.setCancelFlag(&transfersCancelled);
+    DeltaUpload::Result result = delta.run(localPath, remotePath);
+    if (result == DeltaUpload::Done)
+    {
+        qDebug() << "Successfully uploaded changes of " << localPath << " to " << remotePath;
+        health->noteActivity();
+        emit transferFinished(delta.stats());
+        return;
+    }
+    if (result == DeltaUpload::Failed)
+    {
+        emit errorOccured(delta.errorString());
+        rememberIfInterrupted({InterruptedTransfer::Upload, remotePath, localPath});
+        return;
     }
 
-    localFile.close();
+    SftpTransfer transfer(session, sftp);
+    transfer.setJournalScope(credentials.scope());
+    transfer.setCancelFlag(&transfersCancelled);
+    if (!transfer.upload(localPath, remotePath))
+    {
+        emit errorOccured(transfer.errorString());
+        rememberIfInterrupted({InterruptedTransfer::Upload, remotePath, localPath});
+        return;
+    }
+    if (!transfer.errorString().isEmpty())
+    {
+        emit errorOccured(transfer.errorString());
+    }
 
     qDebug() << "Successfully uploaded " << localPath << " to " << remotePath;
+    sampleTransfer(transfer.stats());
+    emit transferFinished(transfer.stats());
 }
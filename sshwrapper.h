@@ -1,12 +1,16 @@
 #ifndef SSHWRAPPER_H
 #define SSHWRAPPER_H
 #include <QObject>
+#include <QHash>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
-#include <QMessageBox>
-#include <QInputDialog>
-#include <QTimer>
+#include "sftptransfer.h"
+#include "sessionhealth.h"
+#include "sessionconnector.h"
 #include <fcntl.h>
+#include <atomic>
+
+class ListingPipeline;
 
 #define S_IRUSR 0400
 #define S_IWUSR 0200
@@ -18,6 +22,10 @@
 #define S_IWOTH 0002
 #define S_IXOTH 0001
 
+// Entries per sftpEntriesListed, big directories arrive in several batches.
+#define FIRST_LISTING_BATCH_SIZE 100
+#define LISTING_BATCH_SIZE 2000
+
 struct SFTPEntry {
     QString path;
     QString name;
@@ -28,10 +36,35 @@ struct SFTPEntry {
     quint32 gid;
     quint32 permissions;
     quint64 createtime = 0;
-    QString mtimeString;
+    qint64 mtime = 0; // Seconds since the epoch, formatted only when shown.
     bool isDirectory;
 };
 
+///
+/// \brief Everything needed to open another session to a host that was already verified.
+///
+struct SessionCredentials {
+    QString user;
+    QString host;
+    quint16 port = 22;
+    QString password; // Empty when public key authentication succeeded.
+    int compressionLevel = 0; // zlib level the browse session negotiated, 0 for none.
+
+    QString scope() const { return QString("%1@%2:%3").arg(user, host).arg(port); }
+};
+
+///
+/// \brief A transfer cut off by a dropped session, replayed after the next connect to the same host.
+///
+struct InterruptedTransfer {
+    enum Kind { Open, Download, Upload };
+    Kind kind;
+    QString remotePath;
+    QString localPath;
+    quint64 size = 0;
+    int streams = 1;
+};
+
 class SSHWrapper : public QObject
 {
     Q_OBJECT
@@ -39,26 +72,66 @@ public:
     explicit SSHWrapper(QObject *parent = nullptr);
     void clearSession();
 
+    static bool openAuxiliarySession(const SessionCredentials &credentials, ssh_session *sessionOut, sftp_session *sftpOut, QString *error);
+    static void closeAuxiliarySession(ssh_session session, sftp_session sftp);
+    // Thread safe, the running transfer fails at its next reply. Used before the thread is stopped.
+    void cancelTransfers() { transfersCancelled = true; }
+
     ~SSHWrapper();
 private:
     ssh_session session;
     sftp_session sftp;
-    QTimer* statusTimer;
-    bool verify_knownhost();
+    SessionCredentials credentials;
+    SessionHealth* health;
+    SessionConnector* connector;
+    ListingPipeline* pipeline = nullptr;
+    bool pipelineRefused = false; // The server would not open a second SFTP channel.
+    std::atomic<bool> transfersCancelled{false};
+    SessionCredentials pendingCredentials;
+    void onConnected();
+    void onConnectFailed(const QString &message, bool cancelled);
 
-    bool sessionSeen = false;
+    QString interruptedScope;
+    QList<InterruptedTransfer> interrupted;
+    void rememberIfInterrupted(const InterruptedTransfer &transfer);
+    void sampleTransfer(const TransferStats &stats);
+    void resumeInterrupted();
+    bool requireSession();
+    bool openPipeline();
 signals:
     void errorOccured(const QString &message);
-    void sftpEntriesListed(const QList<SFTPEntry> &entries, const QString &directory);
+    // mtime is the directory's own when it was listed, -1 if unknown.
+    void sftpEntriesListed(const QList<SFTPEntry> &entries, const QString &directory, bool complete, qint64 mtime);
+    void sftpListingFailed(const QString &directory);
+    void sftpDirectoriesStatted(const QHash<QString, qint64> &mtimes);
     void connectionStatus(bool status, bool newConnection = false);
+    void authenticated(const SessionCredentials &credentials);
+    void trafficSampled(double bytesPerSecond, double ratio, int compressionLevel);
+    void rttMeasured(double ms);
+    void connectPhase(const QString &phase);
+    void hostKeyPrompt(const QString &message);
+    void passwordPrompt(const QString &prompt);
+    void connectFailed(const QString &message, bool cancelled);
+    void connectTimed(const ConnectTimings &timings);
+    void homeResolved(const QString &home);
     void fileReceived(const QString& localPath, const QString& remotePath);
+    void fileDownloaded(const QString& localPath, const QString& remotePath);
+    void transferFinished(const TransferStats &stats);
 
 public slots:
     void sftp_list_dir(const QString &directory);
-    void connectSession(const QString& user, const QString& host, const quint16& port);
+    void sftp_list_dirs(const QStringList &directories);
+    void sftp_stat_dirs(const QStringList &directories);
+    void resolveHome();
+    void connectSession(const QString& user, const QString& host, const quint16& port, int compressionLevel = 0, const QString &preferredAuth = QString(), bool interactive = true);
+    void attachSession(const SessionCredentials &credentials);
+    void cancelConnect();
+    void answerHostKey(bool trusted);
+    void answerPassword(const QString &password, bool accepted);
     void onRequestFile(const QString& remotePath);
+    void onDownloadFile(const QString& remotePath, const QString& localPath, quint64 size, int streams);
     void onSendFile(const QString& localPath, const QString& remotePath);
-    void checkConnection();
+    void setKeepaliveInterval(int seconds);
 };
 
 #endif // SSHWRAPPER_H
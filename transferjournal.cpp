@@ -0,0 +1,226 @@
+#include "transferjournal.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Bound how much work a crash can lose without rewriting the journal on every chunk.
+#define SAVE_INTERVAL_MS 1000
+#define SAVE_INTERVAL_BYTES (8 * 1024 * 1024)
+
+TransferJournal::TransferJournal(const QString &scope, const QString &remotePath, const QString &localPath, bool upload)
+    : remotePath(remotePath), localPath(localPath), upload(upload)
+{
+    QString key = QString("%1\n%2\n%3\n%4").arg(scope, upload ? "up" : "down", remotePath, localPath);
+    QString name = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex() + ".json";
+    path = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/journals/" + name;
+    lastSave.start();
+}
+
+bool TransferJournal::load()
+{
+    QMutexLocker locker(&mutex);
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    if (root.value("remote").toString() != remotePath || root.value("local").toString() != localPath)
+    {
+        return false;
+    }
+
+    size = root.value("size").toString().toULongLong();
+    mtime = root.value("mtime").toString().toLongLong();
+    ranges.clear();
+    for (const QJsonValue &value : root.value("ranges").toArray())
+    {
+        QJsonArray range = value.toArray();
+        ranges.append(ByteRange(range.at(0).toString().toULongLong(), range.at(1).toString().toULongLong()));
+    }
+    return true;
+}
+
+void TransferJournal::start(quint64 size, qint64 mtime)
+{
+    QMutexLocker locker(&mutex);
+    this->size = size;
+    this->mtime = mtime;
+    ranges.clear();
+    unsavedBytes = 0;
+}
+
+bool TransferJournal::matches(quint64 size, qint64 mtime) const
+{
+    QMutexLocker locker(&mutex);
+    return this->size == size && this->mtime == mtime;
+}
+
+///
+/// \brief TransferJournal::commit marks [offset, offset + length) as safely written.
+///
+void TransferJournal::commit(quint64 offset, quint64 length)
+{
+    QMutexLocker locker(&mutex);
+    ByteRange added(offset, offset + length);
+    int index = std::lower_bound(ranges.begin(), ranges.end(), added) - ranges.begin();
+    ranges.insert(index, added);
+
+    // Merge with the neighbours it touches.
+    if (index > 0 && ranges[index - 1].second >= ranges[index].first)
+    {
+        ranges[index - 1].second = std::max(ranges[index - 1].second, ranges[index].second);
+        ranges.removeAt(index);
+        index--;
+    }
+    while (index + 1 < ranges.size() && ranges[index + 1].first <= ranges[index].second)
+    {
+        ranges[index].second = std::max(ranges[index].second, ranges[index + 1].second);
+        ranges.removeAt(index + 1);
+    }
+
+    unsavedBytes += length;
+    if (unsavedBytes >= SAVE_INTERVAL_BYTES || lastSave.elapsed() >= SAVE_INTERVAL_MS)
+    {
+        locker.unlock();
+        save(true);
+    }
+}
+
+void TransferJournal::save(bool force)
+{
+    QMutexLocker locker(&mutex);
+    if (!force && unsavedBytes == 0)
+    {
+        return;
+    }
+    // A range only counts once its bytes are on disk, a journal ahead of the data would make a
+    // resume skip what a crash lost. Uploads write to the host, their ranges are done when acknowledged.
+    if (!upload && !syncLocal())
+    {
+        qDebug() << "Can't sync" << localPath << ", transfer journal not saved.";
+        return;
+    }
+
+    // Sizes are stored as strings, JSON numbers lose precision past 2^53.
+    QJsonArray jsonRanges;
+    for (const ByteRange &range : ranges)
+    {
+        jsonRanges.append(QJsonArray{QString::number(range.first), QString::number(range.second)});
+    }
+    QJsonObject root;
+    root.insert("remote", remotePath);
+    root.insert("local", localPath);
+    root.insert("upload", upload);
+    root.insert("size", QString::number(size));
+    root.insert("mtime", QString::number(mtime));
+    root.insert("ranges", jsonRanges);
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "Can't write transfer journal" << path << file.errorString();
+        return;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    if (!file.commit())
+    {
+        qDebug() << "Can't write transfer journal" << path << file.errorString();
+        return;
+    }
+    unsavedBytes = 0;
+    lastSave.restart();
+}
+
+///
+/// \brief TransferJournal::syncLocal flushes the downloaded file to disk. The page cache belongs to
+/// the file, so a descriptor of its own covers what every stream wrote, mapped pages included.
+/// Streams write unbuffered, nothing of a committed range is left in a QFile buffer.
+///
+bool TransferJournal::syncLocal() const
+{
+    QFile file(localPath);
+    if (!file.open(QIODevice::ReadWrite))
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(file.handle()) == 0;
+#else
+    return fdatasync(file.handle()) == 0;
+#endif
+}
+
+void TransferJournal::remove()
+{
+    QMutexLocker locker(&mutex);
+    ranges.clear();
+    QFile::remove(path);
+}
+
+quint64 TransferJournal::committedBytes() const
+{
+    QMutexLocker locker(&mutex);
+    quint64 total = 0;
+    for (const ByteRange &range : ranges)
+    {
+        total += range.second - range.first;
+    }
+    return total;
+}
+
+quint64 TransferJournal::committedPrefix() const
+{
+    QMutexLocker locker(&mutex);
+    if (ranges.isEmpty() || ranges.first().first != 0)
+    {
+        return 0;
+    }
+    return ranges.first().second;
+}
+
+///
+/// \brief TransferJournal::missing lists the parts of [start, end) not committed yet.
+///
+QList<ByteRange> TransferJournal::missing(quint64 start, quint64 end) const
+{
+    QMutexLocker locker(&mutex);
+    QList<ByteRange> gaps;
+    quint64 cursor = start;
+    for (const ByteRange &range : ranges)
+    {
+        if (range.second <= cursor)
+        {
+            continue;
+        }
+        if (range.first >= end)
+        {
+            break;
+        }
+        if (range.first > cursor)
+        {
+            gaps.append(ByteRange(cursor, range.first));
+        }
+        cursor = std::max(cursor, range.second);
+    }
+    if (cursor < end)
+    {
+        gaps.append(ByteRange(cursor, end));
+    }
+    return gaps;
+}
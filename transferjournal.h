@@ -0,0 +1,53 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include <QString>
+#include <QList>
+#include <QPair>
+#include <QMutex>
+#include <QElapsedTimer>
+
+typedef QPair<quint64, quint64> ByteRange; // [first, second)
+
+///
+/// \brief The TransferJournal class records which byte ranges of a transfer already
+/// reached their destination, so an interrupted transfer can pick up where it stopped.
+/// The journal is a small JSON file keyed by host, direction and both paths. It is only
+/// trusted while the source still has the size and mtime it had when the transfer started.
+/// Commits may come from several threads.
+///
+class TransferJournal
+{
+public:
+    TransferJournal(const QString &scope, const QString &remotePath, const QString &localPath, bool upload);
+
+    bool load();
+    void start(quint64 size, qint64 mtime);
+    bool matches(quint64 size, qint64 mtime) const;
+
+    void commit(quint64 offset, quint64 length);
+    void save(bool force = false);
+    void remove();
+
+    quint64 committedBytes() const;
+    quint64 committedPrefix() const;
+    QList<ByteRange> missing(quint64 start, quint64 end) const;
+
+private:
+    QString path;
+    QString remotePath;
+    QString localPath;
+    bool upload;
+
+    quint64 size = 0;
+    qint64 mtime = 0;
+    QList<ByteRange> ranges; // Sorted and merged.
+
+    mutable QMutex mutex;
+    QElapsedTimer lastSave;
+    quint64 unsavedBytes = 0;
+
+    bool syncLocal() const;
+};
+
+#endif // TRANSFERJOURNAL_H
@@ -0,0 +1,266 @@
+#include "transfermanager.h"
+#include <QDebug>
+#include <QDeadlineTimer>
+#include <QFileInfo>
+#include <QSettings>
+#include <algorithm>
+
+#define DEFAULT_CONCURRENCY 4
+#define STOP_TIMEOUT_MS 2000 // Longest the GUI thread waits for cancelled workers.
+
+TransferManager::TransferManager(QObject *parent)
+    : QObject{parent}
+{
+    maxWorkers = QSettings().value("transfers/concurrency", DEFAULT_CONCURRENCY).toInt();
+}
+
+TransferManager::~TransferManager()
+{
+    stopWorkers();
+}
+
+///
+/// \brief TransferManager::setCredentials points the workers at a newly connected host.
+/// Jobs already queued for the previous host are dropped.
+///
+void TransferManager::setCredentials(const SessionCredentials &credentials)
+{
+    stopWorkers();
+    for (int id : queue)
+    {
+        jobsById.remove(id);
+    }
+    queue.clear();
+    this->credentials = credentials;
+    hasCredentials = true;
+    emit stateChanged();
+}
+
+void TransferManager::setConcurrency(int workers)
+{
+    maxWorkers = std::max(1, workers);
+    QSettings().setValue("transfers/concurrency", maxWorkers);
+    pump();
+}
+
+int TransferManager::activeCount() const
+{
+    int active = 0;
+    for (const Worker &worker : workers)
+    {
+        if (worker.jobId != -1)
+        {
+            active++;
+        }
+    }
+    return active;
+}
+
+double TransferManager::bytesPerSecond() const
+{
+    if (!busyTimer.isValid() || busyTimer.elapsed() <= 0)
+    {
+        return 0;
+    }
+    return busyBytes * 1000.0 / busyTimer.elapsed();
+}
+
+void TransferManager::download(const QString &remotePath, const QString &localPath, bool directory, quint64 size)
+{
+    TransferJob job;
+    job.direction = TransferJob::Download;
+    job.remotePath = remotePath;
+    job.localPath = localPath;
+    job.directory = directory;
+    job.size = size;
+    enqueue(job);
+}
+
+void TransferManager::upload(const QString &localPath, const QString &remotePath)
+{
+    TransferJob job;
+    job.direction = TransferJob::Upload;
+    job.remotePath = remotePath;
+    job.localPath = localPath;
+    job.directory = QFileInfo(localPath).isDir();
+    job.size = QFileInfo(localPath).size();
+    enqueue(job);
+}
+
+void TransferManager::clearFinished()
+{
+    for (auto it = jobsById.begin(); it != jobsById.end();)
+    {
+        if (it->state == TransferJob::Finished || it->state == TransferJob::Failed)
+        {
+            it = jobsById.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    finished = 0;
+    failed = 0;
+    emit stateChanged();
+}
+
+void TransferManager::enqueue(TransferJob job)
+{
+    if (!hasCredentials)
+    {
+        emit errorOccured("Not connected, can't queue transfer.");
+        return;
+    }
+    job.id = nextId++;
+    job.state = TransferJob::Queued;
+    jobsById.insert(job.id, job);
+    // Expanding a directory feeds the queue, so it goes ahead of single files.
+    if (job.directory)
+    {
+        queue.prepend(job.id);
+    }
+    else
+    {
+        queue.enqueue(job.id);
+    }
+    pump();
+    emit stateChanged();
+}
+
+void TransferManager::startWorkers()
+{
+    while (workers.size() < maxWorkers)
+    {
+        QThread *thread = new QThread(this);
+        TransferWorker *worker = new TransferWorker(credentials);
+        connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+        worker->moveToThread(thread);
+        connect(worker, &TransferWorker::jobFinished, this, &TransferManager::onJobFinished);
+        connect(worker, &TransferWorker::jobsDiscovered, this, &TransferManager::onJobsDiscovered);
+        thread->start();
+        workers.append({thread, worker, -1});
+    }
+}
+
+///
+/// \brief TransferManager::stopWorkers cancels the running jobs and ends the worker threads.
+/// Workers notice the cancel at their next reply. One stuck on a link that stopped answering
+/// is not waited for beyond STOP_TIMEOUT_MS, its thread is left to finish and delete itself.
+///
+void TransferManager::stopWorkers()
+{
+    for (Worker &worker : workers)
+    {
+        worker.worker->cancel();
+        worker.thread->requestInterruption();
+        worker.thread->quit();
+        if (worker.jobId != -1 && jobsById.contains(worker.jobId))
+        {
+            // No longer Active, so whatever the worker still reports for it is ignored.
+            jobsById[worker.jobId].state = TransferJob::Failed;
+            jobsById[worker.jobId].error = "Cancelled";
+            failed++;
+        }
+    }
+    QDeadlineTimer deadline(STOP_TIMEOUT_MS);
+    for (Worker &worker : workers)
+    {
+        if (worker.thread->wait(deadline))
+        {
+            delete worker.thread;
+            continue;
+        }
+        qDebug() << "Transfer worker did not stop in time, leaving it to finish on its own.";
+        worker.thread->setParent(nullptr);
+        connect(worker.thread, &QThread::finished, worker.thread, &QObject::deleteLater);
+        if (worker.thread->isFinished())
+        {
+            worker.thread->deleteLater();
+        }
+    }
+    workers.clear();
+}
+
+///
+/// \brief TransferManager::pump hands queued jobs to idle workers, up to the concurrency limit.
+///
+void TransferManager::pump()
+{
+    if (!hasCredentials || queue.isEmpty())
+    {
+        return;
+    }
+    startWorkers();
+
+    for (int i = 0; i < workers.size() && !queue.isEmpty(); i++)
+    {
+        Worker &worker = workers[i];
+        if (worker.jobId != -1 || i >= maxWorkers)
+        {
+            continue;
+        }
+        if (activeCount() == 0)
+        {
+            busyTimer.start();
+            busyBytes = 0;
+        }
+        TransferJob &job = jobsById[queue.dequeue()];
+        job.state = TransferJob::Active;
+        worker.jobId = job.id;
+        TransferWorker *transferWorker = worker.worker;
+        QMetaObject::invokeMethod(transferWorker, [transferWorker, job]() {
+            transferWorker->runJob(job);
+        }, Qt::QueuedConnection);
+    }
+}
+
+void TransferManager::onJobFinished(const TransferJob &job)
+{
+    for (Worker &worker : workers)
+    {
+        if (worker.jobId == job.id)
+        {
+            worker.jobId = -1;
+        }
+    }
+    // Dropped with the queue or cancelled by stopWorkers, already accounted for.
+    auto it = jobsById.constFind(job.id);
+    if (it == jobsById.cend() || it->state != TransferJob::Active)
+    {
+        return;
+    }
+
+    jobsById[job.id] = job;
+    if (job.state == TransferJob::Finished)
+    {
+        finished++;
+        busyBytes += job.stats.bytes;
+    }
+    else
+    {
+        failed++;
+        emit errorOccured(job.error);
+    }
+    emit jobFinished(job);
+    pump();
+    emit stateChanged();
+}
+
+void TransferManager::onJobsDiscovered(int directoryJobId, const QList<TransferJob> &jobs)
+{
+    // Late results of a directory walk that was cancelled, possibly on another host.
+    if (jobsById.value(directoryJobId).state != TransferJob::Active)
+    {
+        return;
+    }
+    for (TransferJob job : jobs)
+    {
+        job.id = nextId++;
+        job.state = TransferJob::Queued;
+        jobsById.insert(job.id, job);
+        queue.enqueue(job.id);
+    }
+    pump();
+    emit stateChanged();
+}
@@ -0,0 +1,76 @@
+#ifndef TRANSFERMANAGER_H
+#define TRANSFERMANAGER_H
+
+#include "transferworker.h"
+#include <QObject>
+#include <QMap>
+#include <QQueue>
+#include <QThread>
+#include <QElapsedTimer>
+
+///
+/// \brief The TransferManager class queues file and directory transfers and runs them on a
+/// bounded number of worker sessions. Directories are expanded by a worker into one job per
+/// file, so a large tree keeps every worker busy instead of moving one file per click.
+///
+class TransferManager : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TransferManager(QObject *parent = nullptr);
+    ~TransferManager();
+
+    void setCredentials(const SessionCredentials &credentials);
+    void setConcurrency(int workers);
+    int concurrency() const { return maxWorkers; }
+
+    int queuedCount() const { return queue.size(); }
+    int activeCount() const;
+    int finishedCount() const { return finished; }
+    int failedCount() const { return failed; }
+    double bytesPerSecond() const;
+    QList<TransferJob> jobs() const { return jobsById.values(); }
+
+public slots:
+    void download(const QString &remotePath, const QString &localPath, bool directory, quint64 size = 0);
+    void upload(const QString &localPath, const QString &remotePath);
+    void clearFinished();
+
+signals:
+    void stateChanged();
+    void jobFinished(const TransferJob &job);
+    void errorOccured(const QString &message);
+
+private slots:
+    void onJobFinished(const TransferJob &job);
+    void onJobsDiscovered(int directoryJobId, const QList<TransferJob> &jobs);
+
+private:
+    struct Worker {
+        QThread *thread;
+        TransferWorker *worker;
+        int jobId;
+    };
+
+    SessionCredentials credentials;
+    bool hasCredentials = false;
+    int maxWorkers;
+    QList<Worker> workers;
+
+    QMap<int, TransferJob> jobsById;
+    QQueue<int> queue;
+    int nextId = 1;
+    int finished = 0;
+    int failed = 0;
+
+    // Aggregate throughput over the current busy period.
+    QElapsedTimer busyTimer;
+    quint64 busyBytes = 0;
+
+    void enqueue(TransferJob job);
+    void startWorkers();
+    void stopWorkers();
+    void pump();
+};
+
+#endif // TRANSFERMANAGER_H
@@ -0,0 +1,237 @@
+#include "transferworker.h"
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QQueue>
+
+// Discovered files are handed to the manager in batches so the queue fills while walking.
+#define DISCOVERY_BATCH_SIZE 256
+// Paths named in the error of a directory job, the rest are only counted.
+#define MAX_REPORTED_PATHS 5
+
+///
+/// \brief describePaths names the first few paths of a list and counts the rest.
+///
+static QString describePaths(const QStringList &paths)
+{
+    QString text = paths.mid(0, MAX_REPORTED_PATHS).join(", ");
+    if (paths.size() > MAX_REPORTED_PATHS)
+    {
+        text += QString(" and %1 more").arg(paths.size() - MAX_REPORTED_PATHS);
+    }
+    return text;
+}
+
+TransferWorker::TransferWorker(const SessionCredentials &credentials, QObject *parent)
+    : QObject{parent}, credentials(credentials)
+{
+}
+
+TransferWorker::~TransferWorker()
+{
+    dropSession();
+}
+
+bool TransferWorker::ensureSession(QString *error)
+{
+    if (session && ssh_is_connected(session))
+    {
+        return true;
+    }
+    dropSession();
+    return SSHWrapper::openAuxiliarySession(credentials, &session, &sftp, error);
+}
+
+void TransferWorker::dropSession()
+{
+    SSHWrapper::closeAuxiliarySession(session, sftp);
+    session = nullptr;
+    sftp = nullptr;
+}
+
+void TransferWorker::runJob(TransferJob job)
+{
+    QString error = "Cancelled";
+    bool ok = !cancelled && ensureSession(&error);
+    if (ok && job.directory)
+    {
+        ok = job.direction == TransferJob::Download ? expandDownload(job, &error) : expandUpload(job, &error);
+    }
+    else if (ok)
+    {
+        SftpTransfer transfer(session, sftp);
+        transfer.setJournalScope(credentials.scope());
+        transfer.setCancelFlag(&cancelled);
+        if (job.direction == TransferJob::Download)
+        {
+            QDir().mkpath(QFileInfo(job.localPath).absolutePath());
+            ok = transfer.download(job.remotePath, job.localPath);
+        }
+        else
+        {
+            ok = transfer.upload(job.localPath, job.remotePath);
+        }
+        error = transfer.errorString();
+        job.stats = transfer.stats();
+    }
+
+    if (!ok && session && !ssh_is_connected(session))
+    {
+        dropSession();
+    }
+    job.state = ok ? TransferJob::Finished : TransferJob::Failed;
+    job.error = ok ? QString() : error;
+    emit jobFinished(job);
+}
+
+///
+/// \brief TransferWorker::expandDownload walks a remote tree breadth first, creates the local
+/// directories and reports one download job per file. A subdirectory that can't be opened is
+/// noted and the walk goes on without it. Entries that are neither files nor directories, e.g.
+/// symbolic links, are skipped. Either makes the job fail once the walk is done, naming them.
+///
+bool TransferWorker::expandDownload(const TransferJob &job, QString *error)
+{
+    QQueue<QPair<QString, QString>> directories;
+    directories.enqueue({job.remotePath, job.localPath});
+    QList<TransferJob> found;
+    QStringList unreadable;
+    QStringList skipped;
+
+    while (!directories.isEmpty() && !cancelled)
+    {
+        QPair<QString, QString> next = directories.dequeue();
+        QString remoteDir = next.first.endsWith('/') ? next.first : next.first + "/";
+        QString localDir = next.second;
+        QDir().mkpath(localDir);
+
+        sftp_dir dir = sftp_opendir(sftp, remoteDir.toUtf8().constData());
+        if (!dir)
+        {
+            if (next.first == job.remotePath || !ssh_is_connected(session))
+            {
+                *error = QString("Directory not opened: %1").arg(remoteDir);
+                return false;
+            }
+            qDebug() << "Directory not opened:" << remoteDir << ssh_get_error(session);
+            unreadable.append(remoteDir);
+            continue;
+        }
+        sftp_attributes attributes;
+        while ((attributes = sftp_readdir(sftp, dir)) != NULL)
+        {
+            QString name = QString::fromUtf8(attributes->name);
+            if (name == "." || name == "..")
+            {
+                sftp_attributes_free(attributes);
+                continue;
+            }
+            QString remotePath = remoteDir + name;
+            QString localPath = localDir + "/" + name;
+            if (attributes->type == SSH_FILEXFER_TYPE_DIRECTORY)
+            {
+                directories.enqueue({remotePath, localPath});
+            }
+            else if (attributes->type == SSH_FILEXFER_TYPE_REGULAR)
+            {
+                TransferJob file;
+                file.direction = TransferJob::Download;
+                file.remotePath = remotePath;
+                file.localPath = localPath;
+                file.size = attributes->size;
+                found.append(file);
+            }
+            else
+            {
+                skipped.append(remotePath);
+            }
+            sftp_attributes_free(attributes);
+
+            if (found.size() >= DISCOVERY_BATCH_SIZE)
+            {
+                emit jobsDiscovered(job.id, found);
+                found.clear();
+            }
+        }
+        sftp_closedir(dir);
+    }
+
+    if (!found.isEmpty())
+    {
+        emit jobsDiscovered(job.id, found);
+    }
+    if (cancelled)
+    {
+        *error = "Cancelled";
+        return false;
+    }
+    QStringList problems;
+    if (!unreadable.isEmpty())
+    {
+        problems.append(QString("%1 directories not opened: %2").arg(unreadable.size()).arg(describePaths(unreadable)));
+    }
+    if (!skipped.isEmpty())
+    {
+        problems.append(QString("%1 links or special files skipped: %2").arg(skipped.size()).arg(describePaths(skipped)));
+    }
+    if (!problems.isEmpty())
+    {
+        *error = QString("Download of %1 is incomplete, %2.").arg(job.remotePath, problems.join("; "));
+        return false;
+    }
+    return true;
+}
+
+///
+/// \brief TransferWorker::expandUpload creates the remote directories of a local tree and
+/// reports one upload job per file.
+///
+bool TransferWorker::expandUpload(const TransferJob &job, QString *error)
+{
+    QDir root(job.localPath);
+    QList<TransferJob> found;
+
+    // Existing directories are fine, anything else shows up when the files fail.
+    sftp_mkdir(sftp, job.remotePath.toUtf8().constData(), 0755);
+
+    QDirIterator it(job.localPath, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        QString remotePath = job.remotePath + "/" + root.relativeFilePath(info.filePath());
+        if (info.isDir())
+        {
+            sftp_mkdir(sftp, remotePath.toUtf8().constData(), 0755);
+            continue;
+        }
+        if (!info.isFile())
+        {
+            continue;
+        }
+        TransferJob file;
+        file.direction = TransferJob::Upload;
+        file.remotePath = remotePath;
+        file.localPath = info.filePath();
+        file.size = info.size();
+        found.append(file);
+
+        if (found.size() >= DISCOVERY_BATCH_SIZE)
+        {
+            emit jobsDiscovered(job.id, found);
+            found.clear();
+        }
+    }
+
+    if (!found.isEmpty())
+    {
+        emit jobsDiscovered(job.id, found);
+    }
+    if (!ssh_is_connected(session))
+    {
+        *error = QString("Connection lost while creating %1").arg(job.remotePath);
+        return false;
+    }
+    return true;
+}
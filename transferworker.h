@@ -0,0 +1,57 @@
+#ifndef TRANSFERWORKER_H
+#define TRANSFERWORKER_H
+
+#include "sshwrapper.h"
+#include "sftptransfer.h"
+#include <QObject>
+#include <atomic>
+
+struct TransferJob {
+    enum Direction { Download, Upload };
+    enum State { Queued, Active, Finished, Failed };
+
+    int id = 0;
+    Direction direction = Download;
+    QString remotePath;
+    QString localPath;
+    quint64 size = 0;
+    bool directory = false; // Expanded into one job per file by the worker.
+    State state = Queued;
+    QString error;
+    TransferStats stats;
+};
+
+///
+/// \brief The TransferWorker class runs queued transfers on its own session and thread.
+/// The session is opened on first use from the credentials of the browsing session.
+///
+class TransferWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TransferWorker(const SessionCredentials &credentials, QObject *parent = nullptr);
+    ~TransferWorker();
+
+    // Thread safe, the running job fails at its next reply and no further job starts.
+    void cancel() { cancelled = true; }
+
+public slots:
+    void runJob(TransferJob job);
+
+signals:
+    void jobFinished(const TransferJob &job);
+    void jobsDiscovered(int directoryJobId, const QList<TransferJob> &jobs);
+
+private:
+    SessionCredentials credentials;
+    ssh_session session = nullptr;
+    sftp_session sftp = nullptr;
+    std::atomic<bool> cancelled{false};
+
+    bool ensureSession(QString *error);
+    void dropSession();
+    bool expandDownload(const TransferJob &job, QString *error);
+    bool expandUpload(const TransferJob &job, QString *error);
+};
+
+#endif // TRANSFERWORKER_H